@@ -0,0 +1,105 @@
+//Grouping files by size the way findDuplicates does it:
+//sorting the FileInfo objects versus radix sorting compact keys.
+//Usage: groupingBench [number of files, default 10M]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "DataStructs.h"
+#include "RadixSort.h"
+
+namespace
+{
+
+std::vector<FileInfo> makeFiles(size_t numFiles)
+{
+	//log like sizes, many small files and a long tail
+	std::mt19937_64 rng(42);
+	std::lognormal_distribution<double> sizes(9.0, 2.5);
+
+	std::vector<FileInfo> files;
+	files.reserve(numFiles);
+	for(size_t idx = 0; idx < numFiles; ++idx)
+	{
+		files.emplace_back(static_cast<FileInfo::FileSizeType>(sizes(rng)), static_cast<DirTreeNodeRef>(idx));
+	}
+	return files;
+}
+
+template <typename F>
+double measureMs(F&& work)
+{
+	auto start = std::chrono::steady_clock::now();
+	work();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+size_t groupObjects(std::vector<FileInfo>& files)
+{
+	size_t groups = 0;
+	auto sizeSorter = [](const FileInfo& left, const FileInfo& right) { return left.size_ < right.size_; };
+	std::sort(files.begin(), files.end(), sizeSorter);
+	for(auto it = files.begin(); it != files.end();)
+	{
+		auto range = std::equal_range(it, files.end(), *it, sizeSorter);
+		groups += std::distance(range.first, range.second) > 1;
+		it = range.second;
+	}
+	return groups;
+}
+
+size_t groupKeys(std::vector<FileInfo>& files)
+{
+	size_t groups = 0;
+	std::vector<SortKey> keys;
+	keys.reserve(files.size());
+	for(uint32_t idx = 0; idx < files.size(); ++idx)
+	{
+		keys.push_back({files[idx].size_, idx});
+	}
+	radixSort(keys);
+
+	for(size_t first = 0; first < keys.size();)
+	{
+		size_t last = first + 1;
+		while(last < keys.size() && keys[last].key_ == keys[first].key_)
+		{
+			++last;
+		}
+		groups += last - first > 1;
+		first = last;
+	}
+	return groups;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	static constexpr int ROUNDS = 3;
+
+	size_t numFiles = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000;
+
+	//best of the rounds, each run gets a freshly built file list
+	double objectMs = 1e100, keyMs = 1e100;
+	size_t objectGroups = 0, keyGroups = 0;
+	for(int round = 0; round < ROUNDS; ++round)
+	{
+		{
+			auto files = makeFiles(numFiles);
+			objectMs = std::min(objectMs, measureMs([&]() { objectGroups = groupObjects(files); }));
+		}
+		{
+			auto files = makeFiles(numFiles);
+			keyMs = std::min(keyMs, measureMs([&]() { keyGroups = groupKeys(files); }));
+		}
+	}
+
+	std::cout << numFiles << " files, best of " << ROUNDS << '\n';
+	std::cout << "std::sort FileInfo + equal_range: " << objectMs << " ms, " << objectGroups << " groups\n";
+	std::cout << "radix sort keys + linear pass:    " << keyMs << " ms, " << keyGroups << " groups\n";
+
+	return objectGroups == keyGroups ? 0 : 1;
+}
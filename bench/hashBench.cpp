@@ -0,0 +1,95 @@
+//XXH3 of the hash kernel variants the CPU runs: streaming XXH3-128 as
+//the full hash and ContentHasher use it, one shot XXH3-64 of the 64KB
+//blocks of the partial hash.
+//Usage: hashBench [MB of data, default 1024]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "hash/HashKernels.h"
+
+namespace
+{
+
+template <typename F>
+double measureMs(F&& work)
+{
+	auto start = std::chrono::steady_clock::now();
+	work();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	static constexpr int ROUNDS = 3;
+	static constexpr size_t CHUNK_SIZE = (1U << 20U); //the IO_BUFFER_SIZE updates
+	static constexpr size_t BLOCK_SIZE = (1U << 16U); //HASH_BUFFER_SIZE
+
+	size_t megabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024;
+
+	//a small buffer reused, mostly from the cache,
+	//so the hashing is measured and not the memory
+	static constexpr size_t DATA_CHUNKS = 4;
+	std::vector<char> data(DATA_CHUNKS * CHUNK_SIZE);
+	std::mt19937_64 rng(42);
+	std::generate(data.begin(), data.end(), [&rng]() { return static_cast<char>(rng()); });
+	size_t numChunks = megabytes;
+
+	std::cout << megabytes << " MB, best of " << ROUNDS << '\n';
+	Hash128 reference{};
+	bool allEqual = true;
+
+	for(size_t n = 0; n < HashKernels::numSupported(); ++n)
+	{
+		const auto& kernels = HashKernels::supported(n);
+
+		double streamMs = 1e100, blockMs = 1e100;
+		Hash128 hash{};
+		XXH64_hash_t blockHashes = 0;
+		for(int round = 0; round < ROUNDS; ++round)
+		{
+			streamMs = std::min(streamMs, measureMs([&]()
+			{
+				void* pState = kernels.createState_();
+				kernels.reset_(pState);
+				for(size_t chunk = 0; chunk < numChunks; ++chunk)
+				{
+					kernels.update_(pState, data.data() + (chunk % DATA_CHUNKS) * CHUNK_SIZE, CHUNK_SIZE);
+				}
+				hash = kernels.digest_(pState);
+				kernels.freeState_(pState);
+			}));
+
+			blockMs = std::min(blockMs, measureMs([&]()
+			{
+				blockHashes = 0;
+				size_t numBlocks = numChunks * (CHUNK_SIZE / BLOCK_SIZE);
+				size_t blocksInData = data.size() / BLOCK_SIZE;
+				for(size_t block = 0; block < numBlocks; ++block)
+				{
+					blockHashes ^= kernels.hash64_(data.data() + (block % blocksInData) * BLOCK_SIZE, BLOCK_SIZE, 113);
+				}
+			}));
+		}
+
+		if(n == 0)
+		{
+			reference = hash;
+		}
+		allEqual = allEqual && XXH128_isEqual(reference, hash);
+
+		std::cout << kernels.name_ << ":\tXXH3-128 stream " << megabytes / streamMs * 1000 / 1024 << " GB/s, "
+			<< "XXH3-64 64KB blocks " << megabytes / blockMs * 1000 / 1024 << " GB/s\n";
+	}
+
+	if(!allEqual)
+	{
+		std::cout << "The variants disagree!\n";
+	}
+
+	return allEqual ? 0 : 1;
+}
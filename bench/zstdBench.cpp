@@ -0,0 +1,173 @@
+//Compressed pack and unpack through the zstd stream buffers: file records
+//written and read the way writeFile and unpackFiles do it, a few small
+//header fields and the payload in IO_BUFFER_SIZE pieces. The legacy rows
+//use the std::streambuf xsputn/xsgetn, i.e. everything goes through the
+//buffers in overflow/underflow sized pieces.
+//Usage: zstdBench [MB of data, default 512]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Compression.h"
+
+bool verbose{false};
+bool quiet{true};
+
+namespace
+{
+
+constexpr size_t IO_BUFFER_SIZE = (1U << 20U);
+constexpr size_t FILE_SIZE = (1U << 22U); //4MB
+
+class LegacyOStreamBuf : public ZstdOStreamBuf
+{
+public:
+	using ZstdOStreamBuf::ZstdOStreamBuf;
+
+protected:
+	std::streamsize xsputn(const char* s, std::streamsize n) override { return std::streambuf::xsputn(s, n); }
+};
+
+class LegacyIStreamBuf : public ZstdIStreamBuf
+{
+public:
+	using ZstdIStreamBuf::ZstdIStreamBuf;
+
+protected:
+	std::streamsize xsgetn(char* s, std::streamsize n) override { return std::streambuf::xsgetn(s, n); }
+};
+
+//the compressed archive only counted
+class NullBuf : public std::streambuf
+{
+protected:
+	int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+	std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+std::string makeLogs(size_t size)
+{
+	std::mt19937_64 rng(42);
+	static const char* LEVELS[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+	std::string text;
+	text.reserve(size + 256);
+	for(uint64_t line = 0; text.size() < size; ++line)
+	{
+		text += "2024-05-01T02:" + std::to_string(line / 60 % 60) + ':' + std::to_string(line % 60) + ' ';
+		text += LEVELS[rng() % 4];
+		text += " worker-" + std::to_string(rng() % 32) + " request " + std::to_string(rng()) + " done in "
+			+ std::to_string(rng() % 1000) + " ms\n";
+	}
+	text.resize(size);
+	return text;
+}
+
+void writeRecords(std::ostream& out, const std::string& data)
+{
+	for(size_t fileStart = 0; fileStart < data.size(); fileStart += FILE_SIZE)
+	{
+		//names, size, flags, mtime and the hash after the data
+		char header[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+		out.write(header, 1);
+		out.write(header, 4);
+		out.write(header, 1);
+		out.write(header, 8);
+		size_t fileEnd = std::min(data.size(), fileStart + FILE_SIZE);
+		for(size_t pos = fileStart; pos < fileEnd; pos += IO_BUFFER_SIZE)
+		{
+			out.write(data.data() + pos, std::min(IO_BUFFER_SIZE, fileEnd - pos));
+		}
+		out.write(header, 8);
+		out.write(header, 8);
+	}
+	out.flush();
+}
+
+bool readRecords(std::istream& in, size_t size)
+{
+	std::vector<char> buffer(IO_BUFFER_SIZE);
+	char header[8];
+	for(size_t fileStart = 0; fileStart < size; fileStart += FILE_SIZE)
+	{
+		in.read(header, 1);
+		in.read(header, 4);
+		in.read(header, 1);
+		in.read(header, 8);
+		size_t fileEnd = std::min(size, fileStart + FILE_SIZE);
+		for(size_t pos = fileStart; pos < fileEnd; pos += IO_BUFFER_SIZE)
+		{
+			in.read(buffer.data(), std::min(IO_BUFFER_SIZE, fileEnd - pos));
+		}
+		in.read(header, 8);
+		in.read(header, 8);
+	}
+	return static_cast<bool>(in);
+}
+
+template <typename F>
+double measureMs(F&& work)
+{
+	auto start = std::chrono::steady_clock::now();
+	work();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename OBuf, typename IBuf>
+void run(const char* label, const std::string& data, const std::string& compressed, size_t bufferSize)
+{
+	static constexpr int ROUNDS = 3;
+
+	double packMs = 1e100, unpackMs = 1e100;
+	bool readOk = true;
+	for(int round = 0; round < ROUNDS; ++round)
+	{
+		packMs = std::min(packMs, measureMs([&]()
+		{
+			NullBuf nullBuf;
+			std::ostream sink(&nullBuf);
+			OBuf zstdBuf(sink, 0, bufferSize);
+			std::ostream out(&zstdBuf);
+			writeRecords(out, data);
+		}));
+
+		unpackMs = std::min(unpackMs, measureMs([&]()
+		{
+			std::istringstream source(compressed);
+			IBuf zstdBuf(source, bufferSize);
+			std::istream in(&zstdBuf);
+			readOk = readRecords(in, data.size()) && readOk;
+		}));
+	}
+
+	double megabytes = data.size() / 1e6;
+	std::cerr << label << " buffer " << (bufferSize >> 10U) << " KB:\tpack " << megabytes / packMs * 1000
+		<< " MB/s, unpack " << megabytes / unpackMs * 1000 << " MB/s" << (readOk ? "" : " READ FAILED") << '\n';
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	size_t megabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 512;
+	auto data = makeLogs(megabytes << 20U);
+
+	std::ostringstream compressedOut;
+	{
+		ZstdOStreamBuf zstdBuf(compressedOut);
+		std::ostream out(&zstdBuf);
+		writeRecords(out, data);
+	}
+	auto compressed = compressedOut.str();
+
+	//the results on stderr, the stream buffers report on stdout
+	std::cerr << megabytes << " MB of logs, " << compressed.size() / 1e6 << " MB compressed, best of 3\n";
+	run<LegacyOStreamBuf, LegacyIStreamBuf>("legacy", data, compressed, 0);
+	run<ZstdOStreamBuf, ZstdIStreamBuf>("bulk  ", data, compressed, 0);
+	run<ZstdOStreamBuf, ZstdIStreamBuf>("bulk  ", data, compressed, IO_BUFFER_SIZE);
+
+	return 0;
+}
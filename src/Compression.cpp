@@ -1,14 +1,22 @@
+//ZSTD_decompressBound
+#define ZSTD_STATIC_LINKING_ONLY
 #include "Compression.h"
+#include "ThreadPool.h"
 #include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <stdexcept>
 
 extern bool verbose;
+extern bool quiet;
 
-ZstdOStreamBuf::ZstdOStreamBuf(std::ostream &sink):
+ZstdOStreamBuf::ZstdOStreamBuf(std::ostream &sink, size_t frameSize, size_t bufferSize):
 	outFileStrb_(sink),
 	cctx_(ZSTD_createCCtx()),
-	inBuf_(ZSTD_CStreamInSize()),
-	outBuf_(ZSTD_CStreamOutSize())
+	inBuf_(bufferSize ? bufferSize : ZSTD_CStreamInSize()),
+	outBuf_(std::max(ZSTD_CStreamOutSize(), bufferSize)),
+	frameSize_(frameSize)
 {
 	assert(cctx_ != nullptr);
 
@@ -51,11 +59,46 @@ int ZstdOStreamBuf::sync()
 	return 0;
 }
 
+std::streamsize ZstdOStreamBuf::xsputn(const char* s, std::streamsize n)
+{
+	// the small writes (record headers, varints) are gathered
+	if (n <= epptr() - pptr())
+	{
+		std::memcpy(pptr(), s, n);
+		pbump(static_cast<int>(n));
+		return n;
+	}
+
+	// the gathered input goes first to keep the order
+	if (flushInput(ZSTD_e_continue) == false)
+	{
+		return 0;
+	}
+
+	if (n < epptr() - pptr())
+	{
+		std::memcpy(pptr(), s, n);
+		pbump(static_cast<int>(n));
+		return n;
+	}
+
+	return compress(s, n, ZSTD_e_continue) ? n : 0;
+}
+
 bool ZstdOStreamBuf::flushInput(ZSTD_EndDirective mode)
 {
-	char* inData = inBuf_.data();
-	auto inSize = pptr() - pbase();
-	ZSTD_inBuffer input{ inData, static_cast<size_t>(inSize), 0 };
+	auto inSize = static_cast<size_t>(pptr() - pbase());
+
+	// this acutally resets the put pointer
+	setp(pbase(), epptr());
+
+	return compress(pbase(), inSize, mode);
+}
+
+// Compresses the data, the frame is ended once it has frameSize_ input bytes
+bool ZstdOStreamBuf::compress(const char* data, size_t size, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer input{ data, size, 0 };
 
 	while (input.pos < input.size)
 	{
@@ -69,14 +112,30 @@ bool ZstdOStreamBuf::flushInput(ZSTD_EndDirective mode)
 		}
 	}
 
-	// this acutally resets the put pointer
-	setp(pbase(), epptr());
+	frameBytes_ += size;
+
+	if (frameSize_ > 0 && frameBytes_ >= frameSize_)
+	{
+		return endFrame();
+	}
+
 	return true;
 }
 
-void ZstdOStreamBuf::flushStreamEnd()
+bool ZstdOStreamBuf::closeFrame()
+{
+	if (pptr() > pbase() && flushInput(ZSTD_e_continue) == false)
+	{
+		return false;
+	}
+
+	//flushInput could have just ended it
+	return frameBytes_ == 0 || endFrame();
+}
+
+// Closes the current frame, the next input starts a new one
+bool ZstdOStreamBuf::endFrame()
 {
-	// end-of-stream: send final frame
 	bool done = false;
     ZSTD_inBuffer emptyInput{ nullptr, 0, 0 };
 	while (!done)
@@ -86,9 +145,19 @@ void ZstdOStreamBuf::flushStreamEnd()
 		assert(!ZSTD_isError(ret));
 		if (output.pos > 0) {
 			outFileStrb_.write((char*)output.dst, output.pos);
+			if (!outFileStrb_) return false;
 		}
 		if (ret == 0) done = true;
 	}
+
+	frameBytes_ = 0;
+	return true;
+}
+
+void ZstdOStreamBuf::flushStreamEnd()
+{
+	// end-of-stream: send final frame
+	endFrame();
 	outFileStrb_.flush();
 
 	std::cout << "Compression completed.\n";
@@ -97,10 +166,10 @@ void ZstdOStreamBuf::flushStreamEnd()
 
 
 
-ZstdIStreamBuf::ZstdIStreamBuf(std::istream &source):
+ZstdIStreamBuf::ZstdIStreamBuf(std::istream &source, size_t bufferSize):
 	inFileStrb_(source),
 	dctx_(ZSTD_createDCtx()),
-	inBuf_(ZSTD_DStreamInSize()),
+	inBuf_(bufferSize ? bufferSize : ZSTD_DStreamInSize()),
 	outBuf_(ZSTD_DStreamOutSize())
 {
 	assert(dctx_);
@@ -116,14 +185,63 @@ ZstdIStreamBuf::~ZstdIStreamBuf()
 {
 	ZSTD_freeDCtx(dctx_);
 
-	std::cout << "Decompression completed.\n";
+	if(!quiet) std::cout << "Decompression completed.\n";
 };
 
 ZstdIStreamBuf::int_type ZstdIStreamBuf::underflow()
 {
 	if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
 
-	ZSTD_outBuffer output{ outBuf_.data(), outBuf_.size(), 0 };
+	size_t produced = decompress(outBuf_.data(), outBuf_.size());
+	if (produced == 0)
+	{
+		return traits_type::eof();
+	}
+
+	// Set get area pointers
+	setg(outBuf_.data(), outBuf_.data(), outBuf_.data() + produced);
+
+	return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize ZstdIStreamBuf::xsgetn(char* s, std::streamsize n)
+{
+	// the rest of the get area first
+	std::streamsize done = std::min<std::streamsize>(n, egptr() - gptr());
+	std::memcpy(s, gptr(), done);
+	gbump(static_cast<int>(done));
+
+	while (done < n)
+	{
+		// the small reads are served from the get area
+		if (n - done < static_cast<std::streamsize>(outBuf_.size()))
+		{
+			if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+			{
+				break;
+			}
+			std::streamsize chunk = std::min<std::streamsize>(n - done, egptr() - gptr());
+			std::memcpy(s + done, gptr(), chunk);
+			gbump(static_cast<int>(chunk));
+			done += chunk;
+			continue;
+		}
+
+		size_t produced = decompress(s + done, n - done);
+		if (produced == 0)
+		{
+			break;
+		}
+		done += produced;
+	}
+
+	return done;
+}
+
+// Decompresses at least one byte into dst, 0 at the end of the data
+size_t ZstdIStreamBuf::decompress(char* dst, size_t size)
+{
+	ZSTD_outBuffer output{ dst, size, 0 };
 
 	while(output.pos == 0)
 	{
@@ -137,7 +255,7 @@ ZstdIStreamBuf::int_type ZstdIStreamBuf::underflow()
 				//end of data but ZSD has still something to write
 				//This should not happen
 				assert(lastZSTDret_ == 0);
-                return traits_type::eof();
+                return 0;
             }
         }
 
@@ -145,8 +263,230 @@ ZstdIStreamBuf::int_type ZstdIStreamBuf::underflow()
         assert(!ZSTD_isError(lastZSTDret_));
 	}
 
-	// Set get area pointers
-	setg(outBuf_.data(), outBuf_.data(), outBuf_.data() + output.pos);
+	return output.pos;
+}
 
-	return traits_type::to_int_type(*gptr());
+
+
+
+ZstdParallelIStreamBuf::ZstdParallelIStreamBuf(std::istream &source, unsigned numThreads):
+	inFileStrb_(source),
+	pool_(std::make_unique<ThreadPool>(numThreads)),
+	maxInFlight_(2 * pool_->size())
+{
+	if(verbose) std::cout << "ZstdParallelIStreamBuf: threads=" << pool_->size() << ", maxInFlight=" << maxInFlight_ << '\n';
+
+	setg(nullptr, nullptr, nullptr);
+}
+
+ZstdParallelIStreamBuf::~ZstdParallelIStreamBuf()
+{
+	// the pool waits for the queued frames
+	inFlight_.clear();
+	pool_.reset();
+
+	if(!quiet) std::cout << "Decompression completed.\n";
+}
+
+bool ZstdParallelIStreamBuf::readNextFrame(std::vector<char>& frame)
+{
+	while (true)
+	{
+		size_t available = pending_.size() - pendingPos_;
+		if (available > 0)
+		{
+			const char* start = pending_.data() + pendingPos_;
+			unsigned long long contentSize = ZSTD_getFrameContentSize(start, available);
+			if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR
+					&& contentSize > MAX_FRAME_SIZE)
+			{
+				startStreaming();
+				return false;
+			}
+
+			size_t frameSize = ZSTD_findFrameCompressedSize(start, available);
+			if (!ZSTD_isError(frameSize))
+			{
+				// without a content size the bound comes from the number of blocks
+				if (ZSTD_decompressBound(start, frameSize) > MAX_FRAME_SIZE)
+				{
+					startStreaming();
+					return false;
+				}
+
+				frame.assign(start, start + frameSize);
+				pendingPos_ += frameSize;
+				return true;
+			}
+
+			if (available >= MAX_FRAME_SIZE)
+			{
+				startStreaming();
+				return false;
+			}
+		}
+
+		if (inputEof_)
+		{
+			if (available > 0)
+			{
+				throw std::runtime_error("Truncated or corrupted zstd frame");
+			}
+			return false;
+		}
+
+		// dropping the consumed frames, then at least doubling what is buffered
+		pending_.erase(pending_.begin(), pending_.begin() + pendingPos_);
+		pendingPos_ = 0;
+
+		size_t oldSize = pending_.size();
+		size_t toRead = std::max(ZSTD_DStreamInSize(), std::min(oldSize, MAX_FRAME_SIZE - oldSize));
+		pending_.resize(oldSize + toRead);
+		inFileStrb_.read(pending_.data() + oldSize, toRead);
+		pending_.resize(oldSize + inFileStrb_.gcount());
+
+		if (static_cast<size_t>(inFileStrb_.gcount()) < toRead)
+		{
+			inputEof_ = true;
+		}
+	}
+}
+
+std::vector<char> ZstdParallelIStreamBuf::decompressFrame(const std::vector<char>& frame)
+{
+	// one decompression context per worker thread
+	thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+	ZSTD_DCtx_reset(dctx.get(), ZSTD_reset_session_only);
+
+	std::vector<char> out;
+	unsigned long long contentSize = ZSTD_getFrameContentSize(frame.data(), frame.size());
+	if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR)
+	{
+		out.reserve(contentSize);
+	}
+
+	ZSTD_inBuffer input{ frame.data(), frame.size(), 0 };
+	size_t ret = 1;
+	while (input.pos < input.size)
+	{
+		if (out.capacity() - out.size() < ZSTD_DStreamOutSize())
+		{
+			out.reserve(std::max(out.capacity() * 2, out.size() + ZSTD_DStreamOutSize()));
+		}
+
+		size_t oldSize = out.size();
+		out.resize(out.capacity());
+		ZSTD_outBuffer output{ out.data() + oldSize, out.size() - oldSize, 0 };
+
+		ret = ZSTD_decompressStream(dctx.get(), &output, &input);
+		out.resize(oldSize + output.pos);
+
+		if (ZSTD_isError(ret))
+		{
+			throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret));
+		}
+	}
+
+	if (ret != 0)
+	{
+		throw std::runtime_error("Incomplete zstd frame");
+	}
+
+	return out;
+}
+
+void ZstdParallelIStreamBuf::startStreaming()
+{
+	if (!dctx_)
+	{
+		dctx_.reset(ZSTD_createDCtx());
+	}
+	ZSTD_DCtx_reset(dctx_.get(), ZSTD_reset_session_only);
+	streaming_ = true;
+}
+
+// Decodes the next piece of the large frame into current_, streaming_
+// is cleared at the end of the frame
+void ZstdParallelIStreamBuf::decompressStreaming()
+{
+	current_.resize(ZSTD_DStreamOutSize());
+	ZSTD_outBuffer output{ current_.data(), current_.size(), 0 };
+
+	while (output.pos == 0 && streaming_)
+	{
+		if (pendingPos_ == pending_.size())
+		{
+			if (inputEof_)
+			{
+				throw std::runtime_error("Truncated or corrupted zstd frame");
+			}
+
+			pending_.resize(ZSTD_DStreamInSize());
+			inFileStrb_.read(pending_.data(), pending_.size());
+			pending_.resize(inFileStrb_.gcount());
+			pendingPos_ = 0;
+			inputEof_ = pending_.size() < ZSTD_DStreamInSize();
+			continue;
+		}
+
+		ZSTD_inBuffer input{ pending_.data(), pending_.size(), pendingPos_ };
+		size_t ret = ZSTD_decompressStream(dctx_.get(), &output, &input);
+		pendingPos_ = input.pos;
+
+		if (ZSTD_isError(ret))
+		{
+			throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret));
+		}
+		if (ret == 0)
+		{
+			streaming_ = false;
+		}
+	}
+
+	current_.resize(output.pos);
+}
+
+void ZstdParallelIStreamBuf::fillPipeline()
+{
+	while (!streaming_ && inFlight_.size() < maxInFlight_)
+	{
+		auto pFrame = std::make_shared<std::vector<char>>();
+		if (!readNextFrame(*pFrame))
+		{
+			return;
+		}
+
+		inFlight_.push_back(pool_->submit([pFrame]() { return decompressFrame(*pFrame); }));
+	}
+}
+
+ZstdParallelIStreamBuf::int_type ZstdParallelIStreamBuf::underflow()
+{
+	if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+	fillPipeline();
+
+	// the large frame is decoded after the frames queued before it
+	while (!inFlight_.empty() || streaming_)
+	{
+		if (!inFlight_.empty())
+		{
+			current_ = inFlight_.front().get();
+			inFlight_.pop_front();
+		}
+		else
+		{
+			decompressStreaming();
+		}
+		fillPipeline();
+
+		// skippable or empty frames produce no output
+		if (!current_.empty())
+		{
+			setg(current_.data(), current_.data(), current_.data() + current_.size());
+			return traits_type::to_int_type(*gptr());
+		}
+	}
+
+	return traits_type::eof();
 }
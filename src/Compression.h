@@ -1,29 +1,55 @@
+#include <array>
+#include <deque>
+#include <future>
+#include <memory>
 #include <streambuf>
 #include <vector>
 #include <zstd.h>
 
+class ThreadPool;
+
+//prefix of the compressed archives, zstd frames follow
+static constexpr std::array<char, 7> MAGIC_NUMBER_COMPRESS = {'M','Y','D','I','R','X','X'};
+
 class ZstdOStreamBuf : public std::streambuf
 {
 public:
-    // Constructor takes the target ostream (must outlive this buffer), and optional compression level
-    ZstdOStreamBuf(std::ostream &sink);
+    // Constructor takes the target ostream (must outlive this buffer), and optional frame size.
+    // A new independent zstd frame is started after every frameSize input bytes
+    // so the archive can be decompressed in parallel, 0 means a single frame.
+    // Writes smaller than bufferSize are gathered, 0 - ZSTD_CStreamInSize().
+    ZstdOStreamBuf(std::ostream &sink, size_t frameSize = 0, size_t bufferSize = 0);
 
     ~ZstdOStreamBuf() override;
 
+    // Compresses the pending input and ends the current frame, everything
+    // written so far can then be decompressed from the sink alone
+    bool closeFrame();
+
 protected:
     // overflow is called when put area is full or on explicit flush
     int_type overflow(int_type ch) override;
 
     int sync() override;
 
+    // Large writes are compressed straight from the caller buffer
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
 private:
     bool flushInput(ZSTD_EndDirective mode);
 
+    bool compress(const char* data, size_t size, ZSTD_EndDirective mode);
+
+    bool endFrame();
+
     void flushStreamEnd();
 
     std::ostream &outFileStrb_;
     ZSTD_CCtx *cctx_;
     std::vector<char> inBuf_, outBuf_;
+
+    size_t frameSize_{0};
+    size_t frameBytes_{0};
 };
 
 
@@ -31,8 +57,11 @@ private:
 class ZstdIStreamBuf : public std::streambuf
 {
 public:
-    // Constructor takes the source istream (must outlive this buffer)
-    explicit ZstdIStreamBuf(std::istream &source);
+    // Constructor takes the source istream (must outlive this buffer).
+    // The source is read in bufferSize pieces, 0 - ZSTD_DStreamInSize().
+    // The get area for the small reads stays ZSTD_DStreamOutSize(), what
+    // it holds is copied, the large reads bypass it.
+    explicit ZstdIStreamBuf(std::istream &source, size_t bufferSize = 0);
 
     ~ZstdIStreamBuf() override;
 
@@ -40,7 +69,12 @@ protected:
     // Called when get area is exhausted
     int_type underflow() override;
 
+    // Large reads are decompressed straight into the caller buffer
+    std::streamsize xsgetn(char* s, std::streamsize n) override;
+
 private:
+    size_t decompress(char* dst, size_t size);
+
     std::istream& inFileStrb_;
 	ZSTD_DCtx* dctx_;
     std::vector<char> inBuf_, outBuf_;
@@ -48,3 +82,49 @@ private:
 	ZSTD_inBuffer input_{};
 	size_t lastZSTDret_{0};
 };
+
+
+
+// Decompresses archives made of several independent frames on a thread pool.
+// Frame boundaries are found with ZSTD_findFrameCompressedSize, the frames are
+// decoded in parallel and delivered in order. At most maxInFlight frames are
+// buffered. A frame whose compressed or decompressed size may exceed
+// MAX_FRAME_SIZE is decoded piece by piece on the calling thread instead.
+// Single frame archives work too, just without the speedup.
+class ZstdParallelIStreamBuf : public std::streambuf
+{
+public:
+    // Constructor takes the source istream (must outlive this buffer)
+    ZstdParallelIStreamBuf(std::istream &source, unsigned numThreads);
+
+    ~ZstdParallelIStreamBuf() override;
+
+protected:
+    int_type underflow() override;
+
+private:
+    static constexpr size_t MAX_FRAME_SIZE = (1U << 26U); //64MB
+
+    bool readNextFrame(std::vector<char>& frame);
+    void fillPipeline();
+    void startStreaming();
+    void decompressStreaming();
+
+    static std::vector<char> decompressFrame(const std::vector<char>& frame);
+
+    std::istream& inFileStrb_;
+    std::unique_ptr<ThreadPool> pool_;
+    size_t maxInFlight_;
+
+    // compressed data read from the source, not yet split into frames
+    std::vector<char> pending_;
+    size_t pendingPos_{0};
+    bool inputEof_{false};
+
+    std::deque<std::future<std::vector<char>>> inFlight_;
+    std::vector<char> current_;
+
+    // the frame too large to be buffered, decoded from pending_
+    bool streaming_{false};
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx_{nullptr, &ZSTD_freeDCtx};
+};
@@ -0,0 +1,484 @@
+#include "ContentStore.h"
+#include "DataStructs.h"
+#include "FileIo.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
+#include <utility>
+#include <zstd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+extern bool verbose;
+
+namespace
+{
+//the hashes are uniformly distributed, the low half is a good enough key
+using HashKey = std::pair<uint64_t, uint64_t>;
+struct HashKeyHash
+{
+	size_t operator()(const HashKey& key) const { return key.first; }
+};
+using HashKeys = std::unordered_set<HashKey, HashKeyHash>;
+
+HashKey toKey(const Hash128& hash)
+{
+	return {hash.low64, hash.high64};
+}
+
+//the blob names, 32 hex digits of the canonical form
+bool fromHex(const std::string& text, Hash128& hash)
+{
+	XXH128_canonical_t canonical;
+	if(text.size() != sizeof(canonical.digest) * 2)
+	{
+		return false;
+	}
+
+	for(size_t i = 0; i < sizeof(canonical.digest); ++i)
+	{
+		unsigned byte = 0;
+		for(char ch : {text[2 * i], text[2 * i + 1]})
+		{
+			byte <<= 4U;
+			if(ch >= '0' && ch <= '9') byte |= ch - '0';
+			else if(ch >= 'a' && ch <= 'f') byte |= ch - 'a' + 10;
+			else return false;
+		}
+		canonical.digest[i] = static_cast<unsigned char>(byte);
+	}
+
+	hash = XXH128_hashFromCanonical(&canonical);
+	return true;
+}
+
+//blocking flock, the descriptor holds the lock until closed
+int lockFile(const fs::path& path, int operation)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+	if(fd >= 0 && ::flock(fd, operation) != 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+//Decompresses a blob for the unpacking, the verification and grep
+class BlobIStreamBuf : public std::streambuf
+{
+public:
+	explicit BlobIStreamBuf(const fs::path& path):
+		dctx_(ZSTD_createDCtx()),
+		inBuf_(ZSTD_DStreamInSize()),
+		outBuf_(ZSTD_DStreamOutSize())
+	{
+		file_.open(path, std::ios::in | std::ios::binary);
+		setg(outBuf_.data(), outBuf_.data(), outBuf_.data());
+	}
+
+	~BlobIStreamBuf() override
+	{
+		ZSTD_freeDCtx(dctx_);
+	}
+
+	bool isOpen() const { return file_.is_open(); }
+
+protected:
+	int_type underflow() override
+	{
+		if(gptr() < egptr())
+		{
+			return traits_type::to_int_type(*gptr());
+		}
+
+		ZSTD_outBuffer output{outBuf_.data(), outBuf_.size(), 0};
+		while(output.pos == 0)
+		{
+			if(input_.pos == input_.size)
+			{
+				file_.read(inBuf_.data(), inBuf_.size());
+				input_ = {inBuf_.data(), static_cast<size_t>(file_.gcount()), 0};
+				if(input_.size == 0)
+				{
+					return traits_type::eof();
+				}
+			}
+
+			if(ZSTD_isError(ZSTD_decompressStream(dctx_, &output, &input_)))
+			{
+				return traits_type::eof();
+			}
+		}
+
+		setg(outBuf_.data(), outBuf_.data(), outBuf_.data() + output.pos);
+		return traits_type::to_int_type(*gptr());
+	}
+
+private:
+	std::ifstream file_;
+	ZSTD_DCtx* dctx_;
+	std::vector<char> inBuf_, outBuf_;
+	ZSTD_inBuffer input_{nullptr, 0, 0};
+};
+
+class BlobStream : public std::istream
+{
+public:
+	explicit BlobStream(const fs::path& path):
+		std::istream(nullptr),
+		buf_(path)
+	{
+		if(buf_.isOpen())
+		{
+			rdbuf(&buf_);
+		}
+	}
+
+private:
+	BlobIStreamBuf buf_;
+};
+
+//adds the blobs listed in a refs file to keys
+bool readRefs(const fs::path& path, HashKeys& keys, const std::array<char, 8>& magicNumber)
+{
+	std::ifstream in(path, std::ios::binary);
+	std::array<char, 8> magicNumBuff{};
+	in.read(magicNumBuff.data(), magicNumBuff.size());
+	if(!in || magicNumBuff != magicNumber)
+	{
+		std::cerr << "Error: " << path << " is not a reference file.\n";
+		return false;
+	}
+
+	XXH128_canonical_t canonical;
+	while(in.read(reinterpret_cast<char*>(canonical.digest), sizeof(canonical.digest)))
+	{
+		keys.insert(toKey(XXH128_hashFromCanonical(&canonical)));
+	}
+
+	return in.eof() && in.gcount() == 0;
+}
+}
+
+ContentStore::ContentStore(const fs::path& dir):
+	dir_(dir)
+{
+}
+
+ContentStore::~ContentStore()
+{
+	if(lockFd_ >= 0)
+	{
+		::close(lockFd_);
+	}
+}
+
+bool ContentStore::open(bool create)
+{
+	std::error_code ec;
+	if(create)
+	{
+		fs::create_directories(dir_ / "blobs", ec);
+		fs::create_directories(dir_ / "tmp", ec);
+		fs::create_directories(dir_ / "refs", ec);
+	}
+
+	if(!fs::is_directory(dir_ / "blobs", ec))
+	{
+		std::cerr << "Error: " << dir_ << " is not a content store.\n";
+		return false;
+	}
+
+	lockFd_ = lockFile(dir_ / "lock", LOCK_SH);
+	if(lockFd_ < 0)
+	{
+		std::cerr << "Error: locking the store " << dir_ << " failed.\n";
+		return false;
+	}
+
+	return true;
+}
+
+std::string ContentStore::toHex(const Hash128& hash)
+{
+	XXH128_canonical_t canonical;
+	XXH128_canonicalFromHash(&canonical, hash);
+
+	static constexpr char digits[] = "0123456789abcdef";
+	std::string ret;
+	ret.reserve(sizeof(canonical.digest) * 2);
+	for(unsigned char byte : canonical.digest)
+	{
+		ret.push_back(digits[byte >> 4U]);
+		ret.push_back(digits[byte & 0xFU]);
+	}
+
+	return ret;
+}
+
+//256 subdirectories keep the directories small
+fs::path ContentStore::blobPath(const Hash128& hash) const
+{
+	auto name = toHex(hash);
+	return dir_ / "blobs" / name.substr(0, 2) / name;
+}
+
+fs::path ContentStore::refsPath(uint64_t archiveId) const
+{
+	static constexpr char digits[] = "0123456789abcdef";
+	std::string name(16, '0');
+	for(size_t pos = 16; pos-- > 0; archiveId >>= 4U)
+	{
+		name[pos] = digits[archiveId & 0xFU];
+	}
+	return dir_ / "refs" / name;
+}
+
+//unique across the hosts sharing the store
+fs::path ContentStore::tempPath() const
+{
+	std::array<char, 256> host{};
+	::gethostname(host.data(), host.size() - 1);
+	return dir_ / "tmp" / (std::string(host.data()) + '-' + std::to_string(::getpid()) + '-'
+			+ std::to_string(tempCounter_++));
+}
+
+bool ContentStore::contains(const Hash128& hash) const
+{
+	std::error_code ec;
+	return fs::exists(blobPath(hash), ec);
+}
+
+bool ContentStore::add(const fs::path& source, uint64_t size, Hash128& hash) const
+{
+	auto temp = tempPath();
+	SourceFile in(source);
+	ArchiveFile out(temp);
+	if(!in.good() || !out.good())
+	{
+		std::cerr << "Error: copying " << source << " to the store failed.\n";
+		return false;
+	}
+
+	ZSTD_CCtx* cctx = ZSTD_createCCtx();
+	std::vector<char> inBuf(std::min<uint64_t>(IO_BUFFER_SIZE, size));
+	std::vector<char> outBuf(ZSTD_CStreamOutSize());
+	ContentHasher hasher;
+	uint64_t remaining = size;
+	bool ok = true;
+
+	//the content hash is computed again, on what is really stored
+	ZSTD_EndDirective mode = ZSTD_e_continue;
+	while(ok && mode != ZSTD_e_end)
+	{
+		in.read(inBuf.data(), std::min<uint64_t>(inBuf.size(), remaining));
+		size_t bytesRead = in.gcount();
+		if(bytesRead == 0)
+		{
+			ok = false;
+			break;
+		}
+		remaining -= bytesRead;
+		hasher.update(inBuf.data(), bytesRead);
+
+		mode = (remaining == 0) ? ZSTD_e_end : ZSTD_e_continue;
+		ZSTD_inBuffer input{inBuf.data(), bytesRead, 0};
+		bool done = false;
+		while(ok && !done)
+		{
+			ZSTD_outBuffer output{outBuf.data(), outBuf.size(), 0};
+			size_t ret = ZSTD_compressStream2(cctx, &output, &input, mode);
+			ok = !ZSTD_isError(ret) && out.write(outBuf.data(), output.pos).good();
+			done = (mode == ZSTD_e_end) ? (ret == 0) : (input.pos == input.size);
+		}
+	}
+
+	ZSTD_freeCCtx(cctx);
+	in.close();
+	out.close();
+
+	std::error_code ec;
+	if(ok && out.good())
+	{
+		hash = hasher.digest(size);
+		auto path = blobPath(hash);
+		fs::create_directories(path.parent_path(), ec);
+		//another packing may have stored the same content meanwhile,
+		//replacing it is harmless
+		fs::rename(temp, path, ec);
+		if(!ec)
+		{
+			if(verbose) std::cout << "Stored " << source << " as " << path << '\n';
+			return true;
+		}
+	}
+
+	fs::remove(temp, ec);
+	std::cerr << "Error: storing " << source << " failed, was it modified?\n";
+	return false;
+}
+
+std::unique_ptr<std::istream> ContentStore::openBlob(const Hash128& hash) const
+{
+	auto pBlob = std::make_unique<BlobStream>(blobPath(hash));
+	if(!pBlob->rdbuf())
+	{
+		std::cerr << "Error: " << toHex(hash) << " is missing in the store " << dir_ << '\n';
+		return nullptr;
+	}
+	return pBlob;
+}
+
+bool ContentStore::addReferences(uint64_t archiveId, std::vector<Hash128> hashes) const
+{
+	if(hashes.empty())
+	{
+		return true;
+	}
+
+	//the new blobs must survive a crash before anything counts on them
+	if(::syncfs(lockFd_) != 0)
+	{
+		std::cerr << "Error: syncing the store " << dir_ << " failed.\n";
+		return false;
+	}
+
+	std::sort(hashes.begin(), hashes.end(), [](const Hash128& a, const Hash128& b)
+			{ return toKey(a) < toKey(b); });
+	hashes.erase(std::unique(hashes.begin(), hashes.end(), [](const Hash128& a, const Hash128& b)
+			{ return toKey(a) == toKey(b); }), hashes.end());
+
+	//written aside and renamed, a crash leaves no partial list
+	auto temp = tempPath();
+	ArchiveFile out(temp);
+	out.write(MAGIC_NUMBER_REFS.data(), MAGIC_NUMBER_REFS.size());
+	XXH128_canonical_t canonical;
+	for(const auto& hash : hashes)
+	{
+		XXH128_canonicalFromHash(&canonical, hash);
+		out.write(reinterpret_cast<const char*>(canonical.digest), sizeof(canonical.digest));
+	}
+
+	uint64_t size = 0;
+	bool ok = out.syncToDisk(size);
+	out.close();
+	std::error_code ec;
+	fs::create_directories(dir_ / "refs", ec);
+	fs::rename(temp, refsPath(archiveId), ec);
+	ok = ok && out.good() && !ec;
+
+	if(!ok)
+	{
+		fs::remove(temp, ec);
+		std::cerr << "Error: recording the references in " << dir_ << " failed.\n";
+	}
+	else if(verbose)
+	{
+		std::cout << "Store references added: " << hashes.size() << '\n';
+	}
+
+	return ok;
+}
+
+bool ContentStore::releaseReferences(uint64_t archiveId) const
+{
+	std::error_code ec;
+	if(!fs::remove(refsPath(archiveId), ec))
+	{
+		if(ec)
+		{
+			std::cerr << "Error: releasing the references in " << dir_ << " failed: " << ec.message() << '\n';
+			return false;
+		}
+		std::cout << "Store: the archive holds no references, released already?\n";
+		return true;
+	}
+
+	if(verbose) std::cout << "Store references released: " << refsPath(archiveId) << '\n';
+	return true;
+}
+
+bool ContentStore::collectGarbage()
+{
+	//open() took the lock shared
+	if(::flock(lockFd_, LOCK_EX | LOCK_NB) != 0)
+	{
+		std::cout << "Waiting for the other users of the store.\n";
+		if(::flock(lockFd_, LOCK_EX) != 0)
+		{
+			std::cerr << "Error: locking the store " << dir_ << " failed.\n";
+			return false;
+		}
+	}
+
+	HashKeys referenced;
+	std::error_code ec;
+	for(const auto& entry : fs::directory_iterator(dir_ / "refs", ec))
+	{
+		if(!readRefs(entry.path(), referenced, MAGIC_NUMBER_REFS))
+		{
+			return false;
+		}
+	}
+	if(ec && ec != std::errc::no_such_file_or_directory)
+	{
+		std::cerr << "Error: reading the references of " << dir_ << " failed: " << ec.message() << '\n';
+		return false;
+	}
+	ec.clear();
+
+	size_t numKept = 0, numRemoved = 0;
+	uint64_t keptBytes = 0, freedBytes = 0;
+	for(auto it = fs::recursive_directory_iterator(dir_ / "blobs", ec); !ec && it != fs::recursive_directory_iterator();
+			it.increment(ec))
+	{
+		Hash128 hash{};
+		if(!it->is_regular_file() || !fromHex(it->path().filename().string(), hash))
+		{
+			continue;
+		}
+
+		auto size = it->file_size();
+		if(referenced.count(toKey(hash)) > 0)
+		{
+			++numKept;
+			keptBytes += size;
+			continue;
+		}
+
+		if(verbose) std::cout << "Removing " << it->path() << '\n';
+		std::error_code removeEc;
+		if(fs::remove(it->path(), removeEc))
+		{
+			++numRemoved;
+			freedBytes += size;
+		}
+	}
+
+	if(ec)
+	{
+		std::cerr << "Error: reading the store " << dir_ << " failed: " << ec.message() << '\n';
+		return false;
+	}
+
+	//nobody else is using the store, the temporary files are leftovers
+	for(const auto& entry : fs::directory_iterator(dir_ / "tmp", ec))
+	{
+		std::error_code removeEc;
+		fs::remove(entry.path(), removeEc);
+	}
+
+	if(referenced.size() > numKept)
+	{
+		std::cerr << "Warning: " << referenced.size() - numKept << " referenced blobs are missing in the store.\n";
+	}
+
+	std::cout << "Store: " << numKept << " blobs kept (" << (keptBytes >> 10U) << " KB), "
+		<< numRemoved << " removed (" << (freedBytes >> 10U) << " KB freed)\n";
+
+	return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "hash/HashKernels.h"
+
+namespace fs = std::filesystem;
+
+//Content addressed store shared by the archives of many runs and hosts.
+//A file content is kept once, zstd compressed, in blobs/xx/<XXH3-128 hex>,
+//the archives only hold its hash. The refs directory has a file per
+//archive id listing the blobs of that archive, so adding or releasing
+//the references of an archive twice changes nothing. The garbage
+//collection removes the blobs no archive references. Packing and
+//reading hold the store lock shared, the garbage collection exclusively.
+class ContentStore
+{
+public:
+	explicit ContentStore(const fs::path& dir);
+	~ContentStore();
+
+	ContentStore(const ContentStore&) = delete;
+	ContentStore& operator=(const ContentStore&) = delete;
+
+	//takes the store lock, create makes the directories first
+	bool open(bool create);
+
+	bool contains(const Hash128& hash) const;
+
+	//compresses the file into the store, hash is updated to the hash of
+	//the stored content (it differs when the file changed meanwhile)
+	bool add(const fs::path& source, uint64_t size, Hash128& hash) const;
+
+	//decompressing stream of the blob, nullptr if it is missing
+	std::unique_ptr<std::istream> openBlob(const Hash128& hash) const;
+
+	//records the blobs of the archive before it is made visible,
+	//the blobs are synced to the disk first
+	bool addReferences(uint64_t archiveId, std::vector<Hash128> hashes) const;
+
+	//the archive no longer references anything, released archives are ignored
+	bool releaseReferences(uint64_t archiveId) const;
+
+	//removes the blobs without references and the leftovers of failed
+	//packings, waits for the other users of the store
+	bool collectGarbage();
+
+	static std::string toHex(const Hash128& hash);
+
+private:
+	static constexpr std::array<char, 8> MAGIC_NUMBER_REFS = {'M','Y','D','I','R','R','F','1'};
+	static constexpr size_t IO_BUFFER_SIZE = (1U << 20U); //1MB
+
+	fs::path blobPath(const Hash128& hash) const;
+	fs::path refsPath(uint64_t archiveId) const;
+	fs::path tempPath() const;
+
+	fs::path dir_;
+	int lockFd_{-1};
+	mutable std::atomic<uint64_t> tempCounter_{0};
+};
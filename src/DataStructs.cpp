@@ -1,5 +1,7 @@
 #include "DataStructs.h"
 #include <iostream>
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <endian.h>
 
@@ -7,7 +9,7 @@ extern bool verbose;
 
 DirTreeNodeRef DirTreeNode::findChildByName(const std::string& nameToFind)
 {
-	auto it = children_.find(nameToFind);
+	auto it = children_.find(std::string_view(nameToFind));
 	if( it == children_.end())
 	{
 		return 0;
@@ -28,14 +30,14 @@ bool DirTreeNode::isEmptyDir() const
 	return parent_ & DIR_MASK;
 }
 
-DirTreeNodeRef DirTreeNode::addChild(std::vector<DirTreeNode*>& index, DirTreeNodeRef parentIdx, std::string nameIn)
+DirTreeNodeRef DirTreeNode::addChild(std::vector<DirTreeNode*>& index, NameArena& names, DirTreeNodeRef parentIdx, const std::string& nameIn)
 {
 	if(verbose) std::cout << "DirTreeNode::addChild name=" << nameIn << "\n";
 
 	DirTreeNode* newNode = new DirTreeNode(index);
 	//theIndex_.push_back(newNode);
 
-	newNode->name_ = std::move(nameIn);
+	newNode->name_ = names.store(nameIn);
 	newNode->parent_ = parentIdx;
 
 	//DirTreeNodeRef ref;
@@ -53,13 +55,13 @@ bool DirTreeNode::TranspComparator::operator()(DirTreeNodeRef left, DirTreeNodeR
 	//return left.refU.ptr->name < right.refU.ptr->name;
 }
 
-bool DirTreeNode::TranspComparator::operator()(const std::string& left, DirTreeNodeRef right) const
+bool DirTreeNode::TranspComparator::operator()(std::string_view left, DirTreeNodeRef right) const
 {
 	return left < indexRef_.at(right)->name_;
 	//return left < right.refU.ptr->name;
 }
 
-bool DirTreeNode::TranspComparator::operator()(DirTreeNodeRef left, const std::string& right) const
+bool DirTreeNode::TranspComparator::operator()(DirTreeNodeRef left, std::string_view right) const
 {
 	return indexRef_.at(left)->name_ < right;
 	//return left.refU.ptr->name < right;
@@ -105,13 +107,6 @@ bool DirTreeNode::TranspComparator::operator()(DirTreeNodeRef left, const std::s
 //assuming that the time machine is using like ext4 filesystem 
 //meaning that the max filename lenght is 255 bytes
 //not handling encoding conversions here
-void DirTreeNode::writeString(std::ostream& out, const std::string& name)
-{
-	uint8_t len = name.size();
-	out.write(reinterpret_cast<const char*>(&len), sizeof(len));
-	out.write(name.data(), len);
-}
-
 std::string DirTreeNode::readString(std::istream& in)
 {
 	uint8_t len;
@@ -132,15 +127,147 @@ DirTreeNodeRef DirTreeNode::readRef(std::istream& in)
 }
 
 
-void DirTreeNode::write(std::ostream& out) const
+void DirTreeNode::read(std::istream& in, DirTreeNodeRef selfIdx, unsigned formatVersion, NameArena& names)
+{
+	if(formatVersion >= 15)
+	{
+		//distance back to the parent, lowest bit is the empty dir flag
+		uint64_t encoded = read_varint(in);
+		parent_ = selfIdx - static_cast<DirTreeNodeRef>(encoded >> 1U);
+		setIsEmptyDir(encoded & 1U);
+	}
+	else
+	{
+		parent_ = readRef(in);
+	}
+	name_ = names.store(readString(in));
+}
+
+
+std::string_view NameArena::store(std::string_view name)
+{
+	char* pData = allocate(name.size());
+	std::copy(name.begin(), name.end(), pData);
+	return {pData, name.size()};
+}
+
+char* NameArena::allocate(size_t length)
+{
+	if(length > chunkFree_)
+	{
+		size_t chunkSize = std::max(length, CHUNK_SIZE);
+		chunks_.emplace_back(new char[chunkSize]);
+		pFree_ = chunks_.back().get();
+		chunkFree_ = chunkSize;
+	}
+
+	char* pData = pFree_;
+	pFree_ += length;
+	chunkFree_ -= length;
+	return pData;
+}
+
+void NameArena::clear()
+{
+	chunks_.clear();
+	chunkFree_ = 0;
+	pFree_ = nullptr;
+}
+
+
+
+
+void ExternalEntry::write(std::ostream& out) const
+{
+	write_varint(out, file_.size_);
+	write_le(out, file_.partialHash_);
+	ContentHasher::write(out, file_.fullHash_);
+	write_varint(out, device_);
+	write_varint(out, inode_);
+
+	write_varint(out, file_.dirRefs_.size());
+	for(DirTreeNodeRef ref : file_.dirRefs_)
+	{
+		write_varint(out, ref);
+	}
+
+	write_varint(out, path_.size());
+	out.write(path_.data(), path_.size());
+}
+
+bool ExternalEntry::read(std::istream& in)
+{
+	file_.size_ = read_varint(in);
+	file_.partialHash_ = read_le<XXH64_hash_t>(in);
+	file_.fullHash_ = ContentHasher::read(in);
+	device_ = read_varint(in);
+	inode_ = read_varint(in);
+
+	file_.dirRefs_.resize(read_varint(in));
+	for(auto& ref : file_.dirRefs_)
+	{
+		ref = read_varint(in);
+	}
+
+	path_.resize(read_varint(in));
+	in.read(path_.data(), path_.size());
+
+	return in.good();
+}
+
+
+ContentHasher::ContentHasher():
+	kernels_(HashKernels::get()),
+	pState_(kernels_.createState_())
+{
+	assert(pState_ != nullptr);
+	reset();
+}
+
+ContentHasher::~ContentHasher()
 {
-	writeRef(out, parent_);
-	writeString(out, name_);
+	kernels_.freeState_(pState_);
 }
 
-void DirTreeNode::read(std::istream& in)
+void ContentHasher::reset()
 {
-	parent_ = readRef(in);
-	name_ = readString(in);
+	kernels_.reset_(pState_);
+	position_ = 0;
 }
 
+void ContentHasher::update(const void* data, size_t length)
+{
+	kernels_.update_(pState_, data, length);
+	position_ += length;
+}
+
+void ContentHasher::skipTo(FileInfo::FileSizeType offset)
+{
+	static const std::array<char, 1U << 16U> zeros{};
+
+	while(position_ < offset)
+	{
+		auto chunk = std::min<FileInfo::FileSizeType>(zeros.size(), offset - position_);
+		update(zeros.data(), chunk);
+	}
+}
+
+XXH128_hash_t ContentHasher::digest(FileInfo::FileSizeType size)
+{
+	skipTo(size);
+	return kernels_.digest_(pState_);
+}
+
+void ContentHasher::write(std::ostream& out, const XXH128_hash_t& hash)
+{
+	write_le(out, hash.high64);
+	write_le(out, hash.low64);
+}
+
+XXH128_hash_t ContentHasher::read(std::istream& in)
+{
+	XXH128_hash_t hash{};
+	hash.high64 = read_le<XXH64_hash_t>(in);
+	hash.low64 = read_le<XXH64_hash_t>(in);
+	return hash;
+}
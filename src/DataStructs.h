@@ -5,9 +5,12 @@
 #include <string>
 #include <cassert>
 #include <filesystem>
+#include <memory>
+#include <string_view>
 #include <vector>
 #include <fstream>
 #include <xxhash.h>
+#include "hash/HashKernels.h"
 
 namespace fs = std::filesystem;
 
@@ -16,6 +19,9 @@ namespace fs = std::filesystem;
 using DirTreeNodeRef = uint32_t;
 constexpr DirTreeNodeRef DIR_MASK = 1U << (sizeof(DirTreeNodeRef) * 8 - 1);
 constexpr DirTreeNodeRef REF_MAX = ~DIR_MASK;
+//The same bit in the file name references marks a hard link
+//to the previous name of the file
+constexpr DirTreeNodeRef LINK_MASK = DIR_MASK;
 
 
 
@@ -83,6 +89,125 @@ T read_le(std::istream& in)
 }
 
 
+//LEB128: 7 bits per byte, lowest group first, high bit set
+//when more bytes follow. Used by format version 15 and newer.
+inline void write_varint(std::ostream& out, uint64_t val)
+{
+	char buf[10];
+	size_t len = 0;
+	while(val >= 0x80U)
+	{
+		buf[len++] = static_cast<char>(val | 0x80U);
+		val >>= 7U;
+	}
+	buf[len++] = static_cast<char>(val);
+	out.write(buf, len);
+}
+
+inline uint64_t read_varint(std::istream& in)
+{
+	//sbumpc is just a pointer increment while the stream buffer has data
+	auto* pBuf = in.rdbuf();
+
+	//unrolled fast paths, most refs, counts and sizes fit in 1-3 bytes
+	int byte = pBuf->sbumpc();
+	if(byte < 0x80)
+	{
+		if(byte == std::char_traits<char>::eof())
+		{
+			in.setstate(std::ios::eofbit | std::ios::failbit);
+			return 0;
+		}
+		return byte;
+	}
+	uint64_t val = byte & 0x7FU;
+
+	byte = pBuf->sbumpc();
+	if(byte >= 0 && byte < 0x80)
+	{
+		return val | (static_cast<uint64_t>(byte) << 7U);
+	}
+
+	for(unsigned shift = 7; shift < 64 && byte >= 0; shift += 7)
+	{
+		val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if(byte < 0x80)
+		{
+			return val;
+		}
+		byte = pBuf->sbumpc();
+	}
+
+	//eof in the middle or more than 10 bytes
+	in.setstate(std::ios::failbit);
+	return 0;
+}
+
+//The same for the in-memory buffers, returns false on truncated input
+inline bool read_varint(const char*& pos, const char* pEnd, uint64_t& val)
+{
+	const auto* pIn = reinterpret_cast<const uint8_t*>(pos);
+	const auto* pLimit = reinterpret_cast<const uint8_t*>(pEnd);
+
+	if(pIn < pLimit && pIn[0] < 0x80U)
+	{
+		val = pIn[0];
+		pos += 1;
+		return true;
+	}
+	if(pLimit - pIn >= 2 && pIn[1] < 0x80U)
+	{
+		val = (pIn[0] & 0x7FU) | (static_cast<uint64_t>(pIn[1]) << 7U);
+		pos += 2;
+		return true;
+	}
+
+	val = 0;
+	for(unsigned shift = 0; shift < 64 && pIn < pLimit; shift += 7, ++pIn)
+	{
+		val |= static_cast<uint64_t>(*pIn & 0x7FU) << shift;
+		if(*pIn < 0x80U)
+		{
+			pos = reinterpret_cast<const char*>(pIn + 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+//signed deltas as small unsigned numbers: 0,-1,1,-2,2 -> 0,1,2,3,4
+inline uint64_t zigzag_encode(int64_t val)
+{
+	return (static_cast<uint64_t>(val) << 1U) ^ static_cast<uint64_t>(val >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t val)
+{
+	return static_cast<int64_t>(val >> 1U) ^ -static_cast<int64_t>(val & 1U);
+}
+
+
+//Storage of the node names, DirTreeNode::name_ points into it.
+//The chunks never move so the views stay valid until clear().
+class NameArena
+{
+public:
+	std::string_view store(std::string_view name);
+
+	//length bytes in one piece, a bigger chunk is made if needed
+	char* allocate(size_t length);
+
+	void clear();
+
+private:
+	static constexpr size_t CHUNK_SIZE = (1U << 20U); //1MB
+
+	std::vector<std::unique_ptr<char[]>> chunks_;
+	size_t chunkFree_{0};
+	char* pFree_{nullptr};
+};
+
+
 struct DirTreeNode
 {
 	//Flat sequence of the directory nodes. It is required
@@ -112,29 +237,29 @@ struct DirTreeNode
 		{}
 
 		bool operator()(DirTreeNodeRef left, const DirTreeNodeRef right) const;
-		bool operator()(const std::string& left, DirTreeNodeRef right) const;
-		bool operator()(DirTreeNodeRef left, const std::string& right) const;
+		bool operator()(std::string_view left, DirTreeNodeRef right) const;
+		bool operator()(DirTreeNodeRef left, std::string_view right) const;
 
 	};
 	using DirTreeNodeSet = std::set<DirTreeNodeRef, TranspComparator>;
 
 
 	DirTreeNodeRef parent_{0};
-	std::string name_;
+	std::string_view name_;
 	DirTreeNodeSet children_;
 
 
 	//std::vector<DirTreeNodeRef> files;
 	DirTreeNodeRef findChildByName(const std::string& nameToFind);
-	DirTreeNodeRef addChild(std::vector<DirTreeNode*>& index, DirTreeNodeRef, std::string name);
+	DirTreeNodeRef addChild(std::vector<DirTreeNode*>& index, NameArena& names, DirTreeNodeRef, const std::string& name);
 
-	void write(std::ostream& out) const;
-	void read(std::istream& in);
+	//Node of the archives before version 16, selfIdx is the position
+	//of the node in the index (v15 stores the parent relative to it)
+	void read(std::istream& in, DirTreeNodeRef selfIdx, unsigned formatVersion, NameArena& names);
 
 	static void writeRef(std::ostream& out, DirTreeNodeRef val);
 	static DirTreeNodeRef readRef(std::istream& in);
 
-	static void writeString(std::ostream& out, const std::string& name);
 	static std::string readString(std::istream& in);
 
 	void setIsEmptyDir(bool in);
@@ -144,6 +269,17 @@ struct DirTreeNode
 
 struct FileInfo
 {
+	//Bits of the per-file flags byte stored in the archive
+	//after the file size (format version 14 and newer)
+	enum RecordFlags : uint8_t
+	{
+		RECORD_SPARSE = 1U << 0U, //extent list follows, only data extents are stored
+		RECORD_HASH = 1U << 1U, //XXH3-128 of the content follows the data
+		RECORD_MTIME = 1U << 2U, //modification time follows the flags
+		RECORD_TIMERANGE = 1U << 3U, //first and last log timestamp follow the mtime
+		RECORD_STORED = 1U << 4U, //blob key follows the time range, the data is in the content store
+	};
+
 	struct IsEqual
 	{
 		bool operator()(const FileInfo& left, const FileInfo& right) const
@@ -160,7 +296,7 @@ struct FileInfo
 		}
 	};
 
-	using FileSizeType = uint32_t;
+	using FileSizeType = uint64_t;
 
 	FileInfo(FileSizeType size, DirTreeNodeRef nameRef):
 		size_(size)
@@ -174,17 +310,118 @@ struct FileInfo
 	XXH64_hash_t partialHash_{}; 
 	XXH128_hash_t fullHash_{}; 
 	//size_t fullHash;
-	//size_t group;
+	//Files with the same hashes but different content (verified
+	//byte by byte) get different groups, 0 otherwise
+	uint32_t group_{};
 	std::vector<DirTreeNodeRef> dirRefs_;
 
-	void swap(FileInfo& other)
+	bool isSameContent(const FileInfo& other) const
 	{
-		size_ = other.size_;
-		partialHash_ = other.partialHash_;
-		fullHash_ = other.fullHash_;
-		dirRefs_.swap(other.dirRefs_);
+		return size_ == other.size_ &&
+			partialHash_ == other.partialHash_ &&
+			fullHash_.high64 == other.fullHash_.high64 &&
+			fullHash_.low64 == other.fullHash_.low64 &&
+			group_ == other.group_;
 	}
 
 	//std::string getFilePath() const;
 	//fs::path getFsFilePath() const;
 };
+
+//Range of a sparse file holding data, everything else is a hole
+struct FileExtent
+{
+	FileInfo::FileSizeType offset_{};
+	FileInfo::FileSizeType length_{};
+};
+
+
+//Per-file metadata stored in the archive in front of the data
+struct FileRecord
+{
+	FileInfo file_;
+	uint8_t flags_{};
+	//nanoseconds since the epoch, valid with RECORD_MTIME
+	int64_t mtime_{};
+	//seconds since the epoch of the first and the last log line,
+	//valid with RECORD_TIMERANGE
+	int64_t timeFirst_{};
+	int64_t timeLast_{};
+	//XXH3-128 of the content, the blob holding it with RECORD_STORED
+	XXH128_hash_t storeKey_{};
+	//the data extents, a single one covering the whole file if not sparse
+	std::vector<FileExtent> extents_;
+
+	//number of data bytes, in the archive or in the content store
+	FileInfo::FileSizeType dataSize() const
+	{
+		FileInfo::FileSizeType ret = 0;
+		for(const auto& extent : extents_)
+		{
+			ret += extent.length_;
+		}
+		return ret;
+	}
+
+	//number of data bytes stored in the archive
+	FileInfo::FileSizeType storedSize() const
+	{
+		return (flags_ & FileInfo::RECORD_STORED) ? 0 : dataSize();
+	}
+};
+
+//A file of the bounded memory scan (--memory-limit), kept in the
+//temporary run files instead of the tree. The path of the first name
+//is relative to the packed directory.
+struct ExternalEntry
+{
+	FileInfo file_;
+	std::string path_;
+	//identity of the files with more than one link, 0 otherwise
+	uint64_t device_{};
+	uint64_t inode_{};
+
+	void write(std::ostream& out) const;
+	bool read(std::istream& in);
+
+	size_t memoryUsage() const
+	{
+		return sizeof(ExternalEntry) + path_.capacity() + file_.dirRefs_.capacity() * sizeof(DirTreeNodeRef);
+	}
+};
+
+//Streaming XXH3-128 of a file content. Holes of sparse files
+//are hashed as zeros so the result does not depend on how
+//the file is stored.
+class ContentHasher
+{
+public:
+	ContentHasher();
+	~ContentHasher();
+
+	ContentHasher(const ContentHasher&) = delete;
+	ContentHasher& operator=(const ContentHasher&) = delete;
+
+	void reset();
+
+	void update(const void* data, size_t length);
+
+	//hashes zeros up to the offset, for the holes
+	void skipTo(FileInfo::FileSizeType offset);
+
+	//hashes zeros up to the file size and returns the hash
+	XXH128_hash_t digest(FileInfo::FileSizeType size);
+
+	static void write(std::ostream& out, const XXH128_hash_t& hash);
+	static XXH128_hash_t read(std::istream& in);
+
+	static bool isEqual(const XXH128_hash_t& left, const XXH128_hash_t& right)
+	{
+		return XXH128_isEqual(left, right);
+	}
+
+private:
+	const HashKernels& kernels_;
+	void* pState_;
+	FileInfo::FileSizeType position_{0};
+};
@@ -0,0 +1,178 @@
+#include "DirWatcher.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+extern bool verbose;
+
+namespace
+{
+//close_write ends the writing of a whole file, modify covers the logs
+//kept open and appended to, moved_to the rotated ones
+constexpr uint32_t WATCH_MASK = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR
+	| IN_DELETE_SELF | IN_MOVE_SELF;
+}
+
+DirWatcher::~DirWatcher()
+{
+	if(fd_ >= 0)
+	{
+		::close(fd_);
+	}
+}
+
+bool DirWatcher::start(const fs::path& root)
+{
+	root_ = fs::canonical(root);
+
+	fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd_ < 0)
+	{
+		std::cerr << "Error: inotify is not available: " << std::strerror(errno) << '\n';
+		return false;
+	}
+
+	if(!addWatches({}, false))
+	{
+		return false;
+	}
+
+	std::cout << "Watching " << root_ << ", " << dirs_.size() << " directories\n";
+	return true;
+}
+
+bool DirWatcher::addWatches(const fs::path& relativeDir, bool markFiles)
+{
+	auto dir = root_ / relativeDir;
+	int wd = ::inotify_add_watch(fd_, dir.c_str(), WATCH_MASK);
+	if(wd < 0)
+	{
+		if(errno == ENOSPC)
+		{
+			std::cerr << "Error: out of inotify watches, raise fs.inotify.max_user_watches.\n";
+			return false;
+		}
+		//removed meanwhile
+		if(verbose) std::cout << "Not watching " << dir << ": " << std::strerror(errno) << '\n';
+		return true;
+	}
+	//a moved directory keeps its descriptor, the path is updated
+	dirs_[wd] = relativeDir;
+
+	std::error_code ec;
+	for(const auto& entry : fs::directory_iterator(dir, fs::directory_options::skip_permission_denied, ec))
+	{
+		if(entry.is_symlink(ec))
+		{
+			continue;
+		}
+
+		if(entry.is_directory(ec))
+		{
+			if(!addWatches(relativeDir / entry.path().filename(), markFiles))
+			{
+				return false;
+			}
+		}
+		else if(markFiles && entry.is_regular_file(ec))
+		{
+			changes_.insert(relativeDir / entry.path().filename());
+		}
+	}
+
+	return true;
+}
+
+void DirWatcher::handleEvent(int wd, uint32_t mask, const char* name)
+{
+	if(mask & IN_Q_OVERFLOW)
+	{
+		std::cerr << "Warning: inotify events were lost, the next archive is a full one.\n";
+		overflowed_ = true;
+		return;
+	}
+
+	auto dirIt = dirs_.find(wd);
+	if(dirIt == dirs_.end())
+	{
+		return;
+	}
+
+	if(mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+	{
+		if(dirIt->second.empty() && !rootLost_)
+		{
+			std::cerr << "Error: the watched directory " << root_ << " is gone.\n";
+			rootLost_ = true;
+		}
+		//the directory is gone, a moved one gets its new path from IN_MOVED_TO
+		if(mask & IN_IGNORED)
+		{
+			dirs_.erase(dirIt);
+		}
+		return;
+	}
+
+	//events of the watched directory itself
+	if(*name == '\0')
+	{
+		return;
+	}
+
+	auto path = dirIt->second / name;
+	if(mask & IN_ISDIR)
+	{
+		if((mask & (IN_CREATE | IN_MOVED_TO)) && !addWatches(path, true))
+		{
+			overflowed_ = true;
+		}
+		return;
+	}
+
+	if(verbose) std::cout << "Changed " << path << '\n';
+	changes_.insert(path);
+}
+
+bool DirWatcher::poll(int timeoutMs)
+{
+	pollfd pfd{fd_, POLLIN, 0};
+	int ret = ::poll(&pfd, 1, timeoutMs);
+	if(ret < 0)
+	{
+		return errno == EINTR;
+	}
+
+	alignas(inotify_event) char buffer[EVENT_BUFFER_SIZE];
+	for(;;)
+	{
+		auto length = ::read(fd_, buffer, sizeof(buffer));
+		if(length <= 0)
+		{
+			return length == 0 || errno == EAGAIN || errno == EINTR;
+		}
+
+		for(char* pos = buffer; pos < buffer + length;)
+		{
+			const auto* pEvent = reinterpret_cast<const inotify_event*>(pos);
+			handleEvent(pEvent->wd, pEvent->mask, pEvent->len > 0 ? pEvent->name : "");
+			pos += sizeof(inotify_event) + pEvent->len;
+		}
+	}
+}
+
+void DirWatcher::requeue(const std::vector<fs::path>& changes, bool fullScan)
+{
+	changes_.insert(changes.begin(), changes.end());
+	overflowed_ = overflowed_ || fullScan;
+}
+
+std::vector<fs::path> DirWatcher::takeChanges()
+{
+	std::vector<fs::path> ret(changes_.begin(), changes_.end());
+	changes_.clear();
+	overflowed_ = false;
+	return ret;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <filesystem>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+//--watch: follows a directory tree with inotify and collects the files
+//created, written or moved into it. The watched directories stay in
+//memory, nothing is walked again after start().
+class DirWatcher
+{
+public:
+	DirWatcher() = default;
+	~DirWatcher();
+
+	DirWatcher(const DirWatcher&) = delete;
+	DirWatcher& operator=(const DirWatcher&) = delete;
+
+	//watches the directory and all its subdirectories
+	bool start(const fs::path& root);
+
+	//waits up to timeoutMs for events and collects them,
+	//false on errors other than an interrupting signal
+	bool poll(int timeoutMs);
+
+	//sorted paths relative to the root of the files changed since the last call
+	std::vector<fs::path> takeChanges();
+
+	//the kernel dropped events, only a full scan is reliable now
+	bool overflowed() const { return overflowed_; }
+
+	//the changes of a failed archive are taken again the next time
+	void requeue(const std::vector<fs::path>& changes, bool fullScan);
+
+	//the watched directory was removed or moved away, nothing more will come
+	bool rootLost() const { return rootLost_; }
+
+	size_t numWatches() const { return dirs_.size(); }
+
+private:
+	static constexpr size_t EVENT_BUFFER_SIZE = (1U << 16U); //64KB
+
+	//new directories are walked, their files may be there before the watch
+	bool addWatches(const fs::path& relativeDir, bool markFiles);
+	void handleEvent(int wd, uint32_t mask, const char* name);
+
+	fs::path root_;
+	int fd_{-1};
+	//watch descriptor -> directory relative to the root
+	std::unordered_map<int, fs::path> dirs_;
+	std::set<fs::path> changes_;
+	bool overflowed_{false};
+	bool rootLost_{false};
+};
@@ -1,9 +1,32 @@
 #include "DirectoryData.h"
 #include "DataStructs.h"
+#include "ThreadPool.h"
+#include "RadixSort.h"
+#include "Progress.h"
+#include "FileIo.h"
+#include "Compression.h"
+#include "LogTime.h"
+#include "ContentStore.h"
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
 #include <xxhash.h>
 #include <zstd.h>
+#include <cerrno>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 extern bool verbose;
 
@@ -18,10 +41,16 @@ bool DirectoryData::preProcessSourceDir(const std::string& directory)
 		return false;
 	}
 
+	if(options_.memoryLimit > 0)
+	{
+		return preProcessExternal();
+	}
+
 	std::cout << "Pre-processing " << workDir_ << '\n';
+	progress.setPhase(Progress::Phase::SCAN);
 
 	auto* pRoot = new DirTreeNode(theIndex_);
-	pRoot->name_ = workDir_.filename();
+	pRoot->name_ = names_.store(workDir_.filename().string());
 	if(verbose) std::cout << "root_.name_=" << pRoot->name_ << '\n';
 
 	auto workDirDepth = std::distance(workDir_.begin(), workDir_.end());
@@ -31,98 +60,172 @@ bool DirectoryData::preProcessSourceDir(const std::string& directory)
 	//each filename will be a node in the tree
 	//aproximating some sane value
 	theIndex_.reserve(MAX_FILE_NUM*2);
-	fileEntries_.reserve(MAX_FILE_NUM);
+	fileTable_.reserve(MAX_FILE_NUM);
+
+	//(st_dev, st_ino) -> position in fileTable_ of the files with more than one link
+	std::map<std::pair<dev_t, ino_t>, FileTable::Index> hardLinks;
 
 	//Loading the directory structure into the tree structure 
 	for (const auto &dir_entry : fs::recursive_directory_iterator(workDir_,
 				fs::directory_options::skip_permission_denied))
 	{
-		if(verbose) std::cout << "preProcess: dir_entry=" << dir_entry << "\n";
+		if(!addSourceEntry(dir_entry, workDirDepth, hardLinks))
+		{
+			return false;
+		}
+	}
 
-		if (dir_entry.is_symlink())
+	return finishScan();
+}
+
+//--watch: the tree holds only the listed files and their directories,
+//the files removed meanwhile are left out
+bool DirectoryData::preProcessChangedFiles(const std::string& directory, const std::vector<fs::path>& files)
+{
+	workDir_ = fs::canonical(directory);
+	progress.setPhase(Progress::Phase::SCAN);
+
+	auto* pRoot = new DirTreeNode(theIndex_);
+	pRoot->name_ = names_.store(workDir_.filename().string());
+
+	auto workDirDepth = std::distance(workDir_.begin(), workDir_.end());
+	std::map<std::pair<dev_t, ino_t>, FileTable::Index> hardLinks;
+
+	for(const auto& file : files)
+	{
+		std::error_code ec;
+		fs::directory_entry dir_entry(workDir_ / file, ec);
+		if(ec || !dir_entry.exists(ec) || dir_entry.is_directory(ec))
 		{
-			std::cerr << "Warrning: Ignoring dir entry " << dir_entry
-				<< " of unsupported type.\nSymlinks are not supported.\n";
+			if(verbose) std::cout << "preProcess: gone " << file << "\n";
 			continue;
 		}
 
-		if (!dir_entry.is_directory() && !dir_entry.is_regular_file())
+		if(!addSourceEntry(dir_entry, workDirDepth, hardLinks))
 		{
-			std::cerr << "Warrning: Ignoring dir entry " << dir_entry
-				<< " of unsupported type.\nOnly normal files and directories are supported.\n";
-			continue;
+			return false;
 		}
+	}
+
+	return finishScan();
+}
+
+//Adds the file or directory to the tree, the directories on the way
+//are created when missing (only the changed files are listed with --watch)
+bool DirectoryData::addSourceEntry(const fs::directory_entry& dir_entry, ptrdiff_t workDirDepth,
+		std::map<std::pair<dev_t, ino_t>, FileTable::Index>& hardLinks)
+{
+	if(verbose) std::cout << "preProcess: dir_entry=" << dir_entry << "\n";
+
+	if (dir_entry.is_symlink())
+	{
+		std::cerr << "Warrning: Ignoring dir entry " << dir_entry
+			<< " of unsupported type.\nSymlinks are not supported.\n";
+		return true;
+	}
+
+	if (!dir_entry.is_directory() && !dir_entry.is_regular_file())
+	{
+		std::cerr << "Warrning: Ignoring dir entry " << dir_entry
+			<< " of unsupported type.\nOnly normal files and directories are supported.\n";
+		return true;
+	}
 
-		auto pathIt = dir_entry.path().begin();
-		//To work on relative path
-		std::advance(pathIt, workDirDepth);
+	auto pathIt = dir_entry.path().begin();
+	//To work on relative path
+	std::advance(pathIt, workDirDepth);
 
-		DirTreeNode* pCurrNode = pRoot;
-		DirTreeNodeRef currIdx = 0;
-		DirTreeNode* pNextNode = nullptr;
-		DirTreeNodeRef nextNodeIdx = 0;
-		 
-		for(;pathIt != dir_entry.path().end();++pathIt)
+	DirTreeNode* pCurrNode = theIndex_.front();
+	DirTreeNodeRef currIdx = 0;
+	DirTreeNode* pNextNode = nullptr;
+	DirTreeNodeRef nextNodeIdx = 0;
+	 
+	for(;pathIt != dir_entry.path().end();++pathIt)
+	{
+		nextNodeIdx = pCurrNode->findChildByName(*pathIt);
+		if( nextNodeIdx == 0) 
 		{
-			nextNodeIdx = pCurrNode->findChildByName(*pathIt);
-			pNextNode = toPtr(nextNodeIdx);
-			if( nextNodeIdx == 0) 
+			//new node -> the end of the path or a directory not seen yet
+			if(std::next(pathIt) == dir_entry.path().end())
 			{
-				//new node -> we should be at the end of the path
-				assert(std::next(pathIt) == dir_entry.path().end());
 				break;
 			}
-
-			pCurrNode = pNextNode;
-			currIdx = nextNodeIdx;
+			nextNodeIdx = pCurrNode->addChild(theIndex_, names_, currIdx, *pathIt);
 		}
+		pNextNode = toPtr(nextNodeIdx);
+
+		pCurrNode = pNextNode;
+		currIdx = nextNodeIdx;
+	}
 
 
-		if (dir_entry.is_regular_file())
+	if (dir_entry.is_regular_file())
+	{
+		std::ifstream f(dir_entry.path(), std::ios::binary);
+		if(!f.good())
 		{
-			std::ifstream f(dir_entry.path(), std::ios::binary);
-			if(!f.good())
-			{
-				std::cerr << dir_entry << " unreadable, skipping.\n";
-				continue;
-			}
+			std::cerr << dir_entry << " unreadable, skipping.\n";
+			return true;
+		}
 
-			DirTreeNodeRef ref = pCurrNode->addChild(theIndex_, currIdx, *pathIt);
+		DirTreeNodeRef ref = pCurrNode->addChild(theIndex_, names_, currIdx, *pathIt);
 
-			auto& fileInfo = fileEntries_.emplace_back();
-			fileInfo.dirRefs_.push_back(ref);
-			if(dir_entry.file_size() > std::numeric_limits<typeof(fileInfo.size_)>::max())
+		//Hard links are the same file, folding them into one entry
+		//so the content is never read or hashed more than once
+		if(dir_entry.hard_link_count() > 1)
+		{
+			struct stat st{};
+			if(::stat(dir_entry.path().c_str(), &st) == 0)
 			{
-				std::cerr << dir_entry.path() << " file too big\n";
-				return false;
+				auto [linkIt, inserted] = hardLinks.try_emplace({st.st_dev, st.st_ino}, fileTable_.size());
+				if(!inserted)
+				{
+					if(verbose) std::cout << "preProcess: hard link detected " << dir_entry << "\n";
+					fileTable_.addName(linkIt->second, ref | LINK_MASK);
+					return true;
+				}
 			}
-			//fileGroups_.emplace(dir_entry.file_size(), ref);
-
-			fileInfo.size_ = dir_entry.file_size();
 		}
-		else if(dir_entry.is_directory())
+
+		if(dir_entry.file_size() > std::numeric_limits<FileTable::FileSizeType>::max())
 		{
-			DirTreeNodeRef ref = pCurrNode->addChild(theIndex_, currIdx, *pathIt);
-			toPtr(ref)->setIsEmptyDir(true);
+			std::cerr << dir_entry.path() << " file too big\n";
+			return false;
 		}
-		else
+		//fileGroups_.emplace(dir_entry.file_size(), ref);
+
+		auto fileIdx = fileTable_.add(dir_entry.file_size(), ref);
+		progress.addFiles(1);
+		progress.addBytes(dir_entry.file_size());
+
+		if(options_.physicalOrder)
 		{
-			std::cerr << dir_entry << " is neither file or directory, skipping.\n";
+			fileTable_.setPhysOffset(fileIdx, getPhysicalOffset(dir_entry.path()));
 		}
-			 
-
-		//fileInfo a = {dir_entry};
-		//allEntries.push_back(a);
-		//allEntries.emplace_back(dir_entry);
 	}
+	else if(dir_entry.is_directory())
+	{
+		DirTreeNodeRef ref = pCurrNode->addChild(theIndex_, names_, currIdx, *pathIt);
+		toPtr(ref)->setIsEmptyDir(true);
+	}
+	else
+	{
+		std::cerr << dir_entry << " is neither file or directory, skipping.\n";
+	}
+
+	return true;
+}
 
+bool DirectoryData::finishScan()
+{
 	theIndex_.shrink_to_fit();
 	//The children list in each node was required to build
 	//the tree, after thet it is not needed. For constructing
 	//directory paths we start from the bottom so only parents
 	//are needed
+	renumberTree();
 	releaseChildren();
-	fileEntries_.shrink_to_fit();
+	fileTable_.shrinkToFit();
 
 	if(verbose) std::cout << "Data trimming completed." << std::endl;
 
@@ -130,399 +233,2951 @@ bool DirectoryData::preProcessSourceDir(const std::string& directory)
 	
 	if(verbose)
 	{
-		for(const auto& file : fileEntries_)
+		for(FileTable::Index idx = 0; idx < fileTable_.size(); ++idx)
 		{
-			std::cout << "FileFsPath:" << getFsFilePath(file.dirRefs_.at(0)) << std::endl;
+			std::cout << "FileFsPath:" << getFsFilePath(fileTable_.firstName(idx)) << std::endl;
 		}
 
-		std::cout << "Number of files=" << fileEntries_.size() << '\n';
+		std::cout << "Number of files=" << fileTable_.size() << '\n';
 		std::cout << "Number of dir items=" << theIndex_.size() << '\n';
 	}
 	
 	return true;;
 }
 
+//Only compact (key, index) pairs are sorted and scanned for the group
+//boundaries, fileTable_ stays in the scan order. The hashes are
+//computed for the groups with more than one file.
 bool DirectoryData::findDuplicates()
 {
 	std::cout << "Looking for duplicates\n";
+	//files are counted when their size group is done, bytes are the hashed data
+	progress.setPhase(Progress::Phase::DEDUP, fileTable_.size());
 
-	//Sort by file size
-	auto sizeSorter =
-		[](const FileInfo& feLeft, const FileInfo& feRight)
-		{
-			return feLeft.size_ < feRight.size_;
-		};
+	duplicateCandidates_.clear();
+	dedupStats_ = DedupStats();
 
+	//end of the group of the same key starting at first
+	auto groupEnd = [](const std::vector<SortKey>& keys, size_t first)
+	{
+		size_t end = first + 1;
+		while(end < keys.size() && keys[end].key_ == keys[first].key_)
+		{
+			++end;
+		}
+		return end;
+	};
 
-	auto HashSorter =
-		[](const FileInfo& feLeft, const FileInfo& feRight)
+	auto toGroup = [this](auto first, auto last)
+	{
+		FileGroup group;
+		group.reserve(std::distance(first, last));
+		for(auto it = first; it != last; ++it)
 		{
-			return feLeft.partialHash_ < feRight.partialHash_;
-		};
+			group.push_back(it->idx_);
+		}
+		return group;
+	};
 
+	//Full hash groups are small, sorted by comparison
+	struct FullHashKey
+	{
+		uint64_t high64_;
+		uint64_t low64_;
+		uint32_t group_;
+		uint32_t idx_;
 
-	auto FullHashSorter =
-		[](const FileInfo& feLeft, const FileInfo& feRight)
+		bool operator<(const FullHashKey& other) const
 		{
-			return std::tie(feLeft.fullHash_.high64, feLeft.fullHash_.low64)
-				< std::tie(feRight.fullHash_.high64, feRight.fullHash_.low64);
-		};
-	
-	std::sort(fileEntries_.begin(), fileEntries_.end(), sizeSorter);
+			return std::tie(high64_, low64_, group_) < std::tie(other.high64_, other.low64_, other.group_);
+		}
+	};
+
+	std::vector<SortKey> sizeKeys;
+	sizeKeys.reserve(fileTable_.size());
+	for(FileTable::Index idx = 0; idx < fileTable_.size(); ++idx)
+	{
+		sizeKeys.push_back({fileTable_.fileSize(idx), idx});
+	}
+	radixSort(sizeKeys);
 
-	for (auto it = fileEntries_.begin(); it != fileEntries_.end();)
+	std::vector<SortKey> hashKeys;
+	std::vector<FullHashKey> fullHashKeys;
+
+	for (size_t first = 0; first < sizeKeys.size();)
 	{
-		auto range = std::equal_range(it, fileEntries_.end(), *it, sizeSorter);
+		size_t last = groupEnd(sizeKeys, first);
 
-		if(std::distance(range.first, range.second) > 1)
+		if(last - first > 1)
 		{
-			if(!computeParialHshes(range))
+			dedupStats_.sameSize_ += last - first;
+			//no slot is added while the hashes are computed
+			auto group = toGroup(sizeKeys.begin() + first, sizeKeys.begin() + last);
+			fileTable_.addHashSlots(group);
+			if(!computeParialHshes(group))
 			{
 				return false;
 			}
 
-			std::sort(range.first, range.second, HashSorter);
-
-			for( auto it2 = range.first; it2 < range.second;)
+			hashKeys.clear();
+			for(size_t pos = first; pos < last; ++pos)
 			{
+				hashKeys.push_back({fileTable_.hashes(sizeKeys[pos].idx_).partialHash_, sizeKeys[pos].idx_});
+			}
+			radixSort(hashKeys);
 
-				auto hashRange = std::equal_range(it2, range.second, *it2, HashSorter);
+			for(size_t hashFirst = 0; hashFirst < hashKeys.size();)
+			{
+				size_t hashLast = groupEnd(hashKeys, hashFirst);
 
-				if(std::distance(hashRange.first, hashRange.second) > 1)
+				if(hashLast - hashFirst > 1)
 				{
-					if(!computeFullHshes(hashRange))
+					if(!computeFullHshes(toGroup(hashKeys.begin() + hashFirst, hashKeys.begin() + hashLast)))
 					{
 						return false;
 					}
 
-					std::sort(hashRange.first, hashRange.second, FullHashSorter);
-					
-					for( auto it3 = hashRange.first; it3 < hashRange.second; ++it3)
+					fullHashKeys.clear();
+					for(size_t pos = hashFirst; pos < hashLast; ++pos)
 					{
-						if(verbose) std::cout << getFsFilePath(it3->dirRefs_.at(0)) << ":size = " << it2->size_
-							<< " hash=" << it2->partialHash_ << " fullHash=" << it3->fullHash_.high64
-								<< ',' << it3->fullHash_.low64 << '\n';
+						const auto& hashes = fileTable_.hashes(hashKeys[pos].idx_);
+						fullHashKeys.push_back({hashes.fullHash_.high64, hashes.fullHash_.low64, hashes.group_,
+								hashKeys[pos].idx_});
+					}
+					std::sort(fullHashKeys.begin(), fullHashKeys.end());
+					dedupStats_.fullHashed_ += fullHashKeys.size();
 
-						//TODO: To make it 100% sure also a full byte by byte comparison should be done
+					for(size_t pos = 0; pos < fullHashKeys.size(); ++pos)
+					{
+						const auto& key = fullHashKeys[pos];
+						auto sameHash = [&key](const FullHashKey& other)
+						{
+							return other.high64_ == key.high64_ && other.low64_ == key.low64_;
+						};
+						if(!(pos > 0 && sameHash(fullHashKeys[pos - 1]))
+								&& !(pos + 1 < fullHashKeys.size() && sameHash(fullHashKeys[pos + 1])))
+						{
+							++dedupStats_.falseCandidates_;
+							dedupStats_.falseCandidateBytes_ += fileTable_.fileSize(key.idx_);
+						}
+
+						duplicateCandidates_.push_back(key.idx_);
+
+						const auto& hashes = fileTable_.hashes(key.idx_);
+						if(verbose) std::cout << getFsFilePath(fileTable_.firstName(key.idx_)) << ":size = "
+							<< fileTable_.fileSize(key.idx_) << " hash=" << hashes.partialHash_
+								<< " fullHash=" << hashes.fullHash_.high64 << ',' << hashes.fullHash_.low64
+								<< " group=" << hashes.group_ << '\n';
+
+						//Without options_.verifyDuplicates the duplicates are decided on the hash only.
 						//For a test program this is fine, no lives will be lost, particularly for 1M of files
 						//the chance is effectively zero
 					}
 				}
 
-				it2 = hashRange.second;
+				hashFirst = hashLast;
 			}
 		}
 
-		it = range.second;
+		progress.addFiles(last - first);
+		first = last;
 	}
 
-	return true;
-}
-
-bool DirectoryData::computeParialHshes
-		(std::pair<std::vector<FileInfo>::iterator, std::vector<FileInfo>::iterator> range)
-{
-	if(verbose) std::cout << "computeParialHshes num=" << std::distance(range.first, range.second) << '\n';
-	for (auto it = range.first; it != range.second; ++it)
+	const auto& stats = dedupStats_;
+	std::cout << "Partial hash: " << stats.fullHashed_ << " of " << stats.sameSize_
+		<< " same size files fully hashed, " << stats.falseCandidates_ << " false candidates";
+	if(stats.fullHashed_ > 0)
 	{
-		//empty files are ok with 0 hashes
-		if(it->size_ == 0)
-		{
-			continue;
-		}
-		fs::path filePath = getFsFilePath(it->dirRefs_.at(0));
-		filePath = workDir_ / filePath;
-
-		std::ifstream fileIn(filePath, std::ios::binary);
-		if(!fileIn.good())
-		{
-			std::cerr << "Could not open " << filePath << " for calculating parial hash.\n";
-			return false;
-		}
-
-		std::array<char, HASH_BUFFER_SIZE> buffer{};
-		fileIn.read(buffer.data(), buffer.size());
-
-		it->partialHash_ = XXH64(buffer.data(), fileIn.gcount(), 113);
-
-		fileIn.close();
-		
-		//uint64_t h = 1469598103934665603ull; // FNV-1a base
-		//for (std::streamsize i = 0; i < bytes_read; ++i) {
-		//	h ^= static_cast<unsigned char>(buffer[i]);
-		//	h *= 1099511628211ull;
-		//}
+		std::cout << " (" << 100 * stats.falseCandidates_ / stats.fullHashed_ << "%, "
+			<< (stats.falseCandidateBytes_ >> 20U) << " MB read in vain)";
 	}
+	std::cout << '\n';
 
 	return true;
 }
 
-
-bool DirectoryData::computeFullHshes
-		(std::pair<std::vector<FileInfo>::iterator, std::vector<FileInfo>::iterator> range)
+//--memory-limit
+//The tree and the file list are not kept in the memory. The name table
+//nodes are written to a temporary file during the scan, the files go
+//through external sorts: by size and inode (hard links are folded),
+//by size and partial hash, by size and full hash. Each pass computes
+//the hashes only for the files with a same key neighbour. The archive
+//uses the version 15 name table which can be written node by node.
+bool DirectoryData::preProcessExternal()
 {
-	auto* pState = XXH3_createState();
-
-	for (auto it = range.first; it != range.second; ++it)
+	if(options_.verifyDuplicates)
 	{
-		//empty files are ok with 0 hashes
-		if(it->size_ == 0)
-		{
-			continue;
-		}
-
-		XXH3_128bits_reset(pState);
-
-		fs::path filePath = getFsFilePath(it->dirRefs_.at(0));
-		filePath = workDir_ / filePath;
-
-		std::ifstream fileIn(filePath, std::ios::binary);
-		if(!fileIn.good())
-		{
-			std::cerr << "Could not open " << filePath << " for calculating full hash.\n";
-			return false;
-		}
+		std::cerr << "Error: byte verification of the duplicates is not supported with --memory-limit.\n";
+		return false;
+	}
+	if(options_.physicalOrder)
+	{
+		std::cerr << "Warning: physical order is not used with --memory-limit.\n";
+	}
 
-		std::array<char, IO_BUFFER_SIZE> buffer{};
+	std::error_code ec;
+	tempDir_ = fs::temp_directory_path(ec) / ("logTool-" + std::to_string(::getpid()));
+	if(ec || !fs::create_directories(tempDir_, ec))
+	{
+		std::cerr << "Error: cannot create the temporary directory " << tempDir_ << '\n';
+		tempDir_.clear();
+		return false;
+	}
 
-		while (fileIn.good())
-		{
-			fileIn.read(buffer.data(), buffer.size());
-			XXH3_128bits_update(pState, buffer.data(), fileIn.gcount());
-		}
+	std::cout << "Pre-processing " << workDir_ << " with temporary files in " << tempDir_ << '\n';
+	progress.setPhase(Progress::Phase::SCAN);
 
-		it->fullHash_ = XXH3_128bits_digest(pState);
+	//only one sorter is filled at a time, the other one is merged
+	//through small read buffers
+	size_t budget = options_.memoryLimit / 2;
 
-		fileIn.close();
-		
-		//uint64_t h = 1469598103934665603ull; // FNV-1a base
-		//for (std::streamsize i = 0; i < bytes_read; ++i) {
-		//	h ^= static_cast<unsigned char>(buffer[i]);
-		//	h *= 1099511628211ull;
-		//}
+	auto pScanned = std::make_unique<ExternalEntrySorter>(tempDir_, "scan", budget,
+			ExternalEntryLess{ExternalEntryLess::BY_INODE});
+	if(!scanExternal(*pScanned))
+	{
+		return false;
 	}
-	
-	XXH3_freeState(pState);
 
-	return true;
-}
+	std::cout << "Looking for duplicates\n";
+	//both passes go through all files
+	progress.setPhase(Progress::Phase::DEDUP, 2 * numExternalNames_);
 
-bool DirectoryData::writeNameTree(std::ostream& out)
-{
-	if (theIndex_.size() <= 1 || fileEntries_.empty())
+	auto pPartial = std::make_unique<ExternalEntrySorter>(tempDir_, "partial", budget,
+			ExternalEntryLess{ExternalEntryLess::BY_PARTIAL_HASH});
+	if(!hashExternal(*pScanned, *pPartial, false))
 	{
-		std::cerr << "Empty directory or no files!\n";
 		return false;
 	}
+	pScanned.reset();
 
-	//std::ostream out("logDump", std::ios::binary | std::ios::trunc);
-	
-	//write the number of nodes that will be written
-	DirTreeNode::writeRef(out, theIndex_.size());
-
-	for(auto* pNode : theIndex_)
+	pExternalEntries_ = std::make_unique<ExternalEntrySorter>(tempDir_, "full", budget,
+			ExternalEntryLess{ExternalEntryLess::BY_FULL_HASH});
+	if(!hashExternal(*pPartial, *pExternalEntries_, true))
 	{
-		pNode->write(out);
+		return false;
 	}
 
-	return true;
+	return pExternalEntries_->finish();
 }
 
-
-bool DirectoryData::readNameTree(std::istream& in)
+bool DirectoryData::ExternalEntryLess::operator()(const ExternalEntry& left, const ExternalEntry& right) const
 {
-	DirTreeNodeRef numNodes = DirTreeNode::readRef(in);
+	const auto& leftFile = left.file_;
+	const auto& rightFile = right.file_;
 
-	while(numNodes--)
+	switch(key_)
 	{
-		auto* pNode = new DirTreeNode(theIndex_);
-		pNode->read(in);
-		if(verbose) std::cout << "Node read: " << pNode->name_ << '\n';
+	case BY_INODE:
+		return std::tie(leftFile.size_, left.device_, left.inode_)
+			< std::tie(rightFile.size_, right.device_, right.inode_);
+	case BY_PARTIAL_HASH:
+		return std::tie(leftFile.size_, leftFile.partialHash_)
+			< std::tie(rightFile.size_, rightFile.partialHash_);
+	case BY_FULL_HASH:
+		return std::tie(leftFile.size_, leftFile.partialHash_, leftFile.fullHash_.high64, leftFile.fullHash_.low64)
+			< std::tie(rightFile.size_, rightFile.partialHash_, rightFile.fullHash_.high64, rightFile.fullHash_.low64);
 	}
-
-	if(verbose) std::cout << "Number of dir items=" << theIndex_.size() << '\n';
-
-	return true;
+	return false;
 }
 
-bool DirectoryData::writeFile(std::ostream& out, const FileInfo& file)
+//Depth first walk with the stack of the open directories, the nodes
+//are numbered in the walk order so the parent is always on the stack
+bool DirectoryData::scanExternal(ExternalEntrySorter& entries)
 {
-	//writing number of file names for this file 
-	if(file.dirRefs_.size() == 0)
-	{
-		std::cerr << "Warning: File with no names passed for writing.\n";
-		return true;
-	}
-
-	DirTreeNode::writeRef(out, file.dirRefs_.size());
-	for(DirTreeNodeRef nameRef : file.dirRefs_)
-	{
-		//writing name references for each file
-		//multiple file references for duplicates
-		DirTreeNode::writeRef(out, nameRef);
-	}
-
-	write_le(out, file.size_);
-	fs::path filePath = getFsFilePath(file.dirRefs_.at(0));
-	filePath = workDir_ / filePath;
-	if(verbose)
+	externalNodes_.open(tempDir_ / "nodes", std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+	if(!externalNodes_)
 	{
-		std::cout << "Full file path for writing=" << filePath << '\n';
-		std::cout << "file size for writing=" << file.size_ << '\n';
+		std::cerr << "Error: cannot create the temporary file in " << tempDir_ << '\n';
+		return false;
 	}
 
-	if(file.size_ == 0)
+	struct OpenDir
 	{
-		if(verbose) std::cout << "Empty file written\n";
-		return true;
-	}
-
-	std::ifstream fileIn(filePath, std::ios::binary);
-	if(!fileIn.good() || !out.good())
+		DirTreeNodeRef idx_;
+		//position of the node in the temporary file, the empty dir
+		//flag is the lowest bit of its first byte
+		std::streamoff offset_;
+		char firstByte_;
+		bool hasChildren_;
+	};
+	std::vector<OpenDir> dirs;
+
+	std::streamoff nodesSize = 0;
+	std::string node;
+
+	auto addNode = [&](DirTreeNodeRef parent, const std::string& name, bool isDir)
 	{
-		return false;
-	}
-	out << fileIn.rdbuf();
-	fileIn.close();
-
-	return true;
-}
+		if(name.size() > std::numeric_limits<uint8_t>::max())
+		{
+			std::cerr << "Error: name too long " << name << '\n';
+			return false;
+		}
 
-bool DirectoryData::writeFiles(std::ostream& out)
-{
-	//writing number of file to write
-	DirTreeNode::writeRef(out, fileEntries_.size());
+		DirTreeNodeRef idx = numExternalNodes_++;
 
-	FileInfo pendingFile{};
+		std::ostringstream nodeOut;
+		write_varint(nodeOut, static_cast<uint64_t>(idx - parent) << 1U);
+		nodeOut.put(static_cast<char>(name.size()));
+		nodeOut.write(name.data(), name.size());
+		node = nodeOut.str();
 
-	for(auto& file : fileEntries_)
-	{
-		if( pendingFile.size_ == file.size_ &&
-				pendingFile.partialHash_ == file.partialHash_ &&
-				pendingFile.fullHash_.high64 == file.fullHash_.high64 &&
-				pendingFile.fullHash_.low64 == file.fullHash_.low64)
+		if(isDir)
 		{
-			//aggregating list of names of same content files
-			if(verbose) std::cout << "writeFiles: Duplicate detected.\n";
-			pendingFile.dirRefs_.push_back(file.dirRefs_.at(0));
-			continue;
+			dirs.push_back({idx, nodesSize, node.front(), false});
 		}
 
-		if (!pendingFile.dirRefs_.empty() && !writeFile(out, pendingFile))
+		externalNodes_.write(node.data(), node.size());
+		nodesSize += node.size();
+		return externalNodes_.good();
+	};
+
+	//marking the directory empty if nothing was added to it
+	auto popDir = [&]()
+	{
+		const auto& dir = dirs.back();
+		if(!dir.hasChildren_)
 		{
-			return false;
+			externalNodes_.seekp(dir.offset_);
+			externalNodes_.put(static_cast<char>(dir.firstByte_ | 1));
+			externalNodes_.seekp(0, std::ios::end);
 		}
+		dirs.pop_back();
+	};
 
-		pendingFile.swap(file);
-		file.dirRefs_.clear();
+	if(!addNode(0, workDir_.filename().string(), true))
+	{
+		return false;
 	}
+	//the root is never an empty dir
+	dirs.back().hasChildren_ = true;
 
-	//after the loop ends we always have the pending file to write
-	return writeFile(out, pendingFile);
-}
-
-
-bool DirectoryData::unpackFiles(std::istream& in)
-{
-	//1MB buffer
-	std::array<char, IO_BUFFER_SIZE> buffer; 
-	if(verbose) std::cout << "IO_BUFFER_SIZE=" << IO_BUFFER_SIZE << '\n';
-
-	//Read the number of files
-	DirTreeNodeRef numFiles = DirTreeNode::readRef(in);
-	if(verbose) std::cout << numFiles << " to unpack\n";
+	const size_t workDirLength = workDir_.native().size() + 1;
 
-	while(numFiles--)
+	for (auto it = fs::recursive_directory_iterator(workDir_, fs::directory_options::skip_permission_denied);
+			it != fs::recursive_directory_iterator(); ++it)
 	{
-		FileInfo fileInfo{};
-		DirTreeNodeRef numNames = DirTreeNode::readRef(in);
-		while(numNames--)
+		const auto& dir_entry = *it;
+		if(verbose) std::cout << "preProcess: dir_entry=" << dir_entry << "\n";
+
+		//leaving the directories that were fully walked
+		while(dirs.size() > static_cast<size_t>(it.depth()) + 1)
 		{
-			DirTreeNodeRef ref = DirTreeNode::readRef(in);
-			fileInfo.dirRefs_.push_back(ref);
+			popDir();
 		}
 
-		auto path = getFsFilePath(fileInfo.dirRefs_.at(0),true);
-		if(verbose) std::cout << "Writing " << path << std::endl;
-		fs::create_directories(path.parent_path());
-		std::ofstream out(getFsFilePath(fileInfo.dirRefs_.at(0),true), std::ios::binary);
-
-		if(!out.good())
-			return false;
-
-		fileInfo.size_ = read_le<FileInfo::FileSizeType>(in);
-		if(verbose) std::cout << "file size read:" << fileInfo.size_ << '\n';
+		if (dir_entry.is_symlink())
+		{
+			std::cerr << "Warrning: Ignoring dir entry " << dir_entry
+				<< " of unsupported type.\nSymlinks are not supported.\n";
+			continue;
+		}
 
-		while (fileInfo.size_ > 0 && in )
+		if (!dir_entry.is_directory() && !dir_entry.is_regular_file())
 		{
-			auto chunk = std::min<std::streamsize>(buffer.size(), fileInfo.size_);
-			in.read(buffer.data(), chunk);
-			auto bytes_read = in.gcount();
-			out.write(buffer.data(), bytes_read);
-			fileInfo.size_ -= bytes_read;
+			std::cerr << "Warrning: Ignoring dir entry " << dir_entry
+				<< " of unsupported type.\nOnly normal files and directories are supported.\n";
+			continue;
 		}
 
-		out.close();
+		auto& parent = dirs.back();
+		DirTreeNodeRef parentIdx = parent.idx_;
+		std::string name = dir_entry.path().filename().string();
 
-		//make copies if more then one dirRef
-		if(fileInfo.dirRefs_.size() > 1)
+		if (dir_entry.is_regular_file())
 		{
-			bool first = true;
-			for( auto dirRef : fileInfo.dirRefs_)
+			std::ifstream f(dir_entry.path(), std::ios::binary);
+			if(!f.good())
+			{
+				std::cerr << dir_entry << " unreadable, skipping.\n";
+				continue;
+			}
+
+			parent.hasChildren_ = true;
+			DirTreeNodeRef ref = numExternalNodes_;
+			if(!addNode(parentIdx, name, false))
+			{
+				return false;
+			}
+			++numExternalNames_;
+			progress.addFiles(1);
+			progress.addBytes(dir_entry.file_size());
+
+			ExternalEntry entry;
+			entry.file_.size_ = dir_entry.file_size();
+			entry.file_.dirRefs_.push_back(ref);
+			entry.path_ = dir_entry.path().native().substr(workDirLength);
+
+			if(dir_entry.hard_link_count() > 1)
 			{
-				if(first)
+				struct stat st{};
+				if(::stat(dir_entry.path().c_str(), &st) == 0)
 				{
-					first = false;
-					continue;
+					entry.device_ = st.st_dev;
+					entry.inode_ = st.st_ino;
 				}
+			}
 
-				auto dupPath = getFsFilePath(dirRef,true);
-				fs::create_directories(dupPath.parent_path());
-				if(verbose) std::cout << "Copying file " << path << " to " << dupPath << "\n";
-				fs::copy_file(path, dupPath, fs::copy_options::overwrite_existing);
-				//The numFiles read at the beginning includes duplicates
-				//so we need the adjustment
-				numFiles--;
+			if(!entries.add(std::move(entry)))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			parent.hasChildren_ = true;
+			if(!addNode(parentIdx, name, true))
+			{
+				return false;
 			}
 		}
 	}
 
-	return true;
-}
-
-bool DirectoryData::write(std::ostream& out)
-{
-	std::cout << "Writing directory data.\n";
+	while(!dirs.empty())
+	{
+		popDir();
+	}
 
-	out.write(MAGIC_NUMBER.data(), MAGIC_NUMBER.size());
+	externalNodes_.flush();
 
-	if(!writeNameTree(out))
+	if(verbose)
 	{
-		std::cerr << "Name Tree writing falure.\n";
-		return false;
+		std::cout << "Number of files=" << numExternalNames_ << '\n';
+		std::cout << "Number of dir items=" << numExternalNodes_ << '\n';
+		std::cout << "Temporary runs=" << entries.numRuns() << '\n';
 	}
-	;
 
-	if(!writeFiles(out))
+	return externalNodes_.good();
+}
+
+//Merges the sorted runs of in, computes the partial (or full) hash of
+//the files that have a neighbour with the same size (and partial hash)
+//and passes all of them to out. Hard links, next to each other in the
+//inode order, become one entry.
+bool DirectoryData::hashExternal(ExternalEntrySorter& in, ExternalEntrySorter& out, bool fullHash)
+{
+	if(!in.finish())
 	{
-		std::cerr << "Files writing failure.\n";
 		return false;
 	}
 
+	ExternalEntry pending;
+	bool hasPending = in.next(pending);
+
+	auto nextFolded = [&](ExternalEntry& entry)
+	{
+		if(!hasPending)
+		{
+			return false;
+		}
+		entry = std::move(pending);
+
+		while((hasPending = in.next(pending)))
+		{
+			if(entry.inode_ == 0 || pending.inode_ != entry.inode_ || pending.device_ != entry.device_)
+			{
+				break;
+			}
+			for(DirTreeNodeRef ref : pending.file_.dirRefs_)
+			{
+				entry.file_.dirRefs_.push_back(ref | LINK_MASK);
+			}
+		}
+		return true;
+	};
+
+	auto sameGroup = [fullHash](const FileInfo& left, const FileInfo& right)
+	{
+		return left.size_ == right.size_ && (!fullHash || left.partialHash_ == right.partialHash_);
+	};
+
+	ExternalEntry current, next;
+	bool hasCurrent = nextFolded(current);
+	bool hasPrevious = false;
+	FileInfo previous;
+
+	while(hasCurrent)
+	{
+		bool hasNext = nextFolded(next);
+
+		//hashing only the files that can have a duplicate
+		bool isCandidate = (hasPrevious && sameGroup(previous, current.file_))
+			|| (hasNext && sameGroup(current.file_, next.file_));
+
+		previous.size_ = current.file_.size_;
+		previous.partialHash_ = current.file_.partialHash_;
+		hasPrevious = true;
+
+		//empty files are ok with 0 hashes
+		if(isCandidate && current.file_.size_ > 0)
+		{
+			fs::path filePath = workDir_ / current.path_;
+			bool hashedOk = fullHash ? computeFullHash(filePath, current.file_.size_, current.file_.fullHash_)
+				: computePartialHash(filePath, current.file_.size_, current.file_.partialHash_);
+			if(!hashedOk)
+			{
+				return false;
+			}
+		}
+
+		progress.addFiles(current.file_.dirRefs_.size());
+		if(!out.add(std::move(current)))
+		{
+			return false;
+		}
+
+		current = std::move(next);
+		hasCurrent = hasNext;
+	}
+
+	return true;
+}
+
+bool DirectoryData::writeExternal(std::ostream& out)
+{
+	if(numExternalNames_ == 0)
+	{
+		std::cerr << "Empty directory or no files!\n";
+		return false;
+	}
+
+	out.write(MAGIC_NUMBER_V15.data(), MAGIC_NUMBER_V15.size());
+
+	write_varint(out, numExternalNodes_);
+	externalNodes_.seekg(0);
+	out << externalNodes_.rdbuf();
+
+	write_varint(out, numExternalNames_);
+	progress.setTotals(numExternalNames_, 0);
+
+	//the same content files are next to each other, one record with
+	//all the names. A record is cut if the names get above the limit,
+	//the content is stored once more then.
+	ExternalEntry group, entry;
+	bool hasGroup = false;
+
+	while(pExternalEntries_->next(entry))
+	{
+		if(hasGroup && group.file_.isSameContent(entry.file_)
+				&& group.memoryUsage() < options_.memoryLimit / 4)
+		{
+			auto& refs = group.file_.dirRefs_;
+			refs.insert(refs.end(), entry.file_.dirRefs_.begin(), entry.file_.dirRefs_.end());
+			continue;
+		}
+
+		if(hasGroup && !writeFile(out, group.file_, workDir_ / group.path_))
+		{
+			return false;
+		}
+
+		group = std::move(entry);
+		hasGroup = true;
+	}
+
+	if(hasGroup && !writeFile(out, group.file_, workDir_ / group.path_))
+	{
+		return false;
+	}
+
+	return out.good();
+}
+
+void DirectoryData::removeTempDir()
+{
+	if(tempDir_.empty())
+	{
+		return;
+	}
+
+	pExternalEntries_.reset();
+	externalNodes_.close();
+
+	std::error_code ec;
+	fs::remove_all(tempDir_, ec);
+	tempDir_.clear();
+}
+
+//Returns the physical position of the first extent of the file
+//so reads can be scheduled in the disk order. If the filesystem
+//does not support FIEMAP the inode number is used instead, inodes
+//are usually allocated close to the data on ext4/xfs.
+uint64_t DirectoryData::getPhysicalOffset(const fs::path& filePath)
+{
+	int fd = ::open(filePath.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return 0;
+	}
+
+	//room for the header and a single extent
+	alignas(struct fiemap) char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)]{};
+	auto* pMap = reinterpret_cast<struct fiemap*>(request);
+
+	pMap->fm_start = 0;
+	pMap->fm_length = FIEMAP_MAX_OFFSET;
+	pMap->fm_extent_count = 1;
+
+	uint64_t offset = 0;
+	struct stat st{};
+
+	if(::ioctl(fd, FS_IOC_FIEMAP, pMap) == 0 && pMap->fm_mapped_extents > 0)
+	{
+		offset = pMap->fm_extents[0].fe_physical;
+	}
+	else if(::fstat(fd, &st) == 0)
+	{
+		offset = st.st_ino;
+	}
+
+	::close(fd);
+
+	if(verbose) std::cout << "getPhysicalOffset: " << filePath << " offset=" << offset << '\n';
+
+	return offset;
+}
+
+DirectoryData::FileGroup DirectoryData::readOrder(const FileGroup& group) const
+{
+	FileGroup order(group);
+
+	if(options_.physicalOrder)
+	{
+		std::sort(order.begin(), order.end(),
+			[this](FileTable::Index left, FileTable::Index right)
+			{
+				return fileTable_.physOffset(left) < fileTable_.physOffset(right);
+			});
+	}
+
+	return order;
+}
+
+bool DirectoryData::computeParialHshes(const FileGroup& group)
+{
+	if(verbose) std::cout << "computeParialHshes num=" << group.size() << '\n';
+	for (auto idx : readOrder(group))
+	{
+		//empty files are ok with 0 hashes
+		if(fileTable_.fileSize(idx) == 0)
+		{
+			continue;
+		}
+		fs::path filePath = getFsFilePath(fileTable_.firstName(idx));
+		filePath = workDir_ / filePath;
+
+		if(!computePartialHash(filePath, fileTable_.fileSize(idx), fileTable_.hashes(idx).partialHash_))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//Log files often share the first block (banners, rotated copies), the
+//sampled blocks spread over the file tell them apart before the full
+//hash reads them whole. Files not larger than the sample are hashed whole.
+bool DirectoryData::computePartialHash(const fs::path& filePath, FileInfo::FileSizeType size,
+		XXH64_hash_t& hash) const
+{
+	int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		std::cerr << "Could not open " << filePath << " for calculating parial hash.\n";
+		return false;
+	}
+	ioThrottle.startReading(fd);
+
+	uint64_t numBlocks = std::clamp(options_.hashSampleBlocks, 1U, Options::MAX_HASH_SAMPLE_BLOCKS);
+	uint64_t sampleSize = numBlocks * HASH_BUFFER_SIZE;
+
+	//each block is hashed as it is read, the sample is never held whole
+	const auto& kernels = HashKernels::get();
+	std::unique_ptr<void, void (*)(void*)> pState(kernels.createState_(), kernels.freeState_);
+	kernels.reset64_(pState.get(), 113);
+	std::vector<char> buffer(std::min<uint64_t>(size, HASH_BUFFER_SIZE));
+	size_t bytesRead = 0;
+
+	auto readBlock = [&](uint64_t offset, size_t length)
+	{
+		ioThrottle.beforeIo();
+		auto ret = ::pread(fd, buffer.data(), length, offset);
+		if(ret < 0)
+		{
+			return false;
+		}
+		ioThrottle.afterIo(ret);
+		ioThrottle.doneReading(fd, offset, ret);
+		kernels.update64_(pState.get(), buffer.data(), ret);
+		bytesRead += ret;
+		return true;
+	};
+
+	bool readOk = true;
+	if(size <= sampleSize)
+	{
+		for(uint64_t offset = 0; offset < size && readOk; offset += HASH_BUFFER_SIZE)
+		{
+			readOk = readBlock(offset, std::min<uint64_t>(HASH_BUFFER_SIZE, size - offset));
+		}
+	}
+	else
+	{
+		//the last block ends at the end of the file
+		uint64_t stride = numBlocks > 1 ? (size - HASH_BUFFER_SIZE) / (numBlocks - 1) : 0;
+		for(uint64_t block = 0; block < numBlocks && readOk; ++block)
+		{
+			uint64_t offset = (block + 1 == numBlocks && block > 0) ? size - HASH_BUFFER_SIZE : block * stride;
+			readOk = readBlock(offset, HASH_BUFFER_SIZE);
+		}
+	}
+	::close(fd);
+	progress.addBytes(bytesRead);
+
+	if(!readOk)
+	{
+		std::cerr << "Error: reading " << filePath << " for calculating parial hash failed.\n";
+		return false;
+	}
+
+	hash = kernels.digest64_(pState.get());
+
+	return true;
+}
+
+
+bool DirectoryData::computeFullHshes(const FileGroup& group)
+{
+	if(options_.verifyDuplicates)
+	{
+		return computeVerifiedHshes(group);
+	}
+
+	for (auto idx : readOrder(group))
+	{
+		//empty files are ok with 0 hashes
+		if(fileTable_.fileSize(idx) == 0)
+		{
+			continue;
+		}
+
+		fs::path filePath = getFsFilePath(fileTable_.firstName(idx));
+		filePath = workDir_ / filePath;
+
+		if(!computeFullHash(filePath, fileTable_.fileSize(idx), fileTable_.hashes(idx).fullHash_))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool DirectoryData::computeFullHash(const fs::path& filePath, FileInfo::FileSizeType size, XXH128_hash_t& hash)
+{
+	SourceFile fileIn(filePath);
+	if(!fileIn.good())
+	{
+		std::cerr << "Could not open " << filePath << " for calculating full hash.\n";
+		return false;
+	}
+
+	//holes are hashed as zeros without reading them
+	std::vector<FileExtent> extents;
+	if(!getDataExtents(filePath, size, extents))
+	{
+		extents.push_back({0, size});
+	}
+
+	ContentHasher hasher;
+	for(const auto& extent : extents)
+	{
+		hasher.skipTo(extent.offset_);
+		fileIn.seekg(extent.offset_);
+		copyData(fileIn, nullptr, extent.length_, &hasher);
+	}
+
+	hash = hasher.digest(size);
+
+	return true;
+}
+
+//Full hashes together with a byte by byte comparison. All candidates are
+//read in lockstep, each chunk is hashed and compared with the chunks of
+//the other files, so every file is still read only once. Files with the
+//same content end up with the same group_, the hash alone is not trusted.
+bool DirectoryData::computeVerifiedHshes(const FileGroup& group)
+{
+	auto order = readOrder(group);
+
+	//empty files are ok with 0 hashes and are all equal
+	if(order.empty() || fileTable_.fileSize(order.front()) == 0)
+	{
+		return true;
+	}
+
+	const auto& kernels = HashKernels::get();
+
+	//representative files of the groups from the previous batches
+	std::vector<FileTable::Index> groupReps;
+
+	for(size_t batchStart = 0; batchStart < order.size(); batchStart += VERIFY_MAX_OPEN)
+	{
+		size_t batchSize = std::min(VERIFY_MAX_OPEN, order.size() - batchStart);
+
+		size_t chunkSize = std::clamp(VERIFY_BUFFER_BUDGET / batchSize, HASH_BUFFER_SIZE, IO_BUFFER_SIZE);
+		chunkSize &= ~(IO_ALIGNMENT - 1);
+
+		//released with the aligned operator delete[] it was allocated with
+		auto alignedDelete = [](char* p) { ::operator delete[](p, std::align_val_t(IO_ALIGNMENT)); };
+		std::unique_ptr<char[], decltype(alignedDelete)> buffers(
+				new (std::align_val_t(IO_ALIGNMENT)) char[chunkSize * batchSize], alignedDelete);
+
+		struct Member
+		{
+			FileTable::Index file_{0};
+			int fd_{-1};
+			void* pState_{nullptr};
+			char* buffer_{nullptr};
+			size_t bytesRead_{0};
+			size_t group_{0};
+		};
+
+		std::vector<Member> members(batchSize);
+		bool ok = true;
+
+		for(size_t i = 0; i < batchSize; ++i)
+		{
+			auto& member = members[i];
+			member.file_ = order[batchStart + i];
+			member.buffer_ = buffers.get() + i * chunkSize;
+			member.pState_ = kernels.createState_();
+			kernels.reset_(member.pState_);
+
+			fs::path filePath = workDir_ / getFsFilePath(fileTable_.firstName(member.file_));
+			member.fd_ = ::open(filePath.c_str(), O_RDONLY);
+			if(member.fd_ < 0)
+			{
+				std::cerr << "Could not open " << filePath << " for calculating full hash.\n";
+				ok = false;
+			}
+			else
+			{
+				ioThrottle.startReading(member.fd_);
+			}
+		}
+
+		for(FileInfo::FileSizeType done = 0; ok && done < fileTable_.fileSize(order.front()); done += chunkSize)
+		{
+			for(auto& member : members)
+			{
+				member.bytesRead_ = 0;
+				while(member.bytesRead_ < chunkSize)
+				{
+					ioThrottle.beforeIo();
+					auto ret = ::read(member.fd_, member.buffer_ + member.bytesRead_, chunkSize - member.bytesRead_);
+					ioThrottle.afterIo(std::max<ssize_t>(ret, 0));
+					if(ret <= 0)
+					{
+						break;
+					}
+					member.bytesRead_ += ret;
+				}
+				ioThrottle.doneReading(member.fd_, done, member.bytesRead_);
+
+				kernels.update_(member.pState_, member.buffer_, member.bytesRead_);
+				progress.addBytes(member.bytesRead_);
+			}
+
+			//refining the groups, members stay together only if this chunk is equal too
+			std::vector<size_t> reps;
+			std::vector<size_t> newGroups(batchSize);
+			for(size_t i = 0; i < batchSize; ++i)
+			{
+				const auto& member = members[i];
+				auto repIt = std::find_if(reps.begin(), reps.end(),
+					[&](size_t rep)
+					{
+						const auto& other = members[rep];
+						return other.group_ == member.group_ && other.bytesRead_ == member.bytesRead_
+							&& std::memcmp(other.buffer_, member.buffer_, member.bytesRead_) == 0;
+					});
+
+				if(repIt == reps.end())
+				{
+					newGroups[i] = reps.size();
+					reps.push_back(i);
+				}
+				else
+				{
+					newGroups[i] = newGroups[*repIt];
+				}
+			}
+
+			for(size_t i = 0; i < batchSize; ++i)
+			{
+				members[i].group_ = newGroups[i];
+			}
+		}
+
+		//groups local to the batch -> groups of the whole range
+		std::vector<size_t> batchToRange;
+		for(auto& member : members)
+		{
+			if(member.fd_ >= 0)
+			{
+				::close(member.fd_);
+			}
+
+			auto& hashes = fileTable_.hashes(member.file_);
+			hashes.fullHash_ = kernels.digest_(member.pState_);
+			kernels.freeState_(member.pState_);
+
+			if(!ok)
+			{
+				continue;
+			}
+
+			if(member.group_ < batchToRange.size())
+			{
+				hashes.group_ = batchToRange[member.group_];
+				continue;
+			}
+
+			//first member of a new group, could still be equal to a group
+			//of an earlier batch, these are compared directly (rare case)
+			auto repIt = std::find_if(groupReps.begin(), groupReps.end(),
+				[&](FileTable::Index rep)
+				{
+					const auto& repHash = fileTable_.hashes(rep).fullHash_;
+					return repHash.high64 == hashes.fullHash_.high64 && repHash.low64 == hashes.fullHash_.low64
+						&& batchStart > 0 && compareFiles(rep, member.file_);
+				});
+
+			if(repIt == groupReps.end())
+			{
+				batchToRange.push_back(groupReps.size());
+				groupReps.push_back(member.file_);
+			}
+			else
+			{
+				batchToRange.push_back(std::distance(groupReps.begin(), repIt));
+			}
+
+			hashes.group_ = batchToRange.back();
+		}
+
+		if(!ok)
+		{
+			return false;
+		}
+	}
+
+	if(verbose) std::cout << "computeVerifiedHshes num=" << order.size() << " groups=" << groupReps.size() << '\n';
+
+	return true;
+}
+
+bool DirectoryData::compareFiles(FileTable::Index left, FileTable::Index right) const
+{
+	SourceFile leftIn(workDir_ / getFsFilePath(fileTable_.firstName(left)));
+	SourceFile rightIn(workDir_ / getFsFilePath(fileTable_.firstName(right)));
+
+	std::vector<char> leftBuff(IO_BUFFER_SIZE), rightBuff(IO_BUFFER_SIZE);
+
+	while(leftIn.good() && rightIn.good())
+	{
+		leftIn.read(leftBuff.data(), leftBuff.size());
+		rightIn.read(rightBuff.data(), rightBuff.size());
+
+		if(leftIn.gcount() != rightIn.gcount()
+				|| std::memcmp(leftBuff.data(), rightBuff.data(), leftIn.gcount()) != 0)
+		{
+			return false;
+		}
+	}
+
+	return leftIn.eof() && rightIn.eof();
+}
+
+//Name table layout (version 16):
+//number of nodes, nodes per block, number of blocks,
+//encoded and decoded size of each block, the blocks.
+//Per node: zigzag parent delta from the previous node with the empty
+//dir flag in the lowest bit, prefix length shared with the previous
+//name, suffix length, suffix. Each block starts without a previous
+//node so the blocks are decoded independently.
+bool DirectoryData::writeNameTree(std::ostream& out)
+{
+	if (theIndex_.size() <= 1 || fileTable_.empty())
+	{
+		std::cerr << "Empty directory or no files!\n";
+		return false;
+	}
+
+	const DirTreeNodeRef numNodes = theIndex_.size();
+
+	std::vector<std::string> blocks;
+	std::vector<size_t> blockNames;
+	for(DirTreeNodeRef first = 0; first < numNodes; first += NAME_BLOCK_NODES)
+	{
+		DirTreeNodeRef last = std::min<DirTreeNodeRef>(numNodes, first + NAME_BLOCK_NODES);
+
+		std::ostringstream block;
+		std::string_view prevName;
+		int64_t prevParent = 0;
+		size_t namesSize = 0;
+
+		for(DirTreeNodeRef idx = first; idx < last; ++idx)
+		{
+			const auto* pNode = theIndex_[idx];
+			int64_t parent = pNode->parent_ & ~DIR_MASK;
+			write_varint(block, (zigzag_encode(parent - prevParent) << 1U) | (pNode->isEmptyDir() ? 1U : 0U));
+
+			const auto& name = pNode->name_;
+			size_t shared = std::mismatch(name.begin(), name.begin() + std::min(name.size(), prevName.size()),
+					prevName.begin()).first - name.begin();
+			write_varint(block, shared);
+			write_varint(block, name.size() - shared);
+			block.write(name.data() + shared, name.size() - shared);
+
+			prevParent = parent;
+			prevName = name;
+			namesSize += name.size();
+		}
+
+		blocks.push_back(block.str());
+		blockNames.push_back(namesSize);
+	}
+
+	write_varint(out, numNodes);
+	write_varint(out, NAME_BLOCK_NODES);
+	write_varint(out, blocks.size());
+	for(size_t blockIdx = 0; blockIdx < blocks.size(); ++blockIdx)
+	{
+		write_varint(out, blocks[blockIdx].size());
+		write_varint(out, blockNames[blockIdx]);
+	}
+
+	for(const auto& block : blocks)
+	{
+		out.write(block.data(), block.size());
+	}
+
+	return out.good();
+}
+
+
+bool DirectoryData::readNameTree(std::istream& in)
+{
+	DirTreeNodeRef numNodes = readNumber(in);
+	theIndex_.reserve(theIndex_.size() + numNodes);
+
+	if(formatVersion_ < 16)
+	{
+		while(numNodes-- && in)
+		{
+			DirTreeNodeRef idx = theIndex_.size();
+			auto* pNode = new DirTreeNode(theIndex_);
+			pNode->read(in, idx, formatVersion_, names_);
+			//the parents come first, see decodeNameBlock
+			if(idx > 0 && (pNode->parent_ & ~DIR_MASK) >= idx)
+			{
+				std::cerr << "Error: corrupted name table.\n";
+				return false;
+			}
+			if(verbose) std::cout << "Node read: " << pNode->name_ << '\n';
+		}
+
+		if(verbose) std::cout << "Number of dir items=" << theIndex_.size() << '\n';
+
+		return in.good();
+	}
+
+	uint64_t blockNodes = read_varint(in);
+	uint64_t numBlocks = read_varint(in);
+	if(!in || numNodes == 0 || blockNodes == 0 || numBlocks != (numNodes + blockNodes - 1) / blockNodes)
+	{
+		std::cerr << "Error: corrupted name table.\n";
+		return false;
+	}
+
+	//offsets of the blocks in the encoded data and in the name arena
+	std::vector<size_t> encodedOffsets(numBlocks + 1, 0);
+	std::vector<size_t> namesOffsets(numBlocks + 1, 0);
+	for(size_t blockIdx = 0; blockIdx < numBlocks && in; ++blockIdx)
+	{
+		encodedOffsets[blockIdx + 1] = encodedOffsets[blockIdx] + read_varint(in);
+		namesOffsets[blockIdx + 1] = namesOffsets[blockIdx] + read_varint(in);
+	}
+
+	std::vector<char> encoded(encodedOffsets.back());
+	in.read(encoded.data(), encoded.size());
+	if(!in)
+	{
+		std::cerr << "Error: corrupted name table.\n";
+		return false;
+	}
+
+	//all names go to one piece of memory
+	char* pNames = names_.allocate(namesOffsets.back());
+
+	DirTreeNodeRef firstNode = theIndex_.size();
+	for(DirTreeNodeRef idx = 0; idx < numNodes; ++idx)
+	{
+		new DirTreeNode(theIndex_);
+	}
+
+	auto decodeBlocks = [&, this](size_t firstBlock, size_t lastBlock)
+	{
+		for(size_t blockIdx = firstBlock; blockIdx < lastBlock; ++blockIdx)
+		{
+			DirTreeNodeRef first = firstNode + blockIdx * blockNodes;
+			DirTreeNodeRef last = std::min<DirTreeNodeRef>(firstNode + numNodes, first + blockNodes);
+			if(!decodeNameBlock(encoded.data() + encodedOffsets[blockIdx], encoded.data() + encodedOffsets[blockIdx + 1],
+					pNames + namesOffsets[blockIdx], namesOffsets[blockIdx + 1] - namesOffsets[blockIdx], first, last))
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	bool decodedOk = true;
+	unsigned numThreads = options_.numThreads ? options_.numThreads : ThreadPool::defaultThreads();
+	if(numThreads > 1 && numBlocks >= NAME_PARALLEL_BLOCKS)
+	{
+		ThreadPool pool(numThreads);
+
+		//a few ranges per thread to even out the work
+		size_t numTasks = std::min<size_t>(numBlocks, pool.size() * 4);
+		std::vector<std::future<bool>> results;
+		for(size_t task = 0; task < numTasks; ++task)
+		{
+			size_t firstBlock = numBlocks * task / numTasks;
+			size_t lastBlock = numBlocks * (task + 1) / numTasks;
+			results.push_back(pool.submit([&decodeBlocks, firstBlock, lastBlock]()
+				{
+					return decodeBlocks(firstBlock, lastBlock);
+				}));
+		}
+
+		for(auto& result : results)
+		{
+			decodedOk = result.get() && decodedOk;
+		}
+	}
+	else
+	{
+		decodedOk = decodeBlocks(0, numBlocks);
+	}
+
+	if(!decodedOk)
+	{
+		std::cerr << "Error: corrupted name table.\n";
+		return false;
+	}
+
+	if(verbose)
+	{
+		for(DirTreeNodeRef idx = firstNode; idx < theIndex_.size(); ++idx)
+		{
+			std::cout << "Node read: " << theIndex_[idx]->name_ << '\n';
+		}
+		std::cout << "Number of dir items=" << theIndex_.size() << '\n';
+	}
+
+	return true;
+}
+
+//Decodes nodes [first, last) into the already allocated nodes,
+//the names go to pNames which has exactly namesSize bytes
+bool DirectoryData::decodeNameBlock(const char* pIn, const char* pEnd, char* pNames, size_t namesSize,
+		DirTreeNodeRef first, DirTreeNodeRef last)
+{
+	const char* pNamesEnd = pNames + namesSize;
+	std::string_view prevName;
+	int64_t prevParent = 0;
+
+	for(DirTreeNodeRef idx = first; idx < last; ++idx)
+	{
+		uint64_t parentCode = 0, shared = 0, suffixSize = 0;
+		if(!read_varint(pIn, pEnd, parentCode) || !read_varint(pIn, pEnd, shared)
+				|| !read_varint(pIn, pEnd, suffixSize))
+		{
+			return false;
+		}
+
+		if(shared > prevName.size() || suffixSize > static_cast<size_t>(pEnd - pIn)
+				|| shared + suffixSize > static_cast<size_t>(pNamesEnd - pNames))
+		{
+			return false;
+		}
+
+		//the parents come first, a later one could make a cycle
+		//that getFsFilePath would follow forever
+		int64_t parent = prevParent + zigzag_decode(parentCode >> 1U);
+		if(parent < 0 || (idx > 0 && parent >= static_cast<int64_t>(idx)))
+		{
+			return false;
+		}
+
+		//the previous name is right before in the arena
+		std::copy(prevName.begin(), prevName.begin() + shared, pNames);
+		std::copy(pIn, pIn + suffixSize, pNames + shared);
+		pIn += suffixSize;
+
+		auto* pNode = theIndex_[idx];
+		pNode->parent_ = parent;
+		pNode->setIsEmptyDir(parentCode & 1U);
+		pNode->name_ = std::string_view(pNames, shared + suffixSize);
+
+		prevParent = parent;
+		prevName = pNode->name_;
+		pNames += pNode->name_.size();
+	}
+
+	return pIn == pEnd && pNames == pNamesEnd;
+}
+
+bool DirectoryData::writeFile(std::ostream& out, const FileInfo& file) const
+{
+	//writing number of file names for this file 
+	if(file.dirRefs_.size() == 0)
+	{
+		std::cerr << "Warning: File with no names passed for writing.\n";
+		return true;
+	}
+
+	return writeFile(out, file, workDir_ / getFsFilePath(file.dirRefs_.at(0)));
+}
+
+bool DirectoryData::writeFile(std::ostream& out, const FileInfo& file, const fs::path& filePath) const
+{
+	if(verbose)
+	{
+		std::cout << "Full file path for writing=" << filePath << '\n';
+		std::cout << "file size for writing=" << file.size_ << '\n';
+	}
+
+	FileRecord record;
+	record.file_ = file;
+	//the content hash is computed while the data is copied
+	record.flags_ = FileInfo::RECORD_HASH;
+
+	struct stat st{};
+	if(::stat(filePath.c_str(), &st) == 0)
+	{
+		record.flags_ |= FileInfo::RECORD_MTIME;
+		record.mtime_ = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+	}
+
+	//the bounded memory scan writes version 15 archives, without the ranges
+	if(options_.memoryLimit == 0 && LogTime::detectRange(filePath, file.size_,
+			(record.flags_ & FileInfo::RECORD_MTIME) ? st.st_mtim.tv_sec : std::time(nullptr),
+			record.timeFirst_, record.timeLast_))
+	{
+		record.flags_ |= FileInfo::RECORD_TIMERANGE;
+		if(verbose) std::cout << "Log time range " << record.timeFirst_ << ".." << record.timeLast_ << '\n';
+	}
+
+	auto& extents = record.extents_;
+	if(file.size_ > 0 && getDataExtents(filePath, file.size_, extents))
+	{
+		record.flags_ |= FileInfo::RECORD_SPARSE;
+		if(verbose) std::cout << "Sparse file, data extents=" << extents.size() << '\n';
+	}
+	else if(pStore_ && file.size_ > 0)
+	{
+		//the sparse files stay in the archive, the blobs hold whole contents
+		return writeStoredFile(out, record, filePath);
+	}
+
+	if(!writeFileRecord(out, record))
+	{
+		return false;
+	}
+
+	ContentHasher hasher;
+
+	if(file.size_ == 0)
+	{
+		if(verbose) std::cout << "Empty file written\n";
+		ContentHasher::write(out, hasher.digest(0));
+		progress.addFiles(file.dirRefs_.size());
+		return out.good();
+	}
+
+	SourceFile fileIn(filePath);
+	if(!fileIn.good() || !out.good())
+	{
+		return false;
+	}
+
+	if(!(record.flags_ & FileInfo::RECORD_SPARSE))
+	{
+		extents.push_back({0, file.size_});
+	}
+
+	//only the data extents are stored, holes are recreated on unpack
+	FileInfo::FileSizeType holeBytes = file.size_;
+	for(const auto& extent : extents)
+	{
+		hasher.skipTo(extent.offset_);
+		fileIn.seekg(extent.offset_);
+		if(!copyData(fileIn, &out, extent.length_, &hasher))
+		{
+			std::cerr << "Error: reading " << filePath << " failed, was it modified?\n";
+			return false;
+		}
+		holeBytes -= extent.length_;
+	}
+	fileIn.close();
+	progress.addFiles(file.dirRefs_.size());
+	progress.addBytes(holeBytes);
+
+	ContentHasher::write(out, hasher.digest(file.size_));
+
+	return out.good();
+}
+
+//The content goes to the store unless it is there already, the
+//archive gets only the record with the blob key and the checksum
+bool DirectoryData::writeStoredFile(std::ostream& out, FileRecord& record, const fs::path& filePath) const
+{
+	const auto& file = record.file_;
+	auto& hash = record.storeKey_;
+	if(!computeFullHash(filePath, file.size_, hash))
+	{
+		return false;
+	}
+
+	bool isNew = !pStore_->contains(hash);
+	if(isNew && !pStore_->add(filePath, file.size_, hash))
+	{
+		return false;
+	}
+
+	record.flags_ |= FileInfo::RECORD_STORED;
+	if(!writeFileRecord(out, record))
+	{
+		return false;
+	}
+	ContentHasher::write(out, hash);
+	progress.addFiles(file.dirRefs_.size());
+
+	//counted in the store once the archive is complete
+	std::lock_guard<std::mutex> lock(storeMutex_);
+	storeRefs_.push_back(hash);
+	numStoreAdded_ += isNew ? 1 : 0;
+
+	return out.good();
+}
+
+//Finds the data extents of the file with SEEK_DATA/SEEK_HOLE.
+//Returns true only if the file has holes, extents are then filled.
+//Filesystems without the support report the whole file as data.
+bool DirectoryData::getDataExtents(const fs::path& filePath, FileInfo::FileSizeType size,
+		std::vector<FileExtent>& extents)
+{
+	extents.clear();
+
+	int fd = ::open(filePath.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	bool isSparse = true;
+	off_t offset = 0;
+	while(offset < static_cast<off_t>(size))
+	{
+		off_t dataStart = ::lseek(fd, offset, SEEK_DATA);
+		if(dataStart < 0)
+		{
+			//ENXIO - no more data till the end of the file,
+			//anything else - SEEK_DATA not supported
+			isSparse = (errno == ENXIO);
+			break;
+		}
+
+		if(dataStart >= static_cast<off_t>(size))
+		{
+			break;
+		}
+
+		off_t dataEnd = ::lseek(fd, dataStart, SEEK_HOLE);
+		if(dataEnd < 0 || dataEnd > static_cast<off_t>(size))
+		{
+			dataEnd = size;
+		}
+
+		extents.push_back({static_cast<FileInfo::FileSizeType>(dataStart),
+				static_cast<FileInfo::FileSizeType>(dataEnd - dataStart)});
+		offset = dataEnd;
+	}
+
+	::close(fd);
+
+	if(isSparse && extents.size() == 1 && extents.front().offset_ == 0
+			&& extents.front().length_ == size)
+	{
+		isSparse = false;
+	}
+
+	if(!isSparse)
+	{
+		extents.clear();
+	}
+
+	return isSparse;
+}
+
+//The extra names of an extracted file: only the data extents are
+//copied, the holes stay holes. copy_file_range lets the filesystem
+//share or clone the blocks, read and write is the fallback.
+bool DirectoryData::copySparseFile(const fs::path& from, const fs::path& to, FileInfo::FileSizeType size)
+{
+	std::vector<FileExtent> extents;
+	if(!getDataExtents(from, size, extents))
+	{
+		extents.assign(1, FileExtent{0, size});
+	}
+
+	int inFd = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	int outFd = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	bool copiedOk = inFd >= 0 && outFd >= 0;
+	std::vector<char> buffer;
+
+	for(const auto& extent : extents)
+	{
+		loff_t inOffset = extent.offset_, outOffset = extent.offset_;
+		uint64_t remaining = extent.length_;
+		while(copiedOk && remaining > 0)
+		{
+			ssize_t ret = buffer.empty() ? ::copy_file_range(inFd, &inOffset, outFd, &outOffset, remaining, 0) : -1;
+			if(ret < 0 && (!buffer.empty() || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				buffer.resize(IO_BUFFER_SIZE);
+				ret = ::pread(inFd, buffer.data(), std::min<uint64_t>(buffer.size(), remaining), inOffset);
+				if(ret > 0 && ::pwrite(outFd, buffer.data(), ret, outOffset) != ret)
+				{
+					ret = -1;
+				}
+				inOffset += std::max<ssize_t>(ret, 0);
+				outOffset += std::max<ssize_t>(ret, 0);
+			}
+
+			copiedOk = ret > 0;
+			remaining -= std::max<ssize_t>(ret, 0);
+		}
+	}
+
+	//the trailing hole
+	copiedOk = copiedOk && ::ftruncate(outFd, size) == 0;
+
+	if(inFd >= 0) ::close(inFd);
+	if(outFd >= 0 && ::close(outFd) != 0)
+	{
+		copiedOk = false;
+	}
+
+	return copiedOk;
+}
+
+//Copies length bytes, the output and the hasher are optional
+bool DirectoryData::copyData(std::istream& in, std::ostream* pOut, FileInfo::FileSizeType length,
+		ContentHasher* pHasher)
+{
+	std::vector<char> buffer(std::min<size_t>(IO_BUFFER_SIZE, length));
+
+	while(length > 0)
+	{
+		auto chunk = std::min<std::streamsize>(buffer.size(), length);
+		in.read(buffer.data(), chunk);
+		auto bytesRead = in.gcount();
+		if(bytesRead == 0)
+		{
+			return false;
+		}
+
+		if(pHasher) pHasher->update(buffer.data(), bytesRead);
+		if(pOut) pOut->write(buffer.data(), bytesRead);
+		length -= bytesRead;
+		progress.addBytes(bytesRead);
+	}
+
+	return in.good() && (pOut == nullptr || pOut->good());
+}
+
+bool DirectoryData::writeFiles(std::ostream& out)
+{
+	std::vector<FileTable::Index> order;
+	if(resuming_)
+	{
+		//the checkpoint has the files already merged and in the write order
+		order.resize(fileTable_.size());
+		std::iota(order.begin(), order.end(), 0);
+
+		uint64_t numNames = 0, totalBytes = 0;
+		for(FileTable::Index idx : order)
+		{
+			numNames += fileTable_.numNames(idx);
+			totalBytes += fileTable_.fileSize(idx);
+		}
+		progress.setTotals(numNames, totalBytes);
+	}
+	else
+	{
+		order = writeOrder();
+	}
+
+	if(options_.checkpointInterval == 0)
+	{
+		return writeRecords(out, order);
+	}
+
+	if(!resuming_ && !startCheckpoint(order))
+	{
+		return false;
+	}
+
+	uint64_t pendingBytes = 0;
+	auto afterFile = [&, this](size_t filesDone)
+	{
+		pendingBytes += fileTable_.fileSize(order[filesDone - 1]);
+		if(pendingBytes < options_.checkpointInterval)
+		{
+			return true;
+		}
+		pendingBytes = 0;
+		return commitCheckpoint(filesDone);
+	};
+
+	return writeRecords(out, order, resumeFiles_, afterFile);
+}
+
+//Merges the duplicates and returns the files to write.
+//The archive records carry their own name references so the order
+//in which they are written does not change the extracted layout.
+//This lets us follow the disk layout when reading the sources.
+std::vector<FileTable::Index> DirectoryData::writeOrder()
+{
+	mergeDuplicates();
+
+	std::vector<FileTable::Index> order;
+	order.reserve(fileTable_.size());
+	for(FileTable::Index idx = 0; idx < fileTable_.size(); ++idx)
+	{
+		//merged duplicates have no names left
+		if(fileTable_.firstName(idx) != 0)
+		{
+			order.push_back(idx);
+		}
+	}
+
+	uint64_t numNames = 0, totalBytes = 0;
+	for(FileTable::Index idx : order)
+	{
+		numNames += fileTable_.numNames(idx);
+		totalBytes += fileTable_.fileSize(idx);
+	}
+	progress.setTotals(numNames, totalBytes);
+
+	if(options_.physicalOrder)
+	{
+		std::stable_sort(order.begin(), order.end(),
+			[this](FileTable::Index left, FileTable::Index right)
+			{
+				return fileTable_.physOffset(left) < fileTable_.physOffset(right);
+			});
+	}
+
+	return order;
+}
+
+bool DirectoryData::writeRecords(std::ostream& out, const std::vector<FileTable::Index>& files,
+		size_t firstFile, const std::function<bool(size_t)>& afterFile) const
+{
+	//writing number of file names to write, duplicates included,
+	//a resumed archive has it already
+	if(firstFile == 0)
+	{
+		DirTreeNodeRef numNames = 0;
+		for(FileTable::Index idx : files)
+		{
+			numNames += fileTable_.numNames(idx);
+		}
+		write_varint(out, numNames);
+	}
+
+	FileInfo file;
+	for(size_t pos = firstFile; pos < files.size(); ++pos)
+	{
+		file.size_ = fileTable_.fileSize(files[pos]);
+		file.dirRefs_ = fileTable_.names(files[pos]);
+		if (!writeFile(out, file))
+		{
+			return false;
+		}
+
+		if(afterFile && !afterFile(pos + 1))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//Checkpoint file layout:
+//magic, source directory, compression and frame size, checkpoint
+//interval, le64 archive id, name table, number of files and per file in the write
+//order: size, number of names, names. This is everything the scan
+//and the duplicate search produced. Then the commits are appended:
+//le64 files written, le64 durable archive size, le64 XXH64 of both.
+bool DirectoryData::startCheckpoint(const std::vector<FileTable::Index>& order)
+{
+	fs::path path = checkpointPath();
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(MAGIC_NUMBER_CHECKPOINT.data(), MAGIC_NUMBER_CHECKPOINT.size());
+
+		const auto& dir = workDir_.native();
+		write_varint(out, dir.size());
+		out.write(dir.data(), dir.size());
+		out.put(options_.compress ? 1 : 0);
+		write_varint(out, options_.frameSize);
+		write_varint(out, options_.checkpointInterval);
+		write_le(out, archiveId_);
+
+		if(!writeNameTree(out))
+		{
+			return false;
+		}
+
+		write_varint(out, order.size());
+		for(FileTable::Index idx : order)
+		{
+			write_varint(out, fileTable_.fileSize(idx));
+			write_varint(out, fileTable_.numNames(idx));
+			for(DirTreeNodeRef ref : fileTable_.names(idx))
+			{
+				write_varint(out, ref);
+			}
+		}
+
+		out.close();
+		if(!out)
+		{
+			std::cerr << "Error: writing the checkpoint " << path << " failed.\n";
+			return false;
+		}
+	}
+
+	checkpointFd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if(checkpointFd_ < 0 || ::fdatasync(checkpointFd_) != 0)
+	{
+		std::cerr << "Error: writing the checkpoint " << path << " failed.\n";
+		return false;
+	}
+
+	if(verbose) std::cout << "Checkpoint started " << path << '\n';
+
+	return true;
+}
+
+//Makes the archive durable up to the end of the filesDone-th file and
+//records that in the checkpoint
+bool DirectoryData::commitCheckpoint(size_t filesDone)
+{
+	uint64_t archiveSize = 0;
+	if(!checkpointSync_ || !checkpointSync_(archiveSize))
+	{
+		std::cerr << "Error: syncing the archive for the checkpoint failed.\n";
+		return false;
+	}
+
+	std::array<char, 24> entry{};
+	uint64_t fields[2] = {filesDone, archiveSize};
+	for(size_t field = 0; field < 2; ++field)
+	{
+		for(size_t byte = 0; byte < 8; ++byte)
+		{
+			entry[field * 8 + byte] = static_cast<char>(fields[field] >> (8U * byte));
+		}
+	}
+	uint64_t hash = XXH64(entry.data(), 16, 0);
+	for(size_t byte = 0; byte < 8; ++byte)
+	{
+		entry[16 + byte] = static_cast<char>(hash >> (8U * byte));
+	}
+
+	if(::write(checkpointFd_, entry.data(), entry.size()) != static_cast<ssize_t>(entry.size())
+			|| ::fdatasync(checkpointFd_) != 0)
+	{
+		std::cerr << "Error: writing the checkpoint failed.\n";
+		return false;
+	}
+
+	if(verbose) std::cout << "Checkpoint: " << filesDone << " files, archive size " << archiveSize << '\n';
+
+	return true;
+}
+
+//--resume: the scan and the duplicate search are replaced by the
+//state saved in the checkpoint, writing continues after the last
+//commit (or from the start if there was none)
+bool DirectoryData::resumeFromCheckpoint(const std::string& directory)
+{
+	workDir_ = fs::canonical(directory);
+
+	fs::path path = checkpointPath();
+	std::ifstream in(path, std::ios::binary);
+	std::array<char, MAGIC_NUMBER_CHECKPOINT.size()> magicNumBuff{};
+	in.read(magicNumBuff.data(), magicNumBuff.size());
+	if(!in || magicNumBuff != MAGIC_NUMBER_CHECKPOINT)
+	{
+		std::cerr << "Error: no checkpoint " << path << " to resume from.\n";
+		return false;
+	}
+
+	std::string dir(read_varint(in), '\0');
+	in.read(dir.data(), dir.size());
+	if(!in || dir != workDir_.native())
+	{
+		std::cerr << "Error: the checkpoint is for " << dir << ", not " << workDir_ << ".\n";
+		return false;
+	}
+
+	options_.compress = (in.get() == 1);
+	options_.frameSize = read_varint(in);
+	options_.checkpointInterval = read_varint(in);
+	//the header written before the checkpoint has it
+	archiveId_ = read_le<uint64_t>(in);
+
+	formatVersion_ = 18;
+	if(!in || !readNameTree(in))
+	{
+		std::cerr << "Error: corrupted checkpoint.\n";
+		return false;
+	}
+
+	uint64_t numFiles = read_varint(in);
+	fileTable_.reserve(numFiles);
+	for(uint64_t file = 0; file < numFiles && in; ++file)
+	{
+		uint64_t size = read_varint(in);
+		uint64_t numNames = read_varint(in);
+		if(numNames == 0)
+		{
+			in.setstate(std::ios::failbit);
+			break;
+		}
+
+		auto idx = fileTable_.add(size, read_varint(in));
+		while(--numNames)
+		{
+			fileTable_.addName(idx, read_varint(in));
+		}
+	}
+
+	if(!in)
+	{
+		std::cerr << "Error: corrupted checkpoint.\n";
+		return false;
+	}
+
+	//the last complete commit wins, a torn one at the end is ignored
+	std::array<char, 24> entry{};
+	while(in.read(entry.data(), entry.size()))
+	{
+		uint64_t fields[3] = {};
+		for(size_t field = 0; field < 3; ++field)
+		{
+			for(size_t byte = 0; byte < 8; ++byte)
+			{
+				fields[field] |= static_cast<uint64_t>(static_cast<unsigned char>(entry[field * 8 + byte])) << (8U * byte);
+			}
+		}
+
+		if(fields[2] != XXH64(entry.data(), 16, 0) || fields[0] > numFiles)
+		{
+			break;
+		}
+		resumeFiles_ = fields[0];
+		resumeOffset_ = fields[1];
+	}
+
+	checkpointFd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if(checkpointFd_ < 0)
+	{
+		std::cerr << "Error: cannot open the checkpoint " << path << '\n';
+		return false;
+	}
+
+	resuming_ = true;
+	std::cout << "Resuming " << workDir_ << " after " << resumeFiles_ << " of " << numFiles << " files\n";
+
+	return true;
+}
+
+//The archive is complete, the checkpoint is not needed any more
+void DirectoryData::finishCheckpoint()
+{
+	if(checkpointFd_ < 0)
+	{
+		return;
+	}
+
+	::close(checkpointFd_);
+	checkpointFd_ = -1;
+
+	std::error_code ec;
+	fs::remove(checkpointPath(), ec);
+}
+
+fs::path DirectoryData::checkpointPath() const
+{
+	return options_.archivePath.string() + ".ckpt";
+}
+
+//Collapsing the entries with the same content into one with
+//the list of all names. The same content files are next to each
+//other in duplicateCandidates_, the merged entries lose their names
+//and are skipped when writing.
+void DirectoryData::mergeDuplicates()
+{
+	const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+	uint32_t lastIdx = NONE;
+
+	for(uint32_t idx : duplicateCandidates_)
+	{
+		if(lastIdx != NONE && fileTable_.isSameContent(idx, lastIdx))
+		{
+			//aggregating list of names of same content files
+			if(verbose) std::cout << "mergeDuplicates: Duplicate detected.\n";
+			fileTable_.mergeNames(lastIdx, idx);
+			continue;
+		}
+
+		lastIdx = idx;
+	}
+
+	std::vector<uint32_t>().swap(duplicateCandidates_);
+}
+
+
+bool DirectoryData::writeFileRecord(std::ostream& out, const FileRecord& record)
+{
+	const auto& file = record.file_;
+
+	write_varint(out, file.dirRefs_.size());
+
+	//writing name references for each file, multiple references for
+	//duplicates. Each one is the zigzag distance from the previous,
+	//the lowest bit carries the hard link flag.
+	int64_t prevRef = 0;
+	for(DirTreeNodeRef nameRef : file.dirRefs_)
+	{
+		int64_t ref = nameRef & ~LINK_MASK;
+		uint64_t isLink = (nameRef & LINK_MASK) ? 1U : 0U;
+		write_varint(out, (zigzag_encode(ref - prevRef) << 1U) | isLink);
+		prevRef = ref;
+	}
+
+	write_varint(out, file.size_);
+	write_le(out, record.flags_);
+
+	if(record.flags_ & FileInfo::RECORD_MTIME)
+	{
+		write_varint(out, zigzag_encode(record.mtime_));
+	}
+
+	if(record.flags_ & FileInfo::RECORD_TIMERANGE)
+	{
+		write_varint(out, zigzag_encode(record.timeFirst_));
+		write_varint(out, record.timeLast_ - record.timeFirst_);
+	}
+
+	if(record.flags_ & FileInfo::RECORD_STORED)
+	{
+		ContentHasher::write(out, record.storeKey_);
+	}
+
+	if(record.flags_ & FileInfo::RECORD_SPARSE)
+	{
+		//extent offsets are stored as the gap after the previous extent
+		write_varint(out, record.extents_.size());
+		FileInfo::FileSizeType prevEnd = 0;
+		for(const auto& extent : record.extents_)
+		{
+			write_varint(out, extent.offset_ - prevEnd);
+			write_varint(out, extent.length_);
+			prevEnd = extent.offset_ + extent.length_;
+		}
+	}
+
+	return out.good();
+}
+
+bool DirectoryData::readFileRecord(std::istream& in, FileRecord& record)
+{
+	auto& fileInfo = record.file_;
+	fileInfo.dirRefs_.clear();
+	record.extents_.clear();
+
+	const bool isVarint = formatVersion_ >= 15;
+
+	DirTreeNodeRef numNames = readNumber(in);
+	int64_t prevRef = 0;
+	while(numNames-- && in)
+	{
+		if(isVarint)
+		{
+			uint64_t encoded = read_varint(in);
+			prevRef += zigzag_decode(encoded >> 1U);
+			DirTreeNodeRef ref = static_cast<DirTreeNodeRef>(prevRef);
+			fileInfo.dirRefs_.push_back((encoded & 1U) ? (ref | LINK_MASK) : ref);
+		}
+		else
+		{
+			fileInfo.dirRefs_.push_back(DirTreeNode::readRef(in));
+		}
+	}
+
+	fileInfo.size_ = readNumber(in);
+	if(verbose) std::cout << "file size read:" << fileInfo.size_ << '\n';
+
+	record.flags_ = (formatVersion_ >= 14) ? read_le<uint8_t>(in) : 0;
+
+	if(record.flags_ & FileInfo::RECORD_MTIME)
+	{
+		record.mtime_ = isVarint ? zigzag_decode(read_varint(in)) : read_le<int64_t>(in);
+	}
+	else
+	{
+		record.mtime_ = 0;
+	}
+
+	if(record.flags_ & FileInfo::RECORD_TIMERANGE)
+	{
+		record.timeFirst_ = zigzag_decode(read_varint(in));
+		record.timeLast_ = record.timeFirst_ + static_cast<int64_t>(read_varint(in));
+	}
+
+	if(record.flags_ & FileInfo::RECORD_STORED)
+	{
+		record.storeKey_ = ContentHasher::read(in);
+	}
+
+	if(record.flags_ & FileInfo::RECORD_SPARSE)
+	{
+		DirTreeNodeRef numExtents = readNumber(in);
+		FileInfo::FileSizeType prevEnd = 0;
+		while(numExtents-- && in)
+		{
+			auto& extent = record.extents_.emplace_back();
+			extent.offset_ = readNumber(in) + (isVarint ? prevEnd : 0);
+			extent.length_ = readNumber(in);
+			prevEnd = extent.offset_ + extent.length_;
+		}
+		if(verbose) std::cout << "sparse file, data extents=" << record.extents_.size() << '\n';
+	}
+	else
+	{
+		record.extents_.push_back({0, fileInfo.size_});
+	}
+
+	if(!in || fileInfo.dirRefs_.empty())
+	{
+		std::cerr << "Error: corrupted file record.\n";
+		return false;
+	}
+
+	return true;
+}
+
+//Jumps over the payload, seeking when the stream allows it,
+//otherwise (compressed stream) the data is decoded and dropped
+bool DirectoryData::skipData(std::istream& in, const FileRecord& record, bool withChecksum)
+{
+	std::streamoff length = record.storedSize();
+	if(withChecksum && (record.flags_ & FileInfo::RECORD_HASH))
+	{
+		length += sizeof(XXH128_hash_t);
+	}
+
+	if(length == 0)
+	{
+		return true;
+	}
+
+	if(!in.seekg(length, std::ios::cur))
+	{
+		in.clear();
+		in.ignore(length);
+		return in.gcount() == length;
+	}
+
+	return true;
+}
+
+bool DirectoryData::unpackFiles(std::istream& in, VolumeInfo* pDecoded)
+{
+	if(verbose) std::cout << "IO_BUFFER_SIZE=" << IO_BUFFER_SIZE << '\n';
+
+	//Read the number of files
+	DirTreeNodeRef numFiles = readNumber(in);
+	if(pDecoded) pDecoded->numNames_ = numFiles;
+	if(verbose) std::cout << numFiles << " to unpack\n";
+	if(volumes_.empty()) progress.setPhase(Progress::Phase::EXTRACT, numFiles);
+
+	FileRecord record;
+	const auto& fileInfo = record.file_;
+	bool checksumOk = true;
+	size_t numUpToDate = 0, numWritten = 0;
+
+	while(numFiles--)
+	{
+		if(!readFileRecord(in, record))
+		{
+			return false;
+		}
+		if(pDecoded) pDecoded->payloadBytes_ += record.file_.size_;
+
+		//The numFiles read at the beginning includes duplicates
+		//so we need the adjustment
+		numFiles -= fileInfo.dirRefs_.size() - 1;
+		progress.addFiles(fileInfo.dirRefs_.size());
+
+		//the data goes to the first wanted name, the other
+		//wanted names are copies or links of it
+		auto firstWanted = std::find_if(fileInfo.dirRefs_.begin(), fileInfo.dirRefs_.end(),
+				[this](DirTreeNodeRef ref) { return isWanted(ref); });
+
+		if(firstWanted == fileInfo.dirRefs_.end() || !isInTimeRange(record))
+		{
+			if(verbose) std::cout << "Skipping " << getFsFilePath(fileInfo.dirRefs_.at(0),true) << '\n';
+			if(!skipData(in, record))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		auto path = getFsFilePath(*firstWanted,true);
+		fs::create_directories(path.parent_path());
+
+		if(options_.update && isUpToDate(path, record))
+		{
+			if(verbose) std::cout << "Up to date " << path << std::endl;
+			++numUpToDate;
+			if(!skipData(in, record))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			//same size target is only patched where the content differs
+			bool inPlace = options_.update && !(record.flags_ & FileInfo::RECORD_SPARSE)
+				&& fs::is_regular_file(path) && fs::file_size(path) == fileInfo.size_;
+
+			if(verbose) std::cout << (inPlace ? "Updating " : "Writing ") << path << std::endl;
+
+			std::unique_ptr<std::istream> pBlob;
+			std::istream* pData = dataStream(in, record, pBlob);
+			if(!pData)
+			{
+				return false;
+			}
+
+			ContentHasher hasher;
+			if(!(inPlace ? updateData(*pData, path, record, hasher) : writeData(*pData, path, record, hasher)))
+			{
+				std::cerr << "Error: writing " << path << " failed.\n";
+				return false;
+			}
+
+			if(record.flags_ & FileInfo::RECORD_HASH)
+			{
+				auto expected = ContentHasher::read(in);
+				if(!ContentHasher::isEqual(expected, hasher.digest(fileInfo.size_)))
+				{
+					std::cerr << "Error: checksum mismatch for " << path << '\n';
+					checksumOk = false;
+				}
+			}
+
+			if(record.flags_ & FileInfo::RECORD_SPARSE)
+			{
+				//trailing hole
+				fs::resize_file(path, fileInfo.size_);
+			}
+
+			setModificationTime(path, record);
+			++numWritten;
+		}
+
+		//make copies if more then one dirRef
+		//last extracted name of the current inode, the target for hard links
+		fs::path linkTarget = path;
+		for(auto refIt = std::next(firstWanted); refIt != fileInfo.dirRefs_.end(); ++refIt)
+		{
+			auto dirRef = *refIt;
+			bool isLink = (dirRef & LINK_MASK);
+			if(!isLink)
+			{
+				linkTarget.clear();
+			}
+
+			if(!isWanted(dirRef))
+			{
+				continue;
+			}
+
+			auto dupPath = getFsFilePath(dirRef,true);
+			fs::create_directories(dupPath.parent_path());
+
+			if(isLink && options_.hardLinks && !linkTarget.empty())
+			{
+				std::error_code ec;
+				if(!(options_.update && fs::equivalent(linkTarget, dupPath, ec)))
+				{
+					//link to the previous name, it is the same inode
+					if(verbose) std::cout << "Linking file " << linkTarget << " to " << dupPath << "\n";
+					fs::remove(dupPath);
+					fs::create_hard_link(linkTarget, dupPath);
+				}
+			}
+			//the archive has one modification time per content, the other
+			//names are compared to the extracted one and keep their own time
+			else if(options_.update && isSameContent(dupPath, path, fileInfo.size_))
+			{
+				if(verbose) std::cout << "Up to date " << dupPath << "\n";
+				++numUpToDate;
+			}
+			else
+			{
+				if(verbose) std::cout << "Copying file " << path << " to " << dupPath << "\n";
+				if(!copySparseFile(path, dupPath, fileInfo.size_))
+				{
+					std::cerr << "Error: copying " << path << " to " << dupPath << " failed.\n";
+					return false;
+				}
+				++numWritten;
+			}
+
+			linkTarget = dupPath;
+		}
+	}
+
+	if(options_.update)
+	{
+		std::cout << "Update: " << numUpToDate << " files up to date, " << numWritten << " written\n";
+	}
+
+	return checksumOk;
+}
+
+bool DirectoryData::writeData(std::istream& in, const fs::path& path, const FileRecord& record,
+		ContentHasher& hasher)
+{
+	std::ofstream out(path, std::ios::binary);
+
+	if(!out.good())
+		return false;
+
+	for(const auto& extent : record.extents_)
+	{
+		//skipping the holes, the file system will not allocate them
+		out.seekp(extent.offset_);
+		hasher.skipTo(extent.offset_);
+
+		if(!copyData(in, &out, extent.length_, &hasher))
+		{
+			return false;
+		}
+	}
+
+	out.close();
+	return out.good();
+}
+
+//Compares the payload with the existing file chunk by chunk and
+//writes only the chunks that differ. Costs reads instead of writes
+//when the target is mostly the same.
+bool DirectoryData::updateData(std::istream& in, const fs::path& path, const FileRecord& record,
+		ContentHasher& hasher)
+{
+	std::fstream target(path, std::ios::binary | std::ios::in | std::ios::out);
+	if(!target.good())
+	{
+		return false;
+	}
+
+	std::vector<char> buffer(IO_BUFFER_SIZE), targetBuffer(IO_BUFFER_SIZE);
+	size_t numChanged = 0;
+
+	FileInfo::FileSizeType position = 0;
+	auto remaining = record.dataSize();
+	while(remaining > 0)
+	{
+		auto chunk = std::min<std::streamsize>(buffer.size(), remaining);
+		in.read(buffer.data(), chunk);
+		if(in.gcount() != chunk)
+		{
+			return false;
+		}
+		hasher.update(buffer.data(), chunk);
+
+		target.seekg(position);
+		target.read(targetBuffer.data(), chunk);
+		if(target.gcount() != chunk || std::memcmp(buffer.data(), targetBuffer.data(), chunk) != 0)
+		{
+			target.clear();
+			target.seekp(position);
+			target.write(buffer.data(), chunk);
+			++numChanged;
+		}
+
+		position += chunk;
+		remaining -= chunk;
+	}
+
+	if(verbose) std::cout << "updateData: " << numChanged << " chunks rewritten\n";
+
+	target.close();
+	return !target.fail();
+}
+
+//Target with the same size and the modification time recorded at pack time
+bool DirectoryData::isUpToDate(const fs::path& path, const FileRecord& record)
+{
+	struct stat st{};
+	if(::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+
+	int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+
+	return static_cast<FileInfo::FileSizeType>(st.st_size) == record.file_.size_
+		&& (record.flags_ & FileInfo::RECORD_MTIME) && mtime == record.mtime_;
+}
+
+//Target with the same data as the already extracted file
+bool DirectoryData::isSameContent(const fs::path& path, const fs::path& extracted, FileInfo::FileSizeType size)
+{
+	struct stat st{};
+	if(::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)
+			|| static_cast<FileInfo::FileSizeType>(st.st_size) != size)
+	{
+		return false;
+	}
+
+	std::ifstream target(path, std::ios::binary);
+	std::ifstream source(extracted, std::ios::binary);
+	std::vector<char> targetBuff(IO_BUFFER_SIZE), sourceBuff(IO_BUFFER_SIZE);
+
+	while(target.good() && source.good())
+	{
+		target.read(targetBuff.data(), targetBuff.size());
+		source.read(sourceBuff.data(), sourceBuff.size());
+
+		if(target.gcount() != source.gcount()
+				|| std::memcmp(targetBuff.data(), sourceBuff.data(), target.gcount()) != 0)
+		{
+			return false;
+		}
+	}
+
+	return target.eof() && source.eof();
+}
+
+void DirectoryData::setModificationTime(const fs::path& path, const FileRecord& record)
+{
+	if(!(record.flags_ & FileInfo::RECORD_MTIME))
+	{
+		return;
+	}
+
+	struct timespec times[2]{};
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = record.mtime_ / 1000000000LL;
+	times[1].tv_nsec = record.mtime_ % 1000000000LL;
+
+	if(::utimensat(AT_FDCWD, path.c_str(), times, 0) != 0 && verbose)
+	{
+		std::cout << "Could not set modification time of " << path << '\n';
+	}
+}
+
+//Hashes the payload as the original file would be hashed,
+//holes of sparse files are hashed as zeros
+bool DirectoryData::hashData(std::istream& in, const FileRecord& record, XXH128_hash_t& hash)
+{
+	ContentHasher hasher;
+
+	for(const auto& extent : record.extents_)
+	{
+		hasher.skipTo(extent.offset_);
+		if(!copyData(in, nullptr, extent.length_, &hasher))
+		{
+			return false;
+		}
+	}
+
+	hash = hasher.digest(record.file_.size_);
+
+	return static_cast<bool>(in);
+}
+
+//The archive itself or the blob of the content store, which is then
+//owned by pBlob. nullptr if the blob is missing.
+std::istream* DirectoryData::dataStream(std::istream& in, const FileRecord& record,
+		std::unique_ptr<std::istream>& pBlob) const
+{
+	if(!(record.flags_ & FileInfo::RECORD_STORED))
+	{
+		return &in;
+	}
+
+	if(!pStore_)
+	{
+		std::cerr << "Error: the data of " << getFsFilePath(record.file_.dirRefs_.at(0),true)
+			<< " is in a content store, use --store.\n";
+		return nullptr;
+	}
+
+	pBlob = pStore_->openBlob(record.storeKey_);
+	return pBlob.get();
+}
+
+//Prints one line per file name, columns separated with tabs:
+//[size] [hash] [name of the stored copy or '-'] path
+//Payloads are skipped, they are read only for the hash column.
+bool DirectoryData::listFiles(std::istream& in, VolumeInfo* pDecoded)
+{
+	DirTreeNodeRef numFiles = readNumber(in);
+	if(pDecoded) pDecoded->numNames_ = numFiles;
+
+	FileRecord record;
+	const auto& fileInfo = record.file_;
+
+	while(numFiles--)
+	{
+		if(!readFileRecord(in, record))
+		{
+			return false;
+		}
+		if(pDecoded) pDecoded->payloadBytes_ += record.file_.size_;
+
+		//The numFiles read at the beginning includes duplicates
+		numFiles -= fileInfo.dirRefs_.size() - 1;
+
+		if(!isInTimeRange(record) || std::none_of(fileInfo.dirRefs_.begin(), fileInfo.dirRefs_.end(),
+				[this](DirTreeNodeRef ref) { return isWanted(ref); }))
+		{
+			if(!skipData(in, record))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		std::string hashHex;
+		if(options_.listHash && (record.flags_ & FileInfo::RECORD_HASH))
+		{
+			//hash stored after the data, no need to read it
+			if(!skipData(in, record, false))
+			{
+				return false;
+			}
+			hashHex = ContentStore::toHex(ContentHasher::read(in));
+		}
+		else if(options_.listHash)
+		{
+			XXH128_hash_t hash{};
+			if(!hashData(in, record, hash))
+			{
+				return false;
+			}
+			hashHex = ContentStore::toHex(hash);
+		}
+		else if(!skipData(in, record))
+		{
+			return false;
+		}
+
+		auto primaryPath = getFsFilePath(fileInfo.dirRefs_.at(0),true);
+
+		for(size_t i = 0; i < fileInfo.dirRefs_.size(); ++i)
+		{
+			if(!isWanted(fileInfo.dirRefs_[i]))
+			{
+				continue;
+			}
+
+			if(options_.listSize) std::cout << fileInfo.size_ << '\t';
+			if(options_.listHash) std::cout << hashHex << '\t';
+			if(options_.listAliases)
+			{
+				std::cout << (i == 0 ? std::string("-") : primaryPath.string()) << '\t';
+			}
+			std::cout << (i == 0 ? primaryPath : getFsFilePath(fileInfo.dirRefs_[i],true)).string() << '\n';
+		}
+	}
+
+	return true;
+}
+
+//Checks the stored content hashes without writing anything. The
+//payloads are read in order, small files are buffered and hashed on
+//the thread pool, the big ones are hashed while reading.
+bool DirectoryData::verifyFiles(std::istream& in, VolumeInfo* pDecoded)
+{
+	DirTreeNodeRef numFiles = readNumber(in);
+	if(pDecoded) pDecoded->numNames_ = numFiles;
+	if(volumes_.empty()) progress.setPhase(Progress::Phase::VERIFY, numFiles);
+
+	ThreadPool pool(options_.numThreads);
+
+	struct PendingCheck
+	{
+		std::future<XXH128_hash_t> hash_;
+		XXH128_hash_t expected_;
+		DirTreeNodeRef ref_;
+		size_t bufferedBytes_;
+	};
+
+	std::deque<PendingCheck> pending;
+	size_t pendingBytes = 0;
+	size_t numOk = 0, numFailed = 0, numNoHash = 0;
+
+	auto check = [&](const XXH128_hash_t& computed, const XXH128_hash_t& expected, DirTreeNodeRef ref)
+	{
+		if(ContentHasher::isEqual(computed, expected))
+		{
+			if(verbose) std::cout << "OK " << getFsFilePath(ref,true) << '\n';
+			++numOk;
+		}
+		else
+		{
+			std::cerr << "Checksum mismatch: " << getFsFilePath(ref,true) << '\n';
+			++numFailed;
+		}
+	};
+
+	auto checkOldest = [&]()
+	{
+		auto& oldest = pending.front();
+		check(oldest.hash_.get(), oldest.expected_, oldest.ref_);
+		pendingBytes -= oldest.bufferedBytes_;
+		pending.pop_front();
+	};
+
+	FileRecord record;
+	const auto& fileInfo = record.file_;
+
+	while(numFiles--)
+	{
+		if(!readFileRecord(in, record))
+		{
+			return false;
+		}
+		if(pDecoded) pDecoded->payloadBytes_ += record.file_.size_;
+
+		//The numFiles read at the beginning includes duplicates
+		numFiles -= fileInfo.dirRefs_.size() - 1;
+		progress.addFiles(fileInfo.dirRefs_.size());
+
+		auto firstWanted = std::find_if(fileInfo.dirRefs_.begin(), fileInfo.dirRefs_.end(),
+				[this](DirTreeNodeRef ref) { return isWanted(ref); });
+
+		if(!(record.flags_ & FileInfo::RECORD_HASH) || firstWanted == fileInfo.dirRefs_.end())
+		{
+			if(firstWanted != fileInfo.dirRefs_.end())
+			{
+				++numNoHash;
+			}
+
+			if(!skipData(in, record))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		size_t storedSize = record.storedSize();
+
+		//the blobs of the content store are decompressed while hashing
+		if(storedSize > VERIFY_INLINE_LIMIT || (record.flags_ & FileInfo::RECORD_STORED))
+		{
+			std::unique_ptr<std::istream> pBlob;
+			std::istream* pData = dataStream(in, record, pBlob);
+			XXH128_hash_t computed{};
+			if(!pData || !hashData(*pData, record, computed))
+			{
+				return false;
+			}
+			check(computed, ContentHasher::read(in), *firstWanted);
+			continue;
+		}
+
+		auto pData = std::make_shared<std::vector<char>>(storedSize);
+		in.read(pData->data(), storedSize);
+		progress.addBytes(storedSize);
+		auto expected = ContentHasher::read(in);
+		if(!in)
+		{
+			std::cerr << "Error: truncated archive.\n";
+			return false;
+		}
+
+		while(!pending.empty() && pendingBytes + storedSize > VERIFY_MEMORY_BUDGET)
+		{
+			checkOldest();
+		}
+
+		auto hashTask = [pData, extents = record.extents_, size = fileInfo.size_]()
+		{
+			ContentHasher hasher;
+			const char* pos = pData->data();
+			for(const auto& extent : extents)
+			{
+				hasher.skipTo(extent.offset_);
+				hasher.update(pos, extent.length_);
+				pos += extent.length_;
+			}
+			return hasher.digest(size);
+		};
+
+		pending.push_back({pool.submit(hashTask), expected, *firstWanted, storedSize});
+		pendingBytes += storedSize;
+	}
+
+	while(!pending.empty())
+	{
+		checkOldest();
+	}
+
+	std::cout << "Verified: " << numOk << " ok, " << numFailed << " failed";
+	if(numNoHash > 0)
+	{
+		std::cout << ", " << numNoHash << " without checksum";
+	}
+	std::cout << '\n';
+
+	return numFailed == 0;
+}
+
+bool DirectoryData::write(std::ostream& out)
+{
+	std::cout << "Writing directory data.\n";
+
+	//a resumed archive keeps the id of its header
+	if(!resuming_)
+	{
+		std::random_device random;
+		archiveId_ = (uint64_t(random()) << 32U) | random();
+	}
+
+	bool volumes = options_.numVolumes > 0 || options_.splitSize > 0;
+
+	if(!options_.storeDir.empty())
+	{
+		if(pExternalEntries_ || options_.checkpointInterval > 0)
+		{
+			std::cerr << "Error: --store is not supported with --memory-limit and checkpoints.\n";
+			return false;
+		}
+
+		pStore_ = std::make_unique<ContentStore>(options_.storeDir);
+		if(!pStore_->open(true))
+		{
+			return false;
+		}
+	}
+
+	if(pExternalEntries_)
+	{
+		if(volumes || options_.checkpointInterval > 0)
+		{
+			std::cerr << "Error: volumes and checkpoints are not supported with --memory-limit.\n";
+			return false;
+		}
+		return writeExternal(out);
+	}
+
+	if(volumes)
+	{
+		if(options_.checkpointInterval > 0)
+		{
+			std::cerr << "Error: checkpoints are not supported with volumes.\n";
+			return false;
+		}
+		return writeVolumes(out);
+	}
+
+	//a resumed archive continues after the last checkpoint
+	if(resumeOffset_ == 0)
+	{
+		out.write(MAGIC_NUMBER.data(), MAGIC_NUMBER.size());
+		write_le(out, archiveId_);
+
+		if(!writeNameTree(out))
+		{
+			std::cerr << "Name Tree writing falure.\n";
+			return false;
+		}
+	}
+	;
+
+	if(!writeFiles(out))
+	{
+		std::cerr << "Files writing failure.\n";
+		return false;
+	}
+
+	return true;
+}
+
+//Volume set layout:
+//manifest: magic, archive id, name table, number of volumes, per volume
+//the file name, number of file names and payload bytes.
+//volume: optional compression prefix and zstd frames around the magic,
+//the archive id, the volume index and the usual number of names and
+//file records. The random archive id tells the volumes of a previous
+//archive of the same name apart.
+//Volumes hold whole files in contiguous ranges of the write order and
+//are written in parallel, each through its own compressor.
+bool DirectoryData::writeVolumes(std::ostream& out)
+{
+	out.write(MAGIC_NUMBER_VOLUMES.data(), MAGIC_NUMBER_VOLUMES.size());
+	write_le(out, archiveId_);
+
+	if(!writeNameTree(out))
+	{
+		std::cerr << "Name Tree writing falure.\n";
+		return false;
+	}
+
+	auto order = writeOrder();
+
+	uint64_t totalBytes = 0;
+	for(FileTable::Index idx : order)
+	{
+		totalBytes += fileTable_.fileSize(idx);
+	}
+
+	std::vector<std::vector<FileTable::Index>> slices(1);
+	uint64_t sliceBytes = 0, doneBytes = 0;
+	for(FileTable::Index idx : order)
+	{
+		auto size = fileTable_.fileSize(idx);
+		bool newSlice = options_.splitSize > 0 ? sliceBytes + size > options_.splitSize
+			: slices.size() < options_.numVolumes && doneBytes >= totalBytes / options_.numVolumes * slices.size();
+
+		if(newSlice && !slices.back().empty())
+		{
+			slices.emplace_back();
+			sliceBytes = 0;
+		}
+
+		slices.back().push_back(idx);
+		sliceBytes += size;
+		doneBytes += size;
+	}
+
+	write_varint(out, slices.size());
+	for(size_t volume = 0; volume < slices.size(); ++volume)
+	{
+		auto name = volumePath(volume).filename().string();
+		uint64_t numNames = 0, payloadBytes = 0;
+		for(FileTable::Index idx : slices[volume])
+		{
+			numNames += fileTable_.numNames(idx);
+			payloadBytes += fileTable_.fileSize(idx);
+		}
+
+		write_varint(out, name.size());
+		out.write(name.data(), name.size());
+		write_varint(out, numNames);
+		write_varint(out, payloadBytes);
+	}
+
+	if(verbose) std::cout << "Writing " << slices.size() << " volumes\n";
+	numVolumesWritten_ = slices.size();
+
+	auto writeVolumeFile = [this, &slices](size_t volume)
+	{
+		fs::path path = volumePath(volume);
+		ArchiveFile file(path);
+		if(!file)
+		{
+			std::cerr << "Error: cannot create the volume " << path << '\n';
+			return false;
+		}
+
+		bool writtenOk = true;
+		if(options_.compress)
+		{
+			file.write(MAGIC_NUMBER_COMPRESS.data(), MAGIC_NUMBER_COMPRESS.size());
+
+			ZstdOStreamBuf zstdStrBuff(file, options_.frameSize, options_.zstdBufferSize);
+			std::ostream outCompress(&zstdStrBuff);
+			writtenOk = writeVolume(outCompress, volume, slices[volume]);
+			outCompress.flush();
+		}
+		else
+		{
+			writtenOk = writeVolume(file, volume, slices[volume]);
+		}
+
+		file.close();
+		if(!writtenOk || !file)
+		{
+			std::cerr << "Error: writing the volume " << path << " failed.\n";
+			return false;
+		}
+		return true;
+	};
+
+	unsigned numThreads = options_.numThreads ? options_.numThreads : ThreadPool::defaultThreads();
+	ThreadPool pool(std::min<size_t>(numThreads, slices.size()));
+	std::vector<std::future<bool>> results;
+	for(size_t volume = 0; volume < slices.size(); ++volume)
+	{
+		results.push_back(pool.submit([&writeVolumeFile, volume]() { return writeVolumeFile(volume); }));
+	}
+
+	bool writtenOk = true;
+	for(auto& result : results)
+	{
+		writtenOk = result.get() && writtenOk;
+	}
+
+	return writtenOk && out.good();
+}
+
+bool DirectoryData::writeVolume(std::ostream& out, size_t volume, const std::vector<FileTable::Index>& files) const
+{
+	out.write(MAGIC_NUMBER_VOLUME.data(), MAGIC_NUMBER_VOLUME.size());
+	write_le(out, archiveId_);
+	write_varint(out, volume);
+	return writeRecords(out, files) && out.good();
+}
+
+//Packing: next to the archive or in the --volume-dir directories round
+//robin. Unpacking: the first existing one of these.
+fs::path DirectoryData::volumePath(size_t volume) const
+{
+	std::string number = std::to_string(volume + 1);
+	number.insert(0, number.size() < 3 ? 3 - number.size() : 0, '0');
+	std::string name = options_.archivePath.filename().string() + '.' + number;
+
+	if(options_.volumeDirs.empty())
+	{
+		return options_.archivePath.parent_path() / name;
+	}
+	return fs::path(options_.volumeDirs[volume % options_.volumeDirs.size()]) / name;
+}
+
+bool DirectoryData::readVolumeList(std::istream& in)
+{
+	uint64_t numVolumes = read_varint(in);
+	if(!in || numVolumes == 0)
+	{
+		std::cerr << "Error: corrupted volume list.\n";
+		return false;
+	}
+
+	volumes_.clear();
+	for(uint64_t volume = 0; volume < numVolumes && in; ++volume)
+	{
+		auto& info = volumes_.emplace_back();
+		info.name_.resize(read_varint(in));
+		in.read(info.name_.data(), info.name_.size());
+		info.numNames_ = read_varint(in);
+		info.payloadBytes_ = read_varint(in);
+	}
+
+	if(!in)
+	{
+		std::cerr << "Error: corrupted volume list.\n";
+		return false;
+	}
+
+	if(verbose) std::cout << "Volumes=" << volumes_.size() << '\n';
+
 	return true;
 }
 
-bool DirectoryData::read(std::istream& in)
+//Opens each volume, checks its header and passes the file records
+//to func. Volumes are searched next to the manifest and in the
+//--volume-dir directories. The names and payload bytes func reports
+//must match the manifest.
+bool DirectoryData::forEachVolume(const std::function<bool(std::istream&, VolumeInfo&)>& func, bool parallel)
+{
+	auto processVolume = [this, &func](size_t volume)
+	{
+		const auto& name = volumes_[volume].name_;
+		fs::path path = options_.archivePath.parent_path() / name;
+		for(const auto& dir : options_.volumeDirs)
+		{
+			if(fs::exists(fs::path(dir) / name))
+			{
+				path = fs::path(dir) / name;
+				break;
+			}
+		}
+
+		std::ifstream file(path, std::ios::binary);
+		if(!file)
+		{
+			std::cerr << "Error: cannot open the volume " << path << '\n';
+			return false;
+		}
+
+		std::array<char, MAGIC_NUMBER_COMPRESS.size()> magicNumBuff{};
+		file.read(magicNumBuff.data(), magicNumBuff.size());
+
+		std::unique_ptr<std::streambuf> pZstdStrBuff;
+		std::istream decompressed(nullptr);
+		std::istream* pIn = &file;
+		if(file && magicNumBuff == MAGIC_NUMBER_COMPRESS)
+		{
+			pZstdStrBuff = std::make_unique<ZstdIStreamBuf>(file, options_.zstdBufferSize);
+			decompressed.rdbuf(pZstdStrBuff.get());
+			pIn = &decompressed;
+		}
+		else
+		{
+			file.clear();
+			file.seekg(0);
+		}
+
+		std::array<char, MAGIC_NUMBER_VOLUME.size()> volumeMagic{};
+		pIn->read(volumeMagic.data(), volumeMagic.size());
+		auto archiveId = read_le<uint64_t>(*pIn);
+		uint64_t index = read_varint(*pIn);
+		if(!*pIn || volumeMagic != MAGIC_NUMBER_VOLUME || archiveId != archiveId_ || index != volume)
+		{
+			std::cerr << "Error: " << path << " is not volume " << volume + 1 << " of the archive.\n";
+			return false;
+		}
+
+		if(verbose) std::cout << "Reading volume " << path << '\n';
+		VolumeInfo decoded;
+		if(!func(*pIn, decoded))
+		{
+			return false;
+		}
+
+		const auto& expected = volumes_[volume];
+		if(decoded.numNames_ != expected.numNames_ || decoded.payloadBytes_ != expected.payloadBytes_)
+		{
+			std::cerr << "Error: " << path << " holds " << decoded.numNames_ << " names and "
+				<< decoded.payloadBytes_ << " bytes, the manifest lists " << expected.numNames_
+				<< " names and " << expected.payloadBytes_ << " bytes.\n";
+			return false;
+		}
+		return true;
+	};
+
+	bool processedOk = true;
+	if(parallel && volumes_.size() > 1)
+	{
+		unsigned numThreads = options_.numThreads ? options_.numThreads : ThreadPool::defaultThreads();
+		ThreadPool pool(std::min<size_t>(numThreads, volumes_.size()));
+		std::vector<std::future<bool>> results;
+		for(size_t volume = 0; volume < volumes_.size(); ++volume)
+		{
+			results.push_back(pool.submit([&processVolume, volume]() { return processVolume(volume); }));
+		}
+
+		for(auto& result : results)
+		{
+			processedOk = result.get() && processedOk;
+		}
+	}
+	else
+	{
+		for(size_t volume = 0; volume < volumes_.size() && processedOk; ++volume)
+		{
+			processedOk = processVolume(volume);
+		}
+	}
+
+	return processedOk;
+}
+
+//Progress of all volumes together
+void DirectoryData::setVolumesPhase(Progress::Phase phase) const
+{
+	uint64_t numNames = 0, payloadBytes = 0;
+	for(const auto& info : volumes_)
+	{
+		numNames += info.numNames_;
+		payloadBytes += info.payloadBytes_;
+	}
+	progress.setPhase(phase, numNames, payloadBytes);
+}
+
+//Counts, sizes and offsets, fixed 32 bit before version 15
+uint64_t DirectoryData::readNumber(std::istream& in) const
+{
+	if(formatVersion_ >= 15)
+	{
+		return read_varint(in);
+	}
+	return read_le<uint32_t>(in);
+}
+
+bool DirectoryData::readHeader(std::istream& in)
 {
 	std::array<char, MAGIC_NUMBER.size()> magicNumBuff{};
 	in.read(magicNumBuff.data(), MAGIC_NUMBER.size());
-	if(magicNumBuff != MAGIC_NUMBER)
+	volumes_.clear();
+	bool volumeSet = (magicNumBuff == MAGIC_NUMBER_VOLUMES);
+
+	if(magicNumBuff == MAGIC_NUMBER || volumeSet)
+	{
+		formatVersion_ = 18;
+	}
+	else if(magicNumBuff == MAGIC_NUMBER_V17)
+	{
+		formatVersion_ = 17;
+	}
+	else if(magicNumBuff == MAGIC_NUMBER_V16)
+	{
+		formatVersion_ = 16;
+	}
+	else if(magicNumBuff == MAGIC_NUMBER_V15)
+	{
+		formatVersion_ = 15;
+	}
+	else if(magicNumBuff == MAGIC_NUMBER_V14)
+	{
+		formatVersion_ = 14;
+	}
+	else if(magicNumBuff == MAGIC_NUMBER_V13)
+	{
+		formatVersion_ = 13;
+	}
+	else
 	{
 		std::cerr << "File format check failed!\n";
 		return false;
 	}
+	if(verbose) std::cout << "Format version " << formatVersion_ << '\n';
 
-	std::cout << "Extracting to current directory.\n";
+	if(formatVersion_ >= 18)
+	{
+		archiveId_ = read_le<uint64_t>(in);
+	}
 
 	if(!readNameTree(in))
 	{
@@ -530,7 +3185,104 @@ bool DirectoryData::read(std::istream& in)
 		return false;
 	}
 
-	if(!unpackFiles(in))
+	if(volumeSet && !readVolumeList(in))
+	{
+		return false;
+	}
+
+	if(!options_.storeDir.empty() && !pStore_)
+	{
+		pStore_ = std::make_unique<ContentStore>(options_.storeDir);
+		if(!pStore_->open(false))
+		{
+			return false;
+		}
+	}
+
+	applyFilters();
+
+	return true;
+}
+
+//Matching the include/exclude globs once against every node of the
+//name tree, the result is a bitmap indexed with DirTreeNodeRef.
+//Nodes are stored after their parents so the paths are built
+//incrementally. No filters means everything is wanted.
+void DirectoryData::applyFilters()
+{
+	wanted_.clear();
+
+	if(options_.includes.empty() && options_.excludes.empty())
+	{
+		return;
+	}
+
+	auto matchesAny = [](const std::vector<std::string>& patterns, const std::string& path)
+	{
+		return std::any_of(patterns.begin(), patterns.end(),
+			[&path](const std::string& pattern)
+			{
+				return ::fnmatch(pattern.c_str(), path.c_str(), 0) == 0;
+			});
+	};
+
+	std::vector<std::string> paths(theIndex_.size());
+	wanted_.resize(theIndex_.size());
+
+	for(DirTreeNodeRef ref = 0; ref < theIndex_.size(); ++ref)
+	{
+		const auto* pNode = theIndex_[ref];
+		if(ref == 0)
+		{
+			paths[ref] = pNode->name_;
+		}
+		else
+		{
+			paths[ref] = paths.at(pNode->parent_ & ~DIR_MASK) + '/';
+			paths[ref] += pNode->name_;
+		}
+
+		wanted_[ref] = (options_.includes.empty() || matchesAny(options_.includes, paths[ref]))
+			&& !matchesAny(options_.excludes, paths[ref]);
+	}
+
+	if(verbose) std::cout << "Filters matched " << std::count(wanted_.begin(), wanted_.end(), true)
+		<< " of " << wanted_.size() << " dir items\n";
+}
+
+bool DirectoryData::isWanted(DirTreeNodeRef ref) const
+{
+	return wanted_.empty() || wanted_.at(ref & ~DIR_MASK);
+}
+
+//Files without a detected range may hold any time, they are kept
+bool DirectoryData::isInTimeRange(const FileRecord& record) const
+{
+	if(!(record.flags_ & FileInfo::RECORD_TIMERANGE))
+	{
+		return true;
+	}
+
+	return record.timeLast_ >= options_.timeFrom && record.timeFirst_ <= options_.timeTo;
+}
+
+bool DirectoryData::read(std::istream& in)
+{
+	std::cout << "Extracting to current directory.\n";
+
+	if(!readHeader(in))
+	{
+		return false;
+	}
+
+	if(!volumes_.empty())
+	{
+		setVolumesPhase(Progress::Phase::EXTRACT);
+	}
+
+	if(!(volumes_.empty() ? unpackFiles(in)
+			: forEachVolume([this](std::istream& volume, VolumeInfo& decoded)
+					{ return unpackFiles(volume, &decoded); }, true)))
 	{
 		std::cerr << "Error: Unpacking files failed.\n";
 		return false;
@@ -541,21 +3293,343 @@ bool DirectoryData::read(std::istream& in)
 	return true;
 }
 
+bool DirectoryData::verify(std::istream& in)
+{
+	if(!readHeader(in))
+	{
+		return false;
+	}
+
+	if(!volumes_.empty())
+	{
+		setVolumesPhase(Progress::Phase::VERIFY);
+	}
+
+	if(!(volumes_.empty() ? verifyFiles(in)
+			: forEachVolume([this](std::istream& volume, VolumeInfo& decoded)
+					{ return verifyFiles(volume, &decoded); }, false)))
+	{
+		std::cerr << "Error: Archive verification failed.\n";
+		return false;
+	}
+
+	return true;
+}
+
+bool DirectoryData::grepFiles(std::istream& in, LineGrep& lineGrep, VolumeInfo* pDecoded)
+{
+	DirTreeNodeRef numFiles = readNumber(in);
+	if(pDecoded) pDecoded->numNames_ = numFiles;
+	if(volumes_.empty()) progress.setPhase(Progress::Phase::GREP, numFiles);
+
+	FileRecord record;
+	const auto& fileInfo = record.file_;
+	std::vector<char> buffer;
+	//path: of each wanted name of the current file
+	std::vector<std::string> prefixes;
+	//with one wanted name the matches are printed right away. With more
+	//the lineNumber:text lines are kept for each name, above
+	//IO_BUFFER_SIZE in a temporary file.
+	std::string matches;
+	std::unique_ptr<std::FILE, decltype(&std::fclose)> pSpill(nullptr, &std::fclose);
+
+	auto addMatch = [&](uint64_t lineNumber, std::string_view line)
+	{
+		if(prefixes.size() == 1)
+		{
+			std::cout << prefixes.front() << lineNumber << ':' << line << '\n';
+			return;
+		}
+
+		matches += std::to_string(lineNumber);
+		matches += ':';
+		matches += line;
+		matches += '\n';
+
+		if(matches.size() < IO_BUFFER_SIZE)
+		{
+			return;
+		}
+		if(!pSpill)
+		{
+			pSpill.reset(std::tmpfile());
+		}
+		//without a temporary file they all stay in memory
+		if(pSpill)
+		{
+			std::fwrite(matches.data(), 1, matches.size(), pSpill.get());
+			matches.clear();
+		}
+	};
+
+	//the prefix goes before each line, the lines may span the pieces
+	auto printMatches = [](const std::string& prefix, const char* pData, size_t size, bool& atLineStart)
+	{
+		for(const char* pEnd = pData + size; pData < pEnd;)
+		{
+			auto pNewLine = static_cast<const char*>(std::memchr(pData, '\n', pEnd - pData));
+			const char* pNext = pNewLine ? pNewLine + 1 : pEnd;
+			if(atLineStart)
+			{
+				std::cout << prefix;
+			}
+			std::cout.write(pData, pNext - pData);
+			atLineStart = (pNewLine != nullptr);
+			pData = pNext;
+		}
+	};
+
+	while(numFiles--)
+	{
+		if(!readFileRecord(in, record))
+		{
+			return false;
+		}
+		if(pDecoded) pDecoded->payloadBytes_ += record.file_.size_;
+
+		//The numFiles read at the beginning includes duplicates
+		numFiles -= fileInfo.dirRefs_.size() - 1;
+		progress.addFiles(fileInfo.dirRefs_.size());
+
+		prefixes.clear();
+		if(isInTimeRange(record))
+		{
+			for(auto ref : fileInfo.dirRefs_)
+			{
+				if(isWanted(ref))
+				{
+					prefixes.push_back(getFsFilePath(ref,true).string() + ':');
+				}
+			}
+		}
+
+		if(prefixes.empty())
+		{
+			if(!skipData(in, record))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		std::unique_ptr<std::istream> pBlob;
+		std::istream* pData = dataStream(in, record, pBlob);
+		if(!pData)
+		{
+			return false;
+		}
+
+		//the holes hold no lines, the extents are searched as one text
+		FileInfo::FileSizeType length = record.dataSize();
+		buffer.resize(std::min<size_t>(IO_BUFFER_SIZE, length));
+		matches.clear();
+		pSpill.reset();
+		while(length > 0)
+		{
+			auto chunk = std::min<std::streamsize>(buffer.size(), length);
+			pData->read(buffer.data(), chunk);
+			if(pData->gcount() != chunk)
+			{
+				std::cerr << "Error: truncated archive.\n";
+				return false;
+			}
+			lineGrep.feed(buffer.data(), chunk, addMatch);
+			length -= chunk;
+			progress.addBytes(chunk);
+		}
+		lineGrep.finish(addMatch);
+
+		//the checksum after the data is not checked, --verify does that
+		if(record.flags_ & FileInfo::RECORD_HASH)
+		{
+			ContentHasher::read(in);
+		}
+		if(!in)
+		{
+			return false;
+		}
+
+		if(prefixes.size() == 1 || (matches.empty() && !pSpill))
+		{
+			continue;
+		}
+
+		buffer.resize(IO_BUFFER_SIZE);
+		for(const auto& prefix : prefixes)
+		{
+			bool atLineStart = true;
+			if(pSpill)
+			{
+				std::rewind(pSpill.get());
+				while(size_t bytesRead = std::fread(buffer.data(), 1, buffer.size(), pSpill.get()))
+				{
+					printMatches(prefix, buffer.data(), bytesRead, atLineStart);
+				}
+			}
+			printMatches(prefix, matches.data(), matches.size(), atLineStart);
+		}
+	}
+
+	return static_cast<bool>(std::cout);
+}
+
+bool DirectoryData::grep(std::istream& in)
+{
+	LineGrep lineGrep(options_.grepPattern, options_.grepRegex);
+	if(!lineGrep.valid())
+	{
+		std::cerr << "Error: Invalid pattern: " << lineGrep.error() << '\n';
+		return false;
+	}
+
+	if(!readHeader(in))
+	{
+		return false;
+	}
+
+	if(!volumes_.empty())
+	{
+		setVolumesPhase(Progress::Phase::GREP);
+	}
+
+	if(!(volumes_.empty() ? grepFiles(in, lineGrep)
+			: forEachVolume([this, &lineGrep](std::istream& volume, VolumeInfo& decoded)
+					{ return grepFiles(volume, lineGrep, &decoded); }, false)))
+	{
+		std::cerr << "Error: Searching the files failed.\n";
+		return false;
+	}
+
+	return true;
+}
+
+bool DirectoryData::addStoreReferences()
+{
+	if(!pStore_)
+	{
+		return true;
+	}
+
+	std::cout << "Store: " << numStoreAdded_ << " files added, "
+		<< storeRefs_.size() - numStoreAdded_ << " already stored\n";
+	storeRefsAdded_ = pStore_->addReferences(archiveId_, storeRefs_);
+	return storeRefsAdded_;
+}
+
+void DirectoryData::discardWritten()
+{
+	std::error_code ec;
+	for(size_t volume = 0; volume < numVolumesWritten_; ++volume)
+	{
+		fs::remove(volumePath(volume), ec);
+	}
+	numVolumesWritten_ = 0;
+
+	if(storeRefsAdded_)
+	{
+		pStore_->releaseReferences(archiveId_);
+		storeRefsAdded_ = false;
+	}
+}
+
+bool DirectoryData::releaseStore(std::istream& in)
+{
+	if(options_.storeDir.empty())
+	{
+		std::cerr << "Error: --store-release needs --store.\n";
+		return false;
+	}
+
+	if(!readHeader(in))
+	{
+		return false;
+	}
+
+	//the references are recorded under the archive id, the records are not needed
+	return pStore_->releaseReferences(archiveId_);
+}
+
+bool DirectoryData::list(std::istream& in)
+{
+	if(!readHeader(in))
+	{
+		return false;
+	}
+
+	if(!(volumes_.empty() ? listFiles(in)
+			: forEachVolume([this](std::istream& volume, VolumeInfo& decoded)
+					{ return listFiles(volume, &decoded); }, false)))
+	{
+		std::cerr << "Error: Listing files failed.\n";
+		return false;
+	}
+
+	//once after the files of all volumes
+	for(DirTreeNodeRef ref = 0; ref < theIndex_.size(); ++ref)
+	{
+		if(theIndex_[ref]->isEmptyDir() && isWanted(ref))
+		{
+			std::cout << getFsFilePath(ref,true).string() << "/\n";
+		}
+	}
+
+	return true;
+}
+
 void DirectoryData::recreateEmptyDirs()
 {
 	if(verbose) std::cout << "Empty Dirs:\n";
 
 	for(auto it = theIndex_.crbegin(); it != theIndex_.crend(); ++it)
 	{
-		if((*it)->isEmptyDir())
+		DirTreeNodeRef ref = std::distance(it, theIndex_.crend()-1);
+		if((*it)->isEmptyDir() && isWanted(ref))
 		{
-			auto dir = getFsFilePath(std::distance(it, theIndex_.crend()-1),true);
+			auto dir = getFsFilePath(ref,true);
 			if(verbose) std::cout << dir << '\n';
 			fs::create_directories(dir);
 		}
 	}
 }
 
+//Breadth first numbering with the siblings in the name order
+//(children_ is sorted by name). Siblings sharing prefixes end up
+//next to each other for the name table front coding and the parents
+//come in non-decreasing order. children_ keeps the old positions,
+//it has to be released after this.
+void DirectoryData::renumberTree()
+{
+	std::vector<DirTreeNodeRef> order;
+	order.reserve(theIndex_.size());
+	order.push_back(0);
+	for(size_t pos = 0; pos < order.size(); ++pos)
+	{
+		const auto& children = theIndex_[order[pos]]->children_;
+		order.insert(order.end(), children.begin(), children.end());
+	}
+	assert(order.size() == theIndex_.size());
+
+	std::vector<DirTreeNodeRef> newRefs(theIndex_.size());
+	std::vector<DirTreeNode*> newIndex(theIndex_.size());
+	for(DirTreeNodeRef pos = 0; pos < order.size(); ++pos)
+	{
+		newRefs[order[pos]] = pos;
+		newIndex[pos] = theIndex_[order[pos]];
+	}
+
+	for(auto* pNode : newIndex)
+	{
+		pNode->parent_ = newRefs[pNode->parent_ & ~DIR_MASK] | (pNode->parent_ & DIR_MASK);
+	}
+
+	fileTable_.remapNames([&newRefs](DirTreeNodeRef ref)
+		{
+			return newRefs[ref & ~LINK_MASK] | (ref & LINK_MASK);
+		});
+
+	theIndex_.swap(newIndex);
+}
+
 void DirectoryData::releaseChildren()
 {
 	for (auto* elem : theIndex_)
@@ -578,11 +3652,19 @@ void DirectoryData::clearDirTree()
 	}
 	
 	theIndex_.clear();
+	names_.clear();
 }
 
 DirectoryData::~DirectoryData()
 {
 	clearDirTree();
+	removeTempDir();
+
+	//an unfinished checkpoint stays for --resume
+	if(checkpointFd_ >= 0)
+	{
+		::close(checkpointFd_);
+	}
 }
 
 
@@ -1,51 +1,327 @@
 #pragma once
 
 #include <array>
+#include <memory>
 #include "DataStructs.h"
+#include "ExternalSorter.h"
+#include "FileTable.h"
+#include "LineGrep.h"
+#include "Progress.h"
+#include "ContentStore.h"
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sys/types.h>
 
 
 class DirectoryData
 {
-	static constexpr std::array<char, 7> MAGIC_NUMBER = {'M','Y','D','I','R','1','3'};
+public:
+	struct Options
+	{
+		//read source files in the order of their position on the disk
+		bool physicalOrder{false};
+		//recreate hard links on unpack instead of copies
+		bool hardLinks{false};
+		//duplicates confirmed byte by byte, not only by the hash
+		bool verifyDuplicates{false};
+		//extra columns of the listing
+		bool listSize{false};
+		bool listAliases{false};
+		bool listHash{false};
+		//path globs (fnmatch) selecting what is extracted or listed,
+		//matched against the path with the root directory name
+		std::vector<std::string> includes;
+		std::vector<std::string> excludes;
+		//skip the files that are already up to date when unpacking
+		bool update{false};
+		//blocks of HASH_BUFFER_SIZE sampled by the partial hash: the head,
+		//the tail and the rest strided between them, 1 - the head only
+		unsigned hashSampleBlocks{6};
+		static constexpr unsigned MAX_HASH_SAMPLE_BLOCKS = 1024; //64MB per file
+		//threads for the parallel work, 0 - all cores
+		unsigned numThreads{0};
+		//bytes, packing keeps the scan results in temporary files
+		//instead of the memory, 0 - everything in memory
+		size_t memoryLimit{0};
+		//packing: file payloads go to this many volume files
+		//or to volumes of at most splitSize payload bytes, 0 - off
+		unsigned numVolumes{0};
+		uint64_t splitSize{0};
+		//directories of the volumes, used round robin when packing and
+		//searched when reading, next to the archive if empty
+		std::vector<std::string> volumeDirs;
+		//the archive (manifest of the volumes), volumes add .001, ...
+		fs::path archivePath{"dir_data.bin"};
+		//volumes are compressed like the archive
+		bool compress{false};
+		size_t frameSize{0};
+		//buffers of the zstd streams, 0 - the zstd recommended sizes
+		size_t zstdBufferSize{0};
+		//packing: the written archive is made durable and recorded in
+		//the checkpoint file after this many payload bytes, 0 - off
+		uint64_t checkpointInterval{0};
+		//--grep: the pattern searched in the file contents,
+		//a POSIX extended regex or a literal
+		std::string grepPattern;
+		bool grepRegex{false};
+		//--from/--to: the files whose log time range is known and does not
+		//overlap [timeFrom, timeTo] are skipped, seconds since the epoch
+		int64_t timeFrom{std::numeric_limits<int64_t>::min()};
+		int64_t timeTo{std::numeric_limits<int64_t>::max()};
+		//--store: directory of the content store shared by the archives,
+		//packing puts the file contents there, reading takes them from it
+		fs::path storeDir;
+	};
+
+private:
+	//file data in the content store
+	static constexpr std::array<char, 7> MAGIC_NUMBER = {'M','Y','D','I','R','1','8'};
+	//name table and the list of the volumes with the file records
+	static constexpr std::array<char, 7> MAGIC_NUMBER_VOLUMES = {'M','Y','D','I','R','V','S'};
+	//scan and duplicate search results with the write progress
+	static constexpr std::array<char, 7> MAGIC_NUMBER_CHECKPOINT = {'M','Y','D','I','R','C','K'};
+	//start of each volume
+	static constexpr std::array<char, 7> MAGIC_NUMBER_VOLUME = {'M','Y','D','I','R','V','D'};
+	//still readable, no content store references
+	static constexpr std::array<char, 7> MAGIC_NUMBER_V17 = {'M','Y','D','I','R','1','7'};
+	//still readable, no log time ranges
+	static constexpr std::array<char, 7> MAGIC_NUMBER_V16 = {'M','Y','D','I','R','1','6'};
+	//still readable, varint encoded tables, 64 bit sizes
+	static constexpr std::array<char, 7> MAGIC_NUMBER_V15 = {'M','Y','D','I','R','1','5'};
+	//still readable, fixed 32 bit fields
+	static constexpr std::array<char, 7> MAGIC_NUMBER_V14 = {'M','Y','D','I','R','1','4'};
+	//still readable, no per-file flags
+	static constexpr std::array<char, 7> MAGIC_NUMBER_V13 = {'M','Y','D','I','R','1','3'};
 	static constexpr size_t IO_BUFFER_SIZE = (1U << 20U); //1MB
 	static constexpr size_t HASH_BUFFER_SIZE = (1U << 16U); //64KB
 	static constexpr size_t MAX_FILE_NUM = 1048576;
+	//byte by byte verification of the duplicates
+	static constexpr size_t VERIFY_BUFFER_BUDGET = (1U << 26U); //64MB
+	static constexpr size_t VERIFY_MAX_OPEN = 512;
+	static constexpr size_t IO_ALIGNMENT = 4096;
+	//--verify: files up to the limit are hashed on the thread pool
+	static constexpr size_t VERIFY_INLINE_LIMIT = (1U << 26U); //64MB
+	static constexpr size_t VERIFY_MEMORY_BUDGET = (1U << 28U); //256MB
+	//name table: nodes between the restart points of the front coding
+	static constexpr DirTreeNodeRef NAME_BLOCK_NODES = 256;
+	//name table: decoded on the thread pool from this many blocks
+	static constexpr size_t NAME_PARALLEL_BLOCKS = 64;
 
 	//owns the DirTreNodes 
 	std::vector<DirTreeNode*> theIndex_;
-	std::vector<FileInfo> fileEntries_;
+	//and their names
+	NameArena names_;
+	FileTable fileTable_;
 
 	//std::unordered_multiset<FileInfo, FileInfo::HashFunction, FileInfo::IsEqual> fileGroups_{MAX_FILE_NUM};
 
 	fs::path workDir_;
 
+	Options options_;
+
+	//version of the archive being read
+	unsigned formatVersion_{18};
+
+	//nodes selected by the include/exclude filters, empty if all
+	std::vector<bool> wanted_;
+
+	//volumes of the archive being read, empty for a single file archive
+	struct VolumeInfo
+	{
+		std::string name_;
+		uint64_t numNames_{0};
+		uint64_t payloadBytes_{0};
+	};
+	std::vector<VolumeInfo> volumes_;
+	//random, after the magic and in every volume header, ties the volumes
+	//to their manifest and names the store references of the archive
+	uint64_t archiveId_{0};
+	//volume files created by writeVolumes, removed by discardWritten
+	size_t numVolumesWritten_{0};
+
+	//checkpoints: flushes the archive to the disk and returns its size
+	std::function<bool(uint64_t&)> checkpointSync_;
+	int checkpointFd_{-1};
+	//--resume: files already in the archive and its durable size
+	bool resuming_{false};
+	size_t resumeFiles_{0};
+	uint64_t resumeOffset_{0};
+
+	//positions in fileTable_ of the files with the same size and
+	//partial hash as another file, in the full hash order so the same
+	//content files are next to each other (set by findDuplicates)
+	std::vector<uint32_t> duplicateCandidates_;
+
+	//how well the partial hash separated the same size files
+	struct DedupStats
+	{
+		uint64_t sameSize_{0};
+		//partial hash shared with another file, fully hashed
+		uint64_t fullHashed_{0};
+		//fully hashed but unique after all, and their bytes
+		uint64_t falseCandidates_{0};
+		uint64_t falseCandidateBytes_{0};
+	};
+	DedupStats dedupStats_;
+
+	//--memory-limit: order of the scanned files in the temporary runs
+	struct ExternalEntryLess
+	{
+		enum Key { BY_INODE, BY_PARTIAL_HASH, BY_FULL_HASH };
+		Key key_{BY_INODE};
+
+		bool operator()(const ExternalEntry& left, const ExternalEntry& right) const;
+	};
+	using ExternalEntrySorter = ExternalSorter<ExternalEntry, ExternalEntryLess>;
+
+	//--memory-limit: state kept between preProcessSourceDir and write
+	fs::path tempDir_;
+	//name table nodes in the version 15 encoding
+	std::fstream externalNodes_;
+	DirTreeNodeRef numExternalNodes_{0};
+	DirTreeNodeRef numExternalNames_{0};
+	std::unique_ptr<ExternalEntrySorter> pExternalEntries_;
+
+	//--store: the blobs referenced by the written records, counted in
+	//the store when the archive is complete
+	std::unique_ptr<ContentStore> pStore_;
+	mutable std::mutex storeMutex_;
+	mutable std::vector<XXH128_hash_t> storeRefs_;
+	mutable size_t numStoreAdded_{0};
+	bool storeRefsAdded_{false};
+
 	void releaseChildren();
+	void renumberTree();
 
 	fs::path getFsFilePath(DirTreeNodeRef dirRef, bool withRoot = false) const;
 
 	DirTreeNode* toPtr(DirTreeNodeRef idx) const;
 
+	uint64_t readNumber(std::istream& in) const;
+
 	bool writeNameTree(std::ostream& out);
 	bool readNameTree(std::istream& in);
+	bool decodeNameBlock(const char* pIn, const char* pEnd, char* pNames, size_t namesSize,
+			DirTreeNodeRef first, DirTreeNodeRef last);
 
-	bool writeFile(std::ostream& out, const FileInfo& file);
+	static bool getDataExtents(const fs::path& filePath, FileInfo::FileSizeType size,
+			std::vector<FileExtent>& extents);
+	static bool copySparseFile(const fs::path& from, const fs::path& to, FileInfo::FileSizeType size);
+	static bool copyData(std::istream& in, std::ostream* pOut, FileInfo::FileSizeType length,
+			ContentHasher* pHasher = nullptr);
+
+	bool writeFile(std::ostream& out, const FileInfo& file) const;
+	bool writeFile(std::ostream& out, const FileInfo& file, const fs::path& filePath) const;
+	bool writeStoredFile(std::ostream& out, FileRecord& record, const fs::path& filePath) const;
 	bool writeFiles(std::ostream& out);
-	bool unpackFiles(std::istream& in);
+	std::vector<FileTable::Index> writeOrder();
+	bool writeRecords(std::ostream& out, const std::vector<FileTable::Index>& files,
+			size_t firstFile = 0, const std::function<bool(size_t)>& afterFile = nullptr) const;
+
+	bool startCheckpoint(const std::vector<FileTable::Index>& order);
+	bool commitCheckpoint(size_t filesDone);
+	fs::path checkpointPath() const;
+
+	bool writeVolumes(std::ostream& out);
+	bool writeVolume(std::ostream& out, size_t volume, const std::vector<FileTable::Index>& files) const;
+	fs::path volumePath(size_t volume) const;
+	bool readVolumeList(std::istream& in);
+	bool forEachVolume(const std::function<bool(std::istream&, VolumeInfo&)>& func, bool parallel);
+	void setVolumesPhase(Progress::Phase phase) const;
+	void mergeDuplicates();
+	//pDecoded: counts the names and payload bytes read, checked against the manifest
+	bool unpackFiles(std::istream& in, VolumeInfo* pDecoded = nullptr);
+	bool listFiles(std::istream& in, VolumeInfo* pDecoded = nullptr);
+	bool grepFiles(std::istream& in, LineGrep& lineGrep, VolumeInfo* pDecoded = nullptr);
+
+	bool writeData(std::istream& in, const fs::path& path, const FileRecord& record,
+			ContentHasher& hasher);
+	bool updateData(std::istream& in, const fs::path& path, const FileRecord& record,
+			ContentHasher& hasher);
+	static bool isUpToDate(const fs::path& path, const FileRecord& record);
+	static bool isSameContent(const fs::path& path, const fs::path& extracted, FileInfo::FileSizeType size);
+	static void setModificationTime(const fs::path& path, const FileRecord& record);
+	bool verifyFiles(std::istream& in, VolumeInfo* pDecoded = nullptr);
+
+	bool readHeader(std::istream& in);
+	void applyFilters();
+	bool isWanted(DirTreeNodeRef ref) const;
+	bool isInTimeRange(const FileRecord& record) const;
+	static bool writeFileRecord(std::ostream& out, const FileRecord& record);
+	bool readFileRecord(std::istream& in, FileRecord& record);
+	static bool skipData(std::istream& in, const FileRecord& record, bool withChecksum = true);
+	static bool hashData(std::istream& in, const FileRecord& record, XXH128_hash_t& hash);
+	std::istream* dataStream(std::istream& in, const FileRecord& record,
+			std::unique_ptr<std::istream>& pBlob) const;
 
 	void recreateEmptyDirs();
+	bool addSourceEntry(const fs::directory_entry& dir_entry, ptrdiff_t workDirDepth,
+			std::map<std::pair<dev_t, ino_t>, FileTable::Index>& hardLinks);
+	bool finishScan();
 	bool findDuplicates();
-	bool computeParialHshes
-		(std::pair<std::vector<FileInfo>::iterator, std::vector<FileInfo>::iterator> range);
+	static uint64_t getPhysicalOffset(const fs::path& filePath);
+
+	//files of the same size (and partial hash), not next to each other
+	using FileGroup = std::vector<FileTable::Index>;
+
+	FileGroup readOrder(const FileGroup& group) const;
+
+	bool computeParialHshes(const FileGroup& group);
+
+	bool computeFullHshes(const FileGroup& group);
+
+	bool computeVerifiedHshes(const FileGroup& group);
 
-	bool computeFullHshes
-		(std::pair<std::vector<FileInfo>::iterator, std::vector<FileInfo>::iterator> range);
+	bool compareFiles(FileTable::Index left, FileTable::Index right) const;
+
+	bool computePartialHash(const fs::path& filePath, FileInfo::FileSizeType size, XXH64_hash_t& hash) const;
+	static bool computeFullHash(const fs::path& filePath, FileInfo::FileSizeType size, XXH128_hash_t& hash);
+
+	bool preProcessExternal();
+	bool scanExternal(ExternalEntrySorter& entries);
+	bool hashExternal(ExternalEntrySorter& in, ExternalEntrySorter& out, bool fullHash);
+	bool writeExternal(std::ostream& out);
+	void removeTempDir();
 
 public:
+	void setOptions(const Options& options) { options_ = options; }
+	//resuming takes the compression settings from the checkpoint
+	const Options& options() const { return options_; }
+
+	//called at the checkpoints to make the archive durable
+	void setCheckpointSync(std::function<bool(uint64_t&)> sync) { checkpointSync_ = std::move(sync); }
+	//loads the scan and duplicate search state instead of preProcessSourceDir
+	bool resumeFromCheckpoint(const std::string& directory);
+	uint64_t resumeOffset() const { return resumeOffset_; }
+	//removes the checkpoint after the archive was completed
+	void finishCheckpoint();
+
 	bool preProcessSourceDir(const std::string &directory);
+	//--watch: only the listed files, relative to the directory
+	bool preProcessChangedFiles(const std::string& directory, const std::vector<fs::path>& files);
 	~DirectoryData();
 	void clearDirTree();
 
 	bool write(std::ostream& out);
 
 	bool read(std::istream& in);
+
+	//prints the content of the archive without extracting
+	bool list(std::istream& in);
+
+	//checks the stored file checksums without extracting
+	bool verify(std::istream& in);
+
+	//prints the matching lines of the files as path:line:text, nothing is written
+	bool grep(std::istream& in);
+
+	//--store: counts the references of the written archive in the store
+	bool addStoreReferences();
+	//--store-release: the archive no longer references its blobs
+	bool releaseStore(std::istream& in);
+	//--watch: removes the volumes of a failed write and releases its
+	//store references, the archive file itself is the caller's
+	void discardWritten();
 };
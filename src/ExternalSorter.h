@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+//Sorts more records than fit in the memory. The records are collected
+//up to the memory budget, sorted and spilled to a run file, the runs
+//are merged back when reading. Record needs write(std::ostream&),
+//read(std::istream&) and memoryUsage(). If everything fits in the
+//budget nothing is written to the disk.
+template <typename Record, typename Less>
+class ExternalSorter
+{
+public:
+	ExternalSorter(fs::path tempDir, std::string name, size_t memoryBudget, Less less = Less()):
+		tempDir_(std::move(tempDir)),
+		name_(std::move(name)),
+		memoryBudget_(memoryBudget),
+		less_(less)
+	{}
+
+	~ExternalSorter()
+	{
+		pMerger_.reset();
+		for(const auto& run : runs_)
+		{
+			std::error_code ec;
+			fs::remove(run, ec);
+		}
+	}
+
+	ExternalSorter(const ExternalSorter&) = delete;
+	ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+	bool add(Record&& record)
+	{
+		bufferBytes_ += record.memoryUsage();
+		buffer_.push_back(std::move(record));
+
+		if(bufferBytes_ >= memoryBudget_)
+		{
+			return spill();
+		}
+		return true;
+	}
+
+	//No more records, after this next() returns them in order
+	bool finish()
+	{
+		if(runs_.empty())
+		{
+			std::stable_sort(buffer_.begin(), buffer_.end(), less_);
+			bufferPos_ = 0;
+			return true;
+		}
+
+		if(!buffer_.empty() && !spill())
+		{
+			return false;
+		}
+		std::vector<Record>().swap(buffer_);
+
+		//limiting the open files and the read buffers
+		while(runs_.size() > MAX_FAN_IN)
+		{
+			std::vector<fs::path> inputs(runs_.begin(), runs_.begin() + MAX_FAN_IN);
+			runs_.erase(runs_.begin(), runs_.begin() + MAX_FAN_IN);
+
+			fs::path output = nextRunPath();
+			if(!mergeRuns(inputs, output))
+			{
+				return false;
+			}
+			runs_.push_back(output);
+		}
+
+		pMerger_ = std::make_unique<Merger>(runs_, less_);
+		return pMerger_->good();
+	}
+
+	bool next(Record& record)
+	{
+		if(pMerger_)
+		{
+			return pMerger_->next(record);
+		}
+
+		if(bufferPos_ < buffer_.size())
+		{
+			record = std::move(buffer_[bufferPos_++]);
+			return true;
+		}
+		return false;
+	}
+
+	size_t numRuns() const { return runs_.size(); }
+
+private:
+	static constexpr size_t MAX_FAN_IN = 64;
+	static constexpr size_t RUN_BUFFER_SIZE = (1U << 16U); //64KB
+
+	//k-way merge of the run files
+	class Merger
+	{
+	public:
+		Merger(const std::vector<fs::path>& runs, Less less):
+			heap_(HeapCompare{this, less})
+		{
+			for(const auto& run : runs)
+			{
+				auto& input = inputs_.emplace_back();
+				input.buffer_.resize(RUN_BUFFER_SIZE);
+				input.stream_.rdbuf()->pubsetbuf(input.buffer_.data(), input.buffer_.size());
+				input.stream_.open(run, std::ios::binary);
+				if(!input.stream_)
+				{
+					std::cerr << "Error: cannot open the temporary file " << run << '\n';
+					good_ = false;
+					return;
+				}
+			}
+
+			for(size_t idx = 0; idx < inputs_.size(); ++idx)
+			{
+				refill(idx);
+			}
+		}
+
+		bool good() const { return good_; }
+
+		bool next(Record& record)
+		{
+			if(heap_.empty())
+			{
+				return false;
+			}
+
+			size_t idx = heap_.top();
+			heap_.pop();
+			record = std::move(inputs_[idx].head_);
+			refill(idx);
+			return true;
+		}
+
+	private:
+		struct Input
+		{
+			std::vector<char> buffer_;
+			std::ifstream stream_;
+			Record head_;
+		};
+
+		//min-heap, the earlier run wins the ties to keep the order stable
+		struct HeapCompare
+		{
+			const Merger* pMerger_;
+			Less less_;
+
+			bool operator()(size_t left, size_t right) const
+			{
+				const auto& leftHead = pMerger_->inputs_[left].head_;
+				const auto& rightHead = pMerger_->inputs_[right].head_;
+				if(less_(rightHead, leftHead))
+				{
+					return true;
+				}
+				if(less_(leftHead, rightHead))
+				{
+					return false;
+				}
+				return left > right;
+			}
+		};
+
+		void refill(size_t idx)
+		{
+			auto& input = inputs_[idx];
+			if(input.stream_.peek() == std::char_traits<char>::eof())
+			{
+				return;
+			}
+
+			if(!input.head_.read(input.stream_))
+			{
+				std::cerr << "Error: corrupted temporary file.\n";
+				good_ = false;
+				return;
+			}
+			heap_.push(idx);
+		}
+
+		std::deque<Input> inputs_;
+		std::priority_queue<size_t, std::vector<size_t>, HeapCompare> heap_;
+		bool good_{true};
+	};
+
+	fs::path nextRunPath()
+	{
+		return tempDir_ / (name_ + '-' + std::to_string(runCounter_++) + ".run");
+	}
+
+	bool spill()
+	{
+		std::stable_sort(buffer_.begin(), buffer_.end(), less_);
+
+		fs::path run = nextRunPath();
+		std::vector<char> streamBuffer(RUN_BUFFER_SIZE);
+		std::ofstream out;
+		out.rdbuf()->pubsetbuf(streamBuffer.data(), streamBuffer.size());
+		out.open(run, std::ios::binary | std::ios::trunc);
+
+		for(const auto& record : buffer_)
+		{
+			record.write(out);
+		}
+		out.close();
+
+		if(!out)
+		{
+			std::cerr << "Error: writing the temporary file " << run << " failed.\n";
+			return false;
+		}
+
+		runs_.push_back(run);
+		buffer_.clear();
+		bufferBytes_ = 0;
+		return true;
+	}
+
+	bool mergeRuns(const std::vector<fs::path>& inputs, const fs::path& output)
+	{
+		bool mergedOk = true;
+		{
+			Merger merger(inputs, less_);
+
+			std::vector<char> streamBuffer(RUN_BUFFER_SIZE);
+			std::ofstream out;
+			out.rdbuf()->pubsetbuf(streamBuffer.data(), streamBuffer.size());
+			out.open(output, std::ios::binary | std::ios::trunc);
+
+			Record record;
+			while(merger.next(record))
+			{
+				record.write(out);
+			}
+			out.close();
+
+			mergedOk = merger.good() && out.good();
+		}
+
+		for(const auto& input : inputs)
+		{
+			std::error_code ec;
+			fs::remove(input, ec);
+		}
+
+		if(!mergedOk)
+		{
+			std::cerr << "Error: merging the temporary file " << output << " failed.\n";
+		}
+		return mergedOk;
+	}
+
+	fs::path tempDir_;
+	std::string name_;
+	size_t memoryBudget_;
+	Less less_;
+
+	std::vector<Record> buffer_;
+	size_t bufferBytes_{0};
+	size_t bufferPos_{0};
+
+	std::vector<fs::path> runs_;
+	size_t runCounter_{0};
+	std::unique_ptr<Merger> pMerger_;
+};
@@ -0,0 +1,394 @@
+#include "FileIo.h"
+#include <algorithm>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+IoThrottle ioThrottle;
+
+namespace
+{
+constexpr size_t IO_CHUNK = (1U << 20U); //1MB
+}
+
+void TokenBucket::setRate(uint64_t perSecond)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	rate_ = perSecond;
+	tokens_ = rate_;
+	last_ = std::chrono::steady_clock::now();
+}
+
+void TokenBucket::take(uint64_t amount)
+{
+	double wait = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(rate_ == 0)
+		{
+			return;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double>(now - last_).count();
+		last_ = now;
+
+		//going into debt, the callers after us wait for it too
+		tokens_ = std::min(rate_, tokens_ + elapsed * rate_) - amount;
+		if(tokens_ < 0)
+		{
+			wait = -tokens_ / rate_;
+		}
+	}
+
+	if(wait > 0)
+	{
+		std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+	}
+}
+
+void IoThrottle::setLimits(const Limits& limits)
+{
+	limits_ = limits;
+	enabled_ = limits.dropCache || limits.bytesPerSecond > 0 || limits.opsPerSecond > 0;
+	bytes_.setRate(limits.bytesPerSecond);
+	ops_.setRate(limits.opsPerSecond);
+}
+
+void IoThrottle::beforeIo()
+{
+	ops_.take(1);
+}
+
+void IoThrottle::afterIo(uint64_t bytes)
+{
+	bytes_.take(bytes);
+}
+
+void IoThrottle::startReading(int fd) const
+{
+	if(limits_.dropCache)
+	{
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+}
+
+void IoThrottle::doneReading(int fd, uint64_t offset, uint64_t length) const
+{
+	if(limits_.dropCache)
+	{
+		::posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+	}
+}
+
+ThrottledInputBuf::~ThrottledInputBuf()
+{
+	close();
+}
+
+bool ThrottledInputBuf::open(const fs::path& path)
+{
+	close();
+
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd_ < 0)
+	{
+		return false;
+	}
+
+	ioThrottle.startReading(fd_);
+	buffer_.resize(IO_CHUNK);
+	filePos_ = 0;
+	setg(buffer_.data(), buffer_.data(), buffer_.data());
+	return true;
+}
+
+void ThrottledInputBuf::close()
+{
+	if(fd_ < 0)
+	{
+		return;
+	}
+
+	//each chunk dropped its pages in underflow, the rest of the file
+	//may be cached for someone else
+	::close(fd_);
+	fd_ = -1;
+}
+
+ThrottledInputBuf::int_type ThrottledInputBuf::underflow()
+{
+	if(gptr() < egptr())
+	{
+		return traits_type::to_int_type(*gptr());
+	}
+
+	if(fd_ < 0)
+	{
+		return traits_type::eof();
+	}
+
+	ioThrottle.beforeIo();
+	auto ret = ::pread(fd_, buffer_.data(), buffer_.size(), filePos_);
+	ioThrottle.afterIo(std::max<ssize_t>(ret, 0));
+	if(ret <= 0)
+	{
+		return traits_type::eof();
+	}
+
+	ioThrottle.doneReading(fd_, filePos_, ret);
+	filePos_ += ret;
+	setg(buffer_.data(), buffer_.data(), buffer_.data() + ret);
+
+	return traits_type::to_int_type(*gptr());
+}
+
+ThrottledInputBuf::pos_type ThrottledInputBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+		std::ios_base::openmode which)
+{
+	if(fd_ < 0 || !(which & std::ios_base::in))
+	{
+		return pos_type(off_type(-1));
+	}
+
+	off_type current = filePos_ - (egptr() - gptr());
+	off_type target = off;
+	if(dir == std::ios_base::cur)
+	{
+		target += current;
+	}
+	else if(dir == std::ios_base::end)
+	{
+		struct stat st{};
+		if(::fstat(fd_, &st) != 0)
+		{
+			return pos_type(off_type(-1));
+		}
+		target += st.st_size;
+	}
+
+	if(target < 0)
+	{
+		return pos_type(off_type(-1));
+	}
+
+	//staying in the buffered chunk if possible
+	off_type bufferStart = filePos_ - (egptr() - eback());
+	if(target >= bufferStart && target <= static_cast<off_type>(filePos_))
+	{
+		setg(eback(), eback() + (target - bufferStart), egptr());
+	}
+	else
+	{
+		filePos_ = target;
+		setg(buffer_.data(), buffer_.data(), buffer_.data());
+	}
+
+	return pos_type(target);
+}
+
+ThrottledInputBuf::pos_type ThrottledInputBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+ThrottledOutputBuf::~ThrottledOutputBuf()
+{
+	close();
+}
+
+bool ThrottledOutputBuf::open(const fs::path& path, bool append)
+{
+	close();
+
+	fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+	if(fd_ < 0)
+	{
+		return false;
+	}
+
+	struct stat st{};
+	buffer_.resize(IO_CHUNK);
+	filePos_ = (append && ::fstat(fd_, &st) == 0) ? st.st_size : 0;
+	writeBackPos_ = filePos_;
+	setp(buffer_.data(), buffer_.data() + buffer_.size());
+	return true;
+}
+
+bool ThrottledOutputBuf::close()
+{
+	if(fd_ < 0)
+	{
+		return true;
+	}
+
+	bool ok = writeBuffer();
+	if(ioThrottle.dropCache())
+	{
+		::sync_file_range(fd_, writeBackPos_, 0,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		::posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	ok = (::close(fd_) == 0) && ok;
+	fd_ = -1;
+	return ok;
+}
+
+ThrottledOutputBuf::int_type ThrottledOutputBuf::overflow(int_type ch)
+{
+	if(!writeBuffer())
+	{
+		return traits_type::eof();
+	}
+
+	if(!traits_type::eq_int_type(ch, traits_type::eof()))
+	{
+		*pptr() = traits_type::to_char_type(ch);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(ch);
+}
+
+int ThrottledOutputBuf::sync()
+{
+	return writeBuffer() ? 0 : -1;
+}
+
+bool ThrottledOutputBuf::writeBuffer()
+{
+	if(fd_ < 0)
+	{
+		return false;
+	}
+
+	size_t length = pptr() - pbase();
+	if(length == 0)
+	{
+		return true;
+	}
+
+	uint64_t chunkStart = filePos_;
+	const char* pData = pbase();
+	while(length > 0)
+	{
+		ioThrottle.beforeIo();
+		auto ret = ::write(fd_, pData, length);
+		if(ret < 0)
+		{
+			return false;
+		}
+		ioThrottle.afterIo(ret);
+		pData += ret;
+		length -= ret;
+		filePos_ += ret;
+	}
+	setp(buffer_.data(), buffer_.data() + buffer_.size());
+
+	//Dirty pages cannot be dropped. The write back of this chunk is
+	//started, the previous chunk is waited for and dropped, so the
+	//disk keeps writing while the next chunk is produced.
+	if(ioThrottle.dropCache())
+	{
+		::sync_file_range(fd_, chunkStart, filePos_ - chunkStart, SYNC_FILE_RANGE_WRITE);
+		if(chunkStart > writeBackPos_)
+		{
+			::sync_file_range(fd_, writeBackPos_, chunkStart - writeBackPos_,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			::posix_fadvise(fd_, writeBackPos_, chunkStart - writeBackPos_, POSIX_FADV_DONTNEED);
+			writeBackPos_ = chunkStart;
+		}
+	}
+
+	return true;
+}
+
+SourceFile::SourceFile(const fs::path& path):
+	std::istream(nullptr)
+{
+	if(ioThrottle.enabled())
+	{
+		if(throttledBuf_.open(path))
+		{
+			rdbuf(&throttledBuf_);
+		}
+	}
+	else if(fileBuf_.open(path, std::ios::in | std::ios::binary))
+	{
+		rdbuf(&fileBuf_);
+	}
+}
+
+void SourceFile::close()
+{
+	throttledBuf_.close();
+	if(fileBuf_.is_open())
+	{
+		fileBuf_.close();
+	}
+}
+
+ArchiveFile::ArchiveFile(const fs::path& path, uint64_t resumeOffset):
+	std::ostream(nullptr),
+	path_(path)
+{
+	bool append = resumeOffset > 0;
+	if(append)
+	{
+		//the tail after the last checkpoint is written again
+		std::error_code ec;
+		if(fs::file_size(path, ec) < resumeOffset || ec)
+		{
+			return;
+		}
+		fs::resize_file(path, resumeOffset, ec);
+		if(ec)
+		{
+			return;
+		}
+	}
+
+	if(ioThrottle.enabled())
+	{
+		if(throttledBuf_.open(path, append))
+		{
+			rdbuf(&throttledBuf_);
+		}
+	}
+	else if(fileBuf_.open(path, std::ios::out | std::ios::binary | (append ? std::ios::app : std::ios::trunc)))
+	{
+		rdbuf(&fileBuf_);
+	}
+}
+
+bool ArchiveFile::syncToDisk(uint64_t& size)
+{
+	if(!flush())
+	{
+		return false;
+	}
+
+	//any descriptor of the file syncs the same page cache
+	int fd = ::open(path_.c_str(), O_WRONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return false;
+	}
+	bool syncedOk = (::fdatasync(fd) == 0);
+	::close(fd);
+
+	std::error_code ec;
+	size = fs::file_size(path_, ec);
+	return syncedOk && !ec;
+}
+
+void ArchiveFile::close()
+{
+	bool closedOk = ioThrottle.enabled() ? throttledBuf_.close() : (fileBuf_.close() != nullptr);
+	if(!closedOk)
+	{
+		setstate(std::ios::failbit);
+	}
+}
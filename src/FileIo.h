@@ -0,0 +1,155 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+//Token bucket, take() blocks until the amount is available.
+//The burst is one second of the rate.
+class TokenBucket
+{
+public:
+	//0 - unlimited
+	void setRate(uint64_t perSecond);
+	void take(uint64_t amount);
+
+private:
+	std::mutex mutex_;
+	double rate_{0};
+	double tokens_{0};
+	std::chrono::steady_clock::time_point last_{};
+};
+
+//Packing on production hosts: the source reads and the archive writes
+//leave the page cache to the applications and can be throttled
+class IoThrottle
+{
+public:
+	struct Limits
+	{
+		//the read and written pages are dropped from the page cache
+		bool dropCache{false};
+		//0 - unlimited
+		uint64_t bytesPerSecond{0};
+		uint64_t opsPerSecond{0};
+	};
+
+	void setLimits(const Limits& limits);
+
+	//SourceFile and ArchiveFile bypass the standard file streams only then
+	bool enabled() const { return enabled_; }
+	bool dropCache() const { return limits_.dropCache; }
+
+	//called before each read or write system call
+	void beforeIo();
+	//charges the bytes the call really transferred, a short read
+	//at the end of a file costs only what it returned
+	void afterIo(uint64_t bytes);
+	//when the pages are dropped, no read ahead past the requested ranges,
+	//so only the pages this reader pulled in are evicted by doneReading
+	void startReading(int fd) const;
+	//pages of [offset, offset + length) are dropped if requested, 0 length - to the end
+	void doneReading(int fd, uint64_t offset, uint64_t length) const;
+
+private:
+	Limits limits_;
+	bool enabled_{false};
+	TokenBucket bytes_;
+	TokenBucket ops_;
+};
+
+extern IoThrottle ioThrottle;
+
+//Reads with pread in IO_CHUNK pieces through the throttle
+class ThrottledInputBuf : public std::streambuf
+{
+public:
+	ThrottledInputBuf() = default;
+	~ThrottledInputBuf() override;
+
+	ThrottledInputBuf(const ThrottledInputBuf&) = delete;
+	ThrottledInputBuf& operator=(const ThrottledInputBuf&) = delete;
+
+	bool open(const fs::path& path);
+	void close();
+
+protected:
+	int_type underflow() override;
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	int fd_{-1};
+	//file offset of the end of the get area
+	uint64_t filePos_{0};
+	std::vector<char> buffer_;
+};
+
+//Writes IO_CHUNK pieces through the throttle, the written pages are
+//flushed to the disk and dropped when requested
+class ThrottledOutputBuf : public std::streambuf
+{
+public:
+	ThrottledOutputBuf() = default;
+	~ThrottledOutputBuf() override;
+
+	ThrottledOutputBuf(const ThrottledOutputBuf&) = delete;
+	ThrottledOutputBuf& operator=(const ThrottledOutputBuf&) = delete;
+
+	//append continues at the end of the existing file
+	bool open(const fs::path& path, bool append = false);
+	bool close();
+
+protected:
+	int_type overflow(int_type ch) override;
+	int sync() override;
+
+private:
+	bool writeBuffer();
+
+	int fd_{-1};
+	uint64_t filePos_{0};
+	//start of the range whose write back was started but not yet dropped
+	uint64_t writeBackPos_{0};
+	std::vector<char> buffer_;
+};
+
+//std::ifstream or the throttled reads, depending on ioThrottle
+class SourceFile : public std::istream
+{
+public:
+	explicit SourceFile(const fs::path& path);
+
+	void close();
+
+private:
+	std::filebuf fileBuf_;
+	ThrottledInputBuf throttledBuf_;
+};
+
+//std::ofstream or the throttled writes, depending on ioThrottle
+class ArchiveFile : public std::ostream
+{
+public:
+	//a resumed archive is cut to resumeOffset and appended to
+	explicit ArchiveFile(const fs::path& path, uint64_t resumeOffset = 0);
+
+	//flushes the stream and the file data to the disk,
+	//size is the durable size of the file
+	bool syncToDisk(uint64_t& size);
+
+	void close();
+
+private:
+	fs::path path_;
+	std::filebuf fileBuf_;
+	ThrottledOutputBuf throttledBuf_;
+};
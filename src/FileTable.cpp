@@ -0,0 +1,150 @@
+#include "FileTable.h"
+#include <cassert>
+
+void FileTable::reserve(size_t numFiles)
+{
+	sizes_.reserve(numFiles);
+	names_.reserve(numFiles);
+}
+
+void FileTable::shrinkToFit()
+{
+	sizes_.shrink_to_fit();
+	names_.shrink_to_fit();
+	overflow_.shrink_to_fit();
+}
+
+FileTable::Index FileTable::add(FileSizeType size, DirTreeNodeRef name)
+{
+	sizes_.push_back(size);
+	names_.push_back(name);
+	return sizes_.size() - 1;
+}
+
+size_t FileTable::numNames(Index idx) const
+{
+	if(names_[idx] == 0)
+	{
+		return 0;
+	}
+
+	auto it = overflowLists_.find(idx);
+	return 1 + (it == overflowLists_.end() ? 0 : it->second.count_);
+}
+
+void FileTable::addName(Index idx, DirTreeNodeRef name)
+{
+	uint32_t pos = overflow_.size();
+	overflow_.push_back({name, NONE});
+
+	auto [it, inserted] = overflowLists_.try_emplace(idx, OverflowList{pos, pos, 1});
+	if(!inserted)
+	{
+		auto& list = it->second;
+		overflow_[list.tail_].next_ = pos;
+		list.tail_ = pos;
+		++list.count_;
+	}
+}
+
+std::vector<DirTreeNodeRef> FileTable::names(Index idx) const
+{
+	std::vector<DirTreeNodeRef> ret;
+	if(names_[idx] == 0)
+	{
+		return ret;
+	}
+
+	ret.push_back(names_[idx]);
+
+	auto it = overflowLists_.find(idx);
+	if(it != overflowLists_.end())
+	{
+		ret.reserve(1 + it->second.count_);
+		for(uint32_t pos = it->second.head_; pos != NONE; pos = overflow_[pos].next_)
+		{
+			ret.push_back(overflow_[pos].name_);
+		}
+	}
+
+	return ret;
+}
+
+void FileTable::mergeNames(Index idx, Index from)
+{
+	addName(idx, names_[from]);
+	names_[from] = 0;
+
+	auto fromIt = overflowLists_.find(from);
+	if(fromIt == overflowLists_.end())
+	{
+		return;
+	}
+
+	//linking the whole list of from after the list of idx
+	auto& list = overflowLists_.at(idx);
+	overflow_[list.tail_].next_ = fromIt->second.head_;
+	list.tail_ = fromIt->second.tail_;
+	list.count_ += fromIt->second.count_;
+	overflowLists_.erase(fromIt);
+}
+
+void FileTable::setPhysOffset(Index idx, uint64_t offset)
+{
+	if(physOffsets_.size() <= idx)
+	{
+		physOffsets_.resize(idx + 1, 0);
+	}
+	physOffsets_[idx] = offset;
+}
+
+uint64_t FileTable::physOffset(Index idx) const
+{
+	return idx < physOffsets_.size() ? physOffsets_[idx] : 0;
+}
+
+void FileTable::addHashSlots(const std::vector<Index>& files)
+{
+	if(hashSlots_.size() < sizes_.size())
+	{
+		hashSlots_.resize(sizes_.size(), NONE);
+	}
+
+	for(Index idx : files)
+	{
+		if(hashSlots_[idx] == NONE)
+		{
+			hashSlots_[idx] = hashes_.size();
+			hashes_.emplace_back();
+		}
+	}
+}
+
+FileTable::Hashes& FileTable::hashes(Index idx)
+{
+	assert(idx < hashSlots_.size() && hashSlots_[idx] != NONE);
+	return hashes_[hashSlots_[idx]];
+}
+
+const FileTable::Hashes& FileTable::hashes(Index idx) const
+{
+	static const Hashes noHashes{};
+
+	if(idx >= hashSlots_.size() || hashSlots_[idx] == NONE)
+	{
+		return noHashes;
+	}
+	return hashes_[hashSlots_[idx]];
+}
+
+bool FileTable::isSameContent(Index left, Index right) const
+{
+	const auto& leftHashes = hashes(left);
+	const auto& rightHashes = hashes(right);
+
+	return sizes_[left] == sizes_[right] &&
+		leftHashes.partialHash_ == rightHashes.partialHash_ &&
+		leftHashes.fullHash_.high64 == rightHashes.fullHash_.high64 &&
+		leftHashes.fullHash_.low64 == rightHashes.fullHash_.low64 &&
+		leftHashes.group_ == rightHashes.group_;
+}
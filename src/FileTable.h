@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <xxhash.h>
+#include "DataStructs.h"
+
+//Files of the packed directory as a struct of arrays, one entry is
+//12 bytes for the most common case of a file with a single name, 16
+//once the duplicate search has sized the hash slot index.
+//The further names (hard links, merged duplicates) go to the overflow
+//pool and the hashes are kept only for the files with a same size
+//candidate.
+class FileTable
+{
+public:
+	using Index = uint32_t;
+	using FileSizeType = FileInfo::FileSizeType;
+
+	struct Hashes
+	{
+		XXH128_hash_t fullHash_{};
+		XXH64_hash_t partialHash_{};
+		//see FileInfo::group_
+		uint32_t group_{};
+	};
+
+	size_t size() const { return sizes_.size(); }
+	bool empty() const { return sizes_.empty(); }
+
+	void reserve(size_t numFiles);
+	void shrinkToFit();
+
+	Index add(FileSizeType size, DirTreeNodeRef name);
+
+	FileSizeType fileSize(Index idx) const { return sizes_[idx]; }
+
+	//first name, 0 (the root dir) if the file was merged into another one
+	DirTreeNodeRef firstName(Index idx) const { return names_[idx]; }
+	size_t numNames(Index idx) const;
+	void addName(Index idx, DirTreeNodeRef name);
+	//all names in the order they were added
+	std::vector<DirTreeNodeRef> names(Index idx) const;
+	//appends the names of from to idx, from is left without names
+	void mergeNames(Index idx, Index from);
+
+	//for renumbering the tree, func gets and returns a name reference
+	template <typename F>
+	void remapNames(F func)
+	{
+		for(auto& name : names_)
+		{
+			name = func(name);
+		}
+		for(auto& overflow : overflow_)
+		{
+			overflow.name_ = func(overflow.name_);
+		}
+	}
+
+	//only set with the physical order option, 0 otherwise
+	void setPhysOffset(Index idx, uint64_t offset);
+	uint64_t physOffset(Index idx) const;
+
+	//creates the missing hash slots of the files, hashes() of them
+	//returns references that stay valid until the next call
+	void addHashSlots(const std::vector<Index>& files);
+	//the slot must have been added
+	Hashes& hashes(Index idx);
+	//zero hashes for the files that were not hashed
+	const Hashes& hashes(Index idx) const;
+
+	bool isSameContent(Index left, Index right) const;
+
+private:
+	static constexpr uint32_t NONE = UINT32_MAX;
+
+	struct OverflowName
+	{
+		DirTreeNodeRef name_;
+		uint32_t next_;
+	};
+
+	//linked list of the further names of a file in overflow_
+	struct OverflowList
+	{
+		uint32_t head_;
+		uint32_t tail_;
+		uint32_t count_;
+	};
+
+	std::vector<FileSizeType> sizes_;
+	std::vector<DirTreeNodeRef> names_;
+
+	std::vector<OverflowName> overflow_;
+	std::unordered_map<Index, OverflowList> overflowLists_;
+
+	std::vector<uint64_t> physOffsets_;
+
+	//position in hashes_ or NONE, sized on the first addHashSlots() call
+	std::vector<uint32_t> hashSlots_;
+	std::vector<Hashes> hashes_;
+};
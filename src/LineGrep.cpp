@@ -0,0 +1,147 @@
+#include "LineGrep.h"
+#include <algorithm>
+#include <cstring>
+
+LineGrep::LineGrep(std::string pattern, bool regex):
+	pattern_(std::move(pattern)),
+	regex_(regex)
+{
+	if(!regex_)
+	{
+		return;
+	}
+
+	int ret = ::regcomp(&compiled_, pattern_.c_str(), REG_EXTENDED | REG_NOSUB);
+	if(ret != 0)
+	{
+		char message[256];
+		::regerror(ret, &compiled_, message, sizeof(message));
+		error_ = message;
+		valid_ = false;
+	}
+}
+
+LineGrep::~LineGrep()
+{
+	if(regex_ && valid_)
+	{
+		::regfree(&compiled_);
+	}
+}
+
+void LineGrep::reset()
+{
+	lineNumber_ = 0;
+	partial_.clear();
+}
+
+//the rest of an overlong line is dropped, it only has to be counted
+void LineGrep::appendPartial(const char* pData, size_t size)
+{
+	partial_.append(pData, std::min(size, MAX_LINE_LENGTH - partial_.size()));
+}
+
+bool LineGrep::isMatch(const char* pLine, size_t size) const
+{
+	if(!regex_)
+	{
+		return ::memmem(pLine, size, pattern_.data(), pattern_.size()) != nullptr;
+	}
+
+	//REG_STARTEND - the line is not copied to terminate it
+	regmatch_t range{};
+	range.rm_so = 0;
+	range.rm_eo = static_cast<regoff_t>(size);
+	return ::regexec(&compiled_, pLine, 1, &range, REG_STARTEND) == 0;
+}
+
+void LineGrep::searchLines(const char* pBegin, const char* pEnd, const MatchFunc& match)
+{
+	//[pBegin, pEnd) holds whole lines, pEnd is after the last '\n'
+	if(regex_)
+	{
+		for(const char* pLine = pBegin; pLine < pEnd;)
+		{
+			auto pNewLine = static_cast<const char*>(std::memchr(pLine, '\n', pEnd - pLine));
+			++lineNumber_;
+			if(isMatch(pLine, pNewLine - pLine))
+			{
+				match(lineNumber_, std::string_view(pLine, pNewLine - pLine));
+			}
+			pLine = pNewLine + 1;
+		}
+		return;
+	}
+
+	//lines up to pCounted are in lineNumber_
+	const char* pCounted = pBegin;
+	const char* pSearch = pBegin;
+	while(pSearch < pEnd)
+	{
+		auto pHit = static_cast<const char*>(::memmem(pSearch, pEnd - pSearch, pattern_.data(), pattern_.size()));
+		if(pHit == nullptr)
+		{
+			break;
+		}
+
+		auto pLine = static_cast<const char*>(::memrchr(pSearch, '\n', pHit - pSearch));
+		pLine = pLine ? pLine + 1 : pSearch;
+		auto pNewLine = static_cast<const char*>(std::memchr(pHit, '\n', pEnd - pHit));
+		//a hit across the line end is no match
+		if(pNewLine < pHit + pattern_.size())
+		{
+			pSearch = pNewLine + 1;
+			continue;
+		}
+
+		lineNumber_ += std::count(pCounted, pLine, '\n') + 1;
+		match(lineNumber_, std::string_view(pLine, pNewLine - pLine));
+		pCounted = pNewLine + 1;
+		pSearch = pCounted;
+	}
+
+	lineNumber_ += std::count(pCounted, pEnd, '\n');
+}
+
+void LineGrep::feed(const char* pData, size_t size, const MatchFunc& match)
+{
+	const char* pEnd = pData + size;
+
+	if(!partial_.empty())
+	{
+		auto pNewLine = static_cast<const char*>(std::memchr(pData, '\n', size));
+		if(pNewLine == nullptr)
+		{
+			appendPartial(pData, size);
+			return;
+		}
+
+		appendPartial(pData, pNewLine - pData);
+		++lineNumber_;
+		if(isMatch(partial_.data(), partial_.size()))
+		{
+			match(lineNumber_, partial_);
+		}
+		partial_.clear();
+		pData = pNewLine + 1;
+	}
+
+	auto pLastNewLine = static_cast<const char*>(::memrchr(pData, '\n', pEnd - pData));
+	const char* pWhole = pLastNewLine ? pLastNewLine + 1 : pData;
+	searchLines(pData, pWhole, match);
+	partial_.clear();
+	appendPartial(pWhole, pEnd - pWhole);
+}
+
+void LineGrep::finish(const MatchFunc& match)
+{
+	if(!partial_.empty())
+	{
+		++lineNumber_;
+		if(isMatch(partial_.data(), partial_.size()))
+		{
+			match(lineNumber_, partial_);
+		}
+	}
+	reset();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <regex.h>
+
+//Finds the lines containing a pattern in data fed in pieces of any size.
+//The literal search runs over the whole piece with memmem and only the
+//lines around the hits are looked at; the regex is matched line by line.
+//A line split between the pieces is searched and reported in its first
+//MAX_LINE_LENGTH bytes only.
+class LineGrep
+{
+public:
+	//lineNumber counts from 1, the line is without the '\n'
+	using MatchFunc = std::function<void(uint64_t lineNumber, std::string_view line)>;
+
+	//regex - POSIX extended regular expression, otherwise a literal
+	LineGrep(std::string pattern, bool regex);
+	~LineGrep();
+
+	LineGrep(const LineGrep&) = delete;
+	LineGrep& operator=(const LineGrep&) = delete;
+
+	//the regex compiled
+	bool valid() const { return valid_; }
+	const std::string& error() const { return error_; }
+
+	//starts a new file
+	void reset();
+	void feed(const char* pData, size_t size, const MatchFunc& match);
+	//the last line without the '\n'
+	void finish(const MatchFunc& match);
+
+private:
+	static constexpr size_t MAX_LINE_LENGTH = (1U << 20U); //1MB
+
+	void appendPartial(const char* pData, size_t size);
+	bool isMatch(const char* pLine, size_t size) const;
+	void searchLines(const char* pBegin, const char* pEnd, const MatchFunc& match);
+
+	std::string pattern_;
+	bool regex_{false};
+	bool valid_{true};
+	std::string error_;
+	regex_t compiled_{};
+
+	//lines before the start of partial_
+	uint64_t lineNumber_{0};
+	//the line not finished in the previous piece, at most MAX_LINE_LENGTH
+	std::string partial_;
+};
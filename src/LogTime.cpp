@@ -0,0 +1,350 @@
+#include "LogTime.h"
+#include "FileIo.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+namespace
+{
+//bytes read from each end of a file, the lines with the timestamps are there
+constexpr size_t PROBE_SIZE = (1U << 14U); //16KB
+//the timestamp is searched for only at the beginning of the line
+constexpr size_t MAX_PREFIX = 48;
+//epoch numbers outside of 2000..2100 are something else
+constexpr int64_t MIN_EPOCH = 946684800;
+constexpr int64_t MAX_EPOCH = 4102444800;
+
+bool readDigits(const char*& p, const char* pEnd, size_t count, int& value)
+{
+	if(static_cast<size_t>(pEnd - p) < count)
+	{
+		return false;
+	}
+
+	value = 0;
+	for(size_t i = 0; i < count; ++i, ++p)
+	{
+		if(*p < '0' || *p > '9')
+		{
+			return false;
+		}
+		value = value * 10 + (*p - '0');
+	}
+	return true;
+}
+
+bool isDigit(const char* p, const char* pEnd)
+{
+	return p < pEnd && *p >= '0' && *p <= '9';
+}
+
+//calendar fields to the epoch, with the zone offset in seconds or as local time
+bool toEpoch(std::tm& fields, bool hasZone, int zoneOffset, int64_t& seconds)
+{
+	if(fields.tm_mon < 0 || fields.tm_mon > 11 || fields.tm_mday < 1 || fields.tm_mday > 31
+			|| fields.tm_hour > 23 || fields.tm_min > 59 || fields.tm_sec > 60)
+	{
+		return false;
+	}
+
+	if(hasZone)
+	{
+		seconds = static_cast<int64_t>(::timegm(&fields)) - zoneOffset;
+		return true;
+	}
+
+	fields.tm_isdst = -1;
+	seconds = static_cast<int64_t>(std::mktime(&fields));
+	return seconds != -1;
+}
+
+//YYYY-MM-DD[(T| )HH:MM[:SS][.fraction]][Z|(+|-)HH[:]MM]
+bool parseIso(const char* p, const char* pEnd, bool timeRequired, int64_t& seconds)
+{
+	std::tm fields{};
+	int year = 0, month = 0, day = 0;
+	if(!readDigits(p, pEnd, 4, year) || p == pEnd || *p++ != '-'
+			|| !readDigits(p, pEnd, 2, month) || p == pEnd || *p++ != '-'
+			|| !readDigits(p, pEnd, 2, day) || isDigit(p, pEnd))
+	{
+		return false;
+	}
+	fields.tm_year = year - 1900;
+	fields.tm_mon = month - 1;
+	fields.tm_mday = day;
+
+	bool hasTime = p + 1 < pEnd && (*p == 'T' || *p == ' ') && isDigit(p + 1, pEnd);
+	if(!hasTime)
+	{
+		return !timeRequired && p == pEnd && toEpoch(fields, false, 0, seconds);
+	}
+
+	++p;
+	if(!readDigits(p, pEnd, 2, fields.tm_hour) || p == pEnd || *p++ != ':'
+			|| !readDigits(p, pEnd, 2, fields.tm_min))
+	{
+		return false;
+	}
+	if(p < pEnd && *p == ':')
+	{
+		++p;
+		if(!readDigits(p, pEnd, 2, fields.tm_sec))
+		{
+			return false;
+		}
+	}
+	else if(timeRequired)
+	{
+		return false;
+	}
+
+	if(p < pEnd && (*p == '.' || *p == ','))
+	{
+		++p;
+		while(isDigit(p, pEnd)) ++p;
+	}
+
+	bool hasZone = false;
+	int zoneOffset = 0;
+	if(p < pEnd && *p == 'Z')
+	{
+		hasZone = true;
+		++p;
+	}
+	else if(p < pEnd && (*p == '+' || *p == '-') && isDigit(p + 1, pEnd))
+	{
+		int sign = (*p++ == '+') ? 1 : -1;
+		int hours = 0, minutes = 0;
+		if(!readDigits(p, pEnd, 2, hours))
+		{
+			return false;
+		}
+		if(p < pEnd && *p == ':') ++p;
+		if(!readDigits(p, pEnd, 2, minutes))
+		{
+			return false;
+		}
+		hasZone = true;
+		zoneOffset = sign * (hours * 3600 + minutes * 60);
+	}
+
+	//the whole argument has to be the time, a line continues after it
+	if(!timeRequired && p != pEnd)
+	{
+		return false;
+	}
+
+	return toEpoch(fields, hasZone, zoneOffset, seconds);
+}
+
+//Mmm dD HH:MM:SS, the year is not in the line
+bool parseSyslog(const char* p, const char* pEnd, int64_t referenceTime, int64_t& seconds)
+{
+	static constexpr const char* MONTHS = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	if(pEnd - p < 15 || p[3] != ' ')
+	{
+		return false;
+	}
+
+	const char* pMonth = std::search(MONTHS, MONTHS + 36, p, p + 3);
+	if(pMonth == MONTHS + 36 || (pMonth - MONTHS) % 3 != 0)
+	{
+		return false;
+	}
+
+	std::tm fields{};
+	fields.tm_mon = static_cast<int>(pMonth - MONTHS) / 3;
+	p += 4;
+	//the day is padded with a space
+	if(*p == ' ') ++p;
+	const char* pDay = p;
+	if(!readDigits(p, pEnd, isDigit(pDay + 1, pEnd) ? 2 : 1, fields.tm_mday)
+			|| p == pEnd || *p++ != ' '
+			|| !readDigits(p, pEnd, 2, fields.tm_hour) || p == pEnd || *p++ != ':'
+			|| !readDigits(p, pEnd, 2, fields.tm_min) || p == pEnd || *p++ != ':'
+			|| !readDigits(p, pEnd, 2, fields.tm_sec))
+	{
+		return false;
+	}
+
+	std::time_t reference = static_cast<std::time_t>(referenceTime);
+	std::tm referenceFields{};
+	::localtime_r(&reference, &referenceFields);
+	fields.tm_year = referenceFields.tm_year;
+	if(!toEpoch(fields, false, 0, seconds))
+	{
+		return false;
+	}
+
+	//December lines in a file written in January
+	static constexpr int64_t DAY = 86400;
+	if(seconds > referenceTime + DAY)
+	{
+		fields.tm_year -= 1;
+		return toEpoch(fields, false, 0, seconds);
+	}
+	return true;
+}
+
+//10 digit seconds or 13 digit milliseconds, optionally with a fraction
+bool parseEpoch(const char* p, const char* pEnd, int64_t& seconds)
+{
+	const char* pStart = p;
+	int64_t value = 0;
+	while(isDigit(p, pEnd) && p - pStart < 14)
+	{
+		value = value * 10 + (*p++ - '0');
+	}
+
+	size_t numDigits = p - pStart;
+	if(isDigit(p, pEnd) || (numDigits != 10 && numDigits != 13))
+	{
+		return false;
+	}
+
+	seconds = (numDigits == 13) ? value / 1000 : value;
+	return seconds >= MIN_EPOCH && seconds <= MAX_EPOCH;
+}
+}
+
+bool LogTime::parseLine(std::string_view line, int64_t referenceTime, int64_t& seconds)
+{
+	const char* pBegin = line.data();
+	const char* pEnd = pBegin + line.size();
+	const char* pLast = pBegin + std::min(line.size(), MAX_PREFIX);
+
+	for(const char* p = pBegin; p < pLast; ++p)
+	{
+		//a timestamp starts a word
+		if(p > pBegin && std::isalnum(static_cast<unsigned char>(p[-1])))
+		{
+			continue;
+		}
+
+		if(isDigit(p, pEnd))
+		{
+			//a bare number is taken as the time only as the first word
+			bool firstWord = (p == pBegin) || (p == pBegin + 1 && *pBegin == '[');
+			if(parseIso(p, pEnd, true, seconds) || (firstWord && parseEpoch(p, pEnd, seconds)))
+			{
+				return true;
+			}
+		}
+		else if(*p >= 'A' && *p <= 'Z' && parseSyslog(p, pEnd, referenceTime, seconds))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool LogTime::parseArgument(const std::string& text, int64_t& seconds)
+{
+	const char* p = text.data();
+	const char* pEnd = p + text.size();
+
+	if(p < pEnd && *p == '@')
+	{
+		++p;
+		bool negative = (p < pEnd && *p == '-');
+		if(negative) ++p;
+		if(p == pEnd)
+		{
+			return false;
+		}
+
+		seconds = 0;
+		for(; p < pEnd; ++p)
+		{
+			if(!isDigit(p, pEnd))
+			{
+				return false;
+			}
+			seconds = seconds * 10 + (*p - '0');
+		}
+		if(negative) seconds = -seconds;
+		return true;
+	}
+
+	return parseIso(p, pEnd, false, seconds);
+}
+
+bool LogTime::detectRange(const fs::path& path, uint64_t size, int64_t referenceTime,
+		int64_t& first, int64_t& last)
+{
+	if(size == 0)
+	{
+		return false;
+	}
+
+	SourceFile fileIn(path);
+	std::vector<char> buffer(std::min<uint64_t>(PROBE_SIZE, size));
+	fileIn.read(buffer.data(), buffer.size());
+	if(static_cast<size_t>(fileIn.gcount()) != buffer.size())
+	{
+		return false;
+	}
+
+	//the head: the first line with a timestamp
+	bool found = false;
+	const char* pEnd = buffer.data() + buffer.size();
+	for(const char* pLine = buffer.data(); pLine < pEnd && !found;)
+	{
+		auto pNewLine = static_cast<const char*>(std::memchr(pLine, '\n', pEnd - pLine));
+		if(pNewLine == nullptr && buffer.size() < size)
+		{
+			//cut by the end of the probe
+			break;
+		}
+		const char* pLineEnd = pNewLine ? pNewLine : pEnd;
+		found = parseLine(std::string_view(pLine, pLineEnd - pLine), referenceTime, first);
+		pLine = pLineEnd + 1;
+	}
+
+	if(!found)
+	{
+		return false;
+	}
+
+	//the tail: the last line with a timestamp
+	uint64_t tailOffset = size - buffer.size();
+	if(tailOffset > 0)
+	{
+		fileIn.seekg(tailOffset);
+		fileIn.read(buffer.data(), buffer.size());
+		if(static_cast<size_t>(fileIn.gcount()) != buffer.size())
+		{
+			return false;
+		}
+	}
+
+	const char* pBegin = buffer.data();
+	//the first line of the tail may be cut
+	if(tailOffset > 0)
+	{
+		auto pNewLine = static_cast<const char*>(std::memchr(pBegin, '\n', pEnd - pBegin));
+		pBegin = pNewLine ? pNewLine + 1 : pEnd;
+	}
+
+	//the file usually ends with a '\n'
+	const char* pLineEnd = (pEnd > pBegin && pEnd[-1] == '\n') ? pEnd - 1 : pEnd;
+	while(pLineEnd > pBegin)
+	{
+		auto pNewLine = static_cast<const char*>(::memrchr(pBegin, '\n', pLineEnd - pBegin));
+		const char* pLine = pNewLine ? pNewLine + 1 : pBegin;
+		if(parseLine(std::string_view(pLine, pLineEnd - pLine), referenceTime, last))
+		{
+			if(last < first) std::swap(first, last);
+			return true;
+		}
+		pLineEnd = pNewLine ? pNewLine : pBegin;
+	}
+
+	//no timestamp in the tail (e.g. a stack trace), the file was
+	//written until its modification time
+	last = std::max(first, referenceTime);
+	return true;
+}
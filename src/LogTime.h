@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+//Timestamps of the log lines, in seconds since the epoch. The times
+//without a zone are local times of the host parsing them.
+class LogTime
+{
+public:
+	//ISO-8601 (2024-05-01T02:00:00.123+02:00, also with a space and without
+	//the zone), syslog (May  1 02:00:00) or epoch seconds or milliseconds
+	//near the start of the line. The syslog year is the one of the
+	//referenceTime unless that puts the line in its future.
+	static bool parseLine(std::string_view line, int64_t referenceTime, int64_t& seconds);
+
+	//--from/--to: ISO-8601 date with an optional time, or @epoch seconds
+	static bool parseArgument(const std::string& text, int64_t& seconds);
+
+	//the timestamps of the first and the last line having one, looked
+	//for in the head and the tail of the file. Without one in the tail
+	//the last is the referenceTime (the modification time).
+	static bool detectRange(const fs::path& path, uint64_t size, int64_t referenceTime,
+			int64_t& first, int64_t& last);
+};
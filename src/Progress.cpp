@@ -0,0 +1,176 @@
+#include "Progress.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+Progress progress;
+
+namespace
+{
+int64_t nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}
+
+void Progress::start(bool human, int fd, unsigned intervalMs)
+{
+	if(running_ || (!human && fd < 0))
+	{
+		return;
+	}
+
+	human_ = human;
+	fd_ = fd;
+	running_ = true;
+	phaseStart_ = nowNs();
+	thread_ = std::thread(&Progress::run, this, intervalMs);
+}
+
+void Progress::stop()
+{
+	if(!running_)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = false;
+	}
+	cv_.notify_all();
+	thread_.join();
+
+	report(true);
+}
+
+void Progress::setPhase(Phase phase, uint64_t totalFiles, uint64_t totalBytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	//the finished phase keeps its last line
+	if(running_)
+	{
+		report(true);
+	}
+
+	files_ = 0;
+	bytes_ = 0;
+	totalFiles_ = totalFiles;
+	totalBytes_ = totalBytes;
+	phaseStart_ = nowNs();
+	phase_ = phase;
+}
+
+void Progress::setTotals(uint64_t totalFiles, uint64_t totalBytes)
+{
+	totalFiles_ = totalFiles;
+	totalBytes_ = totalBytes;
+}
+
+const char* Progress::phaseName(Phase phase)
+{
+	switch(phase)
+	{
+		case Phase::IDLE: return "idle";
+		case Phase::SCAN: return "scan";
+		case Phase::DEDUP: return "dedup";
+		case Phase::WRITE: return "write";
+		case Phase::COMPRESS: return "compress";
+		case Phase::EXTRACT: return "extract";
+		case Phase::VERIFY: return "verify";
+		case Phase::GREP: return "grep";
+	}
+	return "unknown";
+}
+
+void Progress::run(unsigned intervalMs)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while(!cv_.wait_for(lock, std::chrono::milliseconds(intervalMs), [this]() { return !running_; }))
+	{
+		report(false);
+	}
+}
+
+void Progress::report(bool final)
+{
+	Phase phase = phase_;
+	if(phase == Phase::IDLE)
+	{
+		return;
+	}
+
+	uint64_t files = files_.load(std::memory_order_relaxed);
+	uint64_t bytes = bytes_.load(std::memory_order_relaxed);
+	uint64_t totalFiles = totalFiles_;
+	uint64_t totalBytes = totalBytes_;
+	double seconds = (nowNs() - phaseStart_) / 1e9;
+
+	//averaged over the phase, steadier than the last interval
+	double bytesPerSec = seconds > 0 ? bytes / seconds : 0;
+	double filesPerSec = seconds > 0 ? files / seconds : 0;
+
+	//-1 when it cannot be estimated yet
+	double eta = -1;
+	if(totalBytes > 0 && bytesPerSec > 0)
+	{
+		eta = (totalBytes > bytes ? totalBytes - bytes : 0) / bytesPerSec;
+	}
+	else if(totalFiles > 0 && filesPerSec > 0)
+	{
+		eta = (totalFiles > files ? totalFiles - files : 0) / filesPerSec;
+	}
+
+	char line[256];
+	if(fd_ >= 0)
+	{
+		int len = std::snprintf(line, sizeof(line),
+				"{\"phase\":\"%s\",\"files\":%llu,\"files_total\":%llu,\"bytes\":%llu,\"bytes_total\":%llu,"
+				"\"mb_per_s\":%.2f,\"files_per_s\":%.1f,\"eta_s\":%.0f,\"final\":%s}\n",
+				phaseName(phase), static_cast<unsigned long long>(files), static_cast<unsigned long long>(totalFiles),
+				static_cast<unsigned long long>(bytes), static_cast<unsigned long long>(totalBytes),
+				bytesPerSec / 1e6, filesPerSec, eta, final ? "true" : "false");
+		//the orchestrator may have gone away, the work goes on
+		if(len > 0 && ::write(fd_, line, std::min<size_t>(len, sizeof(line) - 1)) < 0)
+		{
+			fd_ = -1;
+		}
+	}
+
+	if(human_)
+	{
+		std::string text = std::string(phaseName(phase)) + ": " + std::to_string(files);
+		if(totalFiles > 0) text += '/' + std::to_string(totalFiles);
+		std::snprintf(line, sizeof(line), " files, %.1f", bytes / 1e6);
+		text += line;
+		if(totalBytes > 0)
+		{
+			std::snprintf(line, sizeof(line), "/%.1f", totalBytes / 1e6);
+			text += line;
+		}
+		//the scan only looks at the sizes, the bytes are not read
+		if(phase == Phase::SCAN)
+		{
+			std::snprintf(line, sizeof(line), " MB, %.0f files/s", filesPerSec);
+		}
+		else
+		{
+			std::snprintf(line, sizeof(line), " MB, %.1f MB/s", bytesPerSec / 1e6);
+		}
+		text += line;
+		if(eta >= 0)
+		{
+			auto etaSec = static_cast<unsigned long long>(eta);
+			std::snprintf(line, sizeof(line), ", ETA %llu:%02llu:%02llu", etaSec / 3600, etaSec / 60 % 60, etaSec % 60);
+			text += line;
+		}
+
+		//padding over the rest of a longer previous line
+		text.resize(std::max<size_t>(text.size(), 79), ' ');
+		std::cerr << '\r' << text << (final ? "\n" : "") << std::flush;
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+//Progress of the long running work. The counters are relaxed atomics
+//bumped on the hot paths, a separate thread reads them at a fixed rate
+//and prints the status, so the workers never format or write anything.
+class Progress
+{
+public:
+	enum class Phase { IDLE, SCAN, DEDUP, WRITE, COMPRESS, EXTRACT, VERIFY, GREP };
+
+	//human readable line on stderr and/or one JSON object per line on fd
+	//(-1 - off), refreshed every intervalMs
+	void start(bool human, int fd, unsigned intervalMs);
+	//prints the final status and joins the thread
+	void stop();
+
+	//resets the counters, totals of 0 are unknown
+	void setPhase(Phase phase, uint64_t totalFiles = 0, uint64_t totalBytes = 0);
+	void setTotals(uint64_t totalFiles, uint64_t totalBytes);
+
+	void addFiles(uint64_t num) { files_.fetch_add(num, std::memory_order_relaxed); }
+	void addBytes(uint64_t num) { bytes_.fetch_add(num, std::memory_order_relaxed); }
+
+	~Progress() { stop(); }
+
+private:
+	static const char* phaseName(Phase phase);
+
+	void run(unsigned intervalMs);
+	void report(bool final);
+
+	std::atomic<Phase> phase_{Phase::IDLE};
+	std::atomic<uint64_t> files_{0};
+	std::atomic<uint64_t> bytes_{0};
+	std::atomic<uint64_t> totalFiles_{0};
+	std::atomic<uint64_t> totalBytes_{0};
+	//steady clock of the phase start in ns
+	std::atomic<int64_t> phaseStart_{0};
+
+	bool human_{false};
+	int fd_{-1};
+	bool running_{false};
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+};
+
+extern Progress progress;
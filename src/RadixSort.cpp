@@ -0,0 +1,62 @@
+#include "RadixSort.h"
+#include <algorithm>
+
+void radixSort(std::vector<SortKey>& keys)
+{
+	//16 bit digits, the histograms (512KB each) stay in the cache
+	//and a 64 bit key takes at most 4 passes
+	static constexpr unsigned DIGIT_BITS = 16;
+	static constexpr unsigned NUM_DIGITS = 64 / DIGIT_BITS;
+	static constexpr size_t NUM_BUCKETS = size_t{1} << DIGIT_BITS;
+	static constexpr uint64_t DIGIT_MASK = NUM_BUCKETS - 1;
+
+	//the histograms cost more than sorting a few keys
+	if(keys.size() < NUM_BUCKETS)
+	{
+		std::stable_sort(keys.begin(), keys.end(),
+			[](const SortKey& left, const SortKey& right)
+			{
+				return left.key_ < right.key_;
+			});
+		return;
+	}
+
+	//histograms of all the digits in one pass
+	std::vector<size_t> counts(NUM_DIGITS * NUM_BUCKETS, 0);
+	for(const auto& key : keys)
+	{
+		for(unsigned digit = 0; digit < NUM_DIGITS; ++digit)
+		{
+			++counts[digit * NUM_BUCKETS + ((key.key_ >> (digit * DIGIT_BITS)) & DIGIT_MASK)];
+		}
+	}
+
+	std::vector<SortKey> buffer(keys.size());
+
+	for(unsigned digit = 0; digit < NUM_DIGITS; ++digit)
+	{
+		size_t* pCount = counts.data() + digit * NUM_BUCKETS;
+		const unsigned shift = digit * DIGIT_BITS;
+
+		//all keys in one bucket, nothing to do for this digit
+		if(pCount[(keys.front().key_ >> shift) & DIGIT_MASK] == keys.size())
+		{
+			continue;
+		}
+
+		size_t offset = 0;
+		for(size_t bucket = 0; bucket < NUM_BUCKETS; ++bucket)
+		{
+			size_t size = pCount[bucket];
+			pCount[bucket] = offset;
+			offset += size;
+		}
+
+		for(const auto& key : keys)
+		{
+			buffer[pCount[(key.key_ >> shift) & DIGIT_MASK]++] = key;
+		}
+
+		keys.swap(buffer);
+	}
+}
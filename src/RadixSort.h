@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//Compact sort key pointing at an element of a bigger array,
+//sorting these moves 16 bytes instead of the whole element
+struct SortKey
+{
+	uint64_t key_;
+	uint32_t idx_;
+};
+
+//Stable LSD radix sort by key_, 16 bits per pass. The passes over
+//the digits that are the same in all keys are skipped so e.g. sizes
+//below 4GB take at most 2 passes.
+void radixSort(std::vector<SortKey>& keys);
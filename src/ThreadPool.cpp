@@ -0,0 +1,59 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned numThreads)
+{
+	if(numThreads == 0)
+	{
+		numThreads = defaultThreads();
+	}
+
+	workers_.reserve(numThreads);
+	for(unsigned i = 0; i < numThreads; ++i)
+	{
+		workers_.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cv_.notify_all();
+
+	for(auto& worker : workers_)
+	{
+		worker.join();
+	}
+}
+
+unsigned ThreadPool::defaultThreads()
+{
+	unsigned num = std::thread::hardware_concurrency();
+	return num > 0 ? num : 1;
+}
+
+void ThreadPool::workerLoop()
+{
+	while(true)
+	{
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+
+			//finishing the queued tasks before stopping
+			if(tasks_.empty())
+			{
+				return;
+			}
+
+			task = std::move(tasks_.front());
+			tasks_.pop();
+		}
+
+		task();
+	}
+}
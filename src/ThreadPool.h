@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//Fixed set of worker threads executing the submitted tasks in FIFO order
+class ThreadPool
+{
+public:
+	//0 means one thread per hardware thread
+	explicit ThreadPool(unsigned numThreads = 0);
+
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	template <typename F>
+	auto submit(F&& task) -> std::future<std::invoke_result_t<F>>
+	{
+		using ResultType = std::invoke_result_t<F>;
+
+		//std::function needs a copyable callable, packaged_task is move only
+		auto pTask = std::make_shared<std::packaged_task<ResultType()>>(std::forward<F>(task));
+		auto result = pTask->get_future();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			tasks_.emplace([pTask]() { (*pTask)(); });
+		}
+		cv_.notify_one();
+
+		return result;
+	}
+
+	unsigned size() const { return workers_.size(); }
+
+	static unsigned defaultThreads();
+
+private:
+	void workerLoop();
+
+	std::vector<std::thread> workers_;
+	std::queue<std::function<void()>> tasks_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	bool stopping_{false};
+};
@@ -0,0 +1,126 @@
+#include "HashKernels.h"
+#include <cstring>
+#include <ostream>
+
+extern const HashKernels hashKernelsScalar;
+extern const HashKernels hashKernelsBase;
+#ifdef LOGTOOL_HASH_X86
+extern const HashKernels hashKernelsAvx2;
+extern const HashKernels hashKernelsAvx512;
+#endif
+
+namespace
+{
+
+struct Variant
+{
+	const HashKernels* pKernels_;
+	bool (*isSupported_)();
+};
+
+bool always()
+{
+	return true;
+}
+
+#ifdef LOGTOOL_HASH_X86
+//__builtin_cpu_supports checks the OS support of the registers too,
+//the init is needed as this may run before the libgcc constructors
+bool hasAvx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+bool hasAvx512()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+//the best first
+const Variant VARIANTS[] = {
+#ifdef LOGTOOL_HASH_X86
+	{&hashKernelsAvx512, hasAvx512},
+	{&hashKernelsAvx2, hasAvx2},
+#endif
+	{&hashKernelsBase, always},
+	{&hashKernelsScalar, always},
+};
+
+const HashKernels* pSelected = nullptr;
+
+const HashKernels* detect()
+{
+	for(const auto& variant : VARIANTS)
+	{
+		if(variant.isSupported_())
+		{
+			return variant.pKernels_;
+		}
+	}
+	return &hashKernelsBase;
+}
+
+}
+
+const HashKernels& HashKernels::get()
+{
+	static const HashKernels* pDetected = detect();
+	return pSelected ? *pSelected : *pDetected;
+}
+
+bool HashKernels::select(const char* name)
+{
+	if(std::strcmp(name, "auto") == 0)
+	{
+		pSelected = nullptr;
+		return true;
+	}
+
+	for(const auto& variant : VARIANTS)
+	{
+		if(std::strcmp(name, variant.pKernels_->name_) == 0)
+		{
+			if(!variant.isSupported_())
+			{
+				return false;
+			}
+			pSelected = variant.pKernels_;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t HashKernels::numSupported()
+{
+	size_t num = 0;
+	for(const auto& variant : VARIANTS)
+	{
+		num += variant.isSupported_() ? 1 : 0;
+	}
+	return num;
+}
+
+const HashKernels& HashKernels::supported(size_t n)
+{
+	for(const auto& variant : VARIANTS)
+	{
+		if(variant.isSupported_() && n-- == 0)
+		{
+			return *variant.pKernels_;
+		}
+	}
+	return *detect();
+}
+
+void HashKernels::printSupported(std::ostream& out)
+{
+	for(size_t n = 0; n < numSupported(); ++n)
+	{
+		out << (n > 0 ? " " : "") << supported(n).name_;
+	}
+}
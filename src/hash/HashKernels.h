@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <xxhash.h>
+
+//the public type, the variants see XXH128_hash_t renamed by XXH_INLINE_ALL
+using Hash128 = XXH128_hash_t;
+
+//XXH3 compiled for several instruction sets, each variant is a
+//HashKernels*.cpp including xxhash.h with XXH_INLINE_ALL and built with
+//its own -m flags. The best one the CPU runs is picked at startup, the
+//hashes are the same whichever computes them.
+struct HashKernels
+{
+	const char* name_;
+	//one shot XXH3-64 with a seed
+	XXH64_hash_t (*hash64_)(const void* data, size_t length, XXH64_hash_t seed);
+	//streaming XXH3-128, the state is opaque
+	void* (*createState_)();
+	void (*freeState_)(void* pState);
+	void (*reset_)(void* pState);
+	void (*update_)(void* pState, const void* data, size_t length);
+	Hash128 (*digest_)(void* pState);
+	//streaming XXH3-64 with a seed on the same state, equal to hash64_
+	void (*reset64_)(void* pState, XXH64_hash_t seed);
+	void (*update64_)(void* pState, const void* data, size_t length);
+	XXH64_hash_t (*digest64_)(void* pState);
+
+	//the variant in use
+	static const HashKernels& get();
+	//--hash-impl: auto or a variant name, false if unknown or
+	//not supported by the CPU. Called before any hashing starts.
+	static bool select(const char* name);
+	//the variants the CPU runs, the best first
+	static void printSupported(std::ostream& out);
+	//the number of the variants the CPU runs and the n-th of them
+	static size_t numSupported();
+	static const HashKernels& supported(size_t n);
+};
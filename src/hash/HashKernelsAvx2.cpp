@@ -0,0 +1,3 @@
+//Built with -mavx2
+#define HASH_KERNELS hashKernelsAvx2
+#include "HashKernelsImpl.h"
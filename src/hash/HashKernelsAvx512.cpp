@@ -0,0 +1,3 @@
+//Built with -mavx512f
+#define HASH_KERNELS hashKernelsAvx512
+#include "HashKernelsImpl.h"
@@ -0,0 +1,3 @@
+//The baseline of the target, SSE2 on x86-64, NEON on aarch64
+#define HASH_KERNELS hashKernelsBase
+#include "HashKernelsImpl.h"
@@ -0,0 +1,81 @@
+//The body of a hash kernel variant. The including file sets XXH_VECTOR
+//if needed and HASH_KERNELS to the name of the table to define, the
+//instruction set comes from the compiler flags of that file. No C++
+//library headers are included here: their inline functions compiled
+//with the wider instruction set could be picked by the linker for all.
+#include "HashKernels.h"
+
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+namespace
+{
+
+XXH64_hash_t hash64(const void* data, size_t length, XXH64_hash_t seed)
+{
+	return XXH3_64bits_withSeed(data, length, seed);
+}
+
+void* createState()
+{
+	return XXH3_createState();
+}
+
+void freeState(void* pState)
+{
+	XXH3_freeState(static_cast<XXH3_state_t*>(pState));
+}
+
+void reset(void* pState)
+{
+	XXH3_128bits_reset(static_cast<XXH3_state_t*>(pState));
+}
+
+void update(void* pState, const void* data, size_t length)
+{
+	XXH3_128bits_update(static_cast<XXH3_state_t*>(pState), data, length);
+}
+
+Hash128 digest(void* pState)
+{
+	auto hash = XXH3_128bits_digest(static_cast<XXH3_state_t*>(pState));
+	Hash128 ret;
+	ret.low64 = hash.low64;
+	ret.high64 = hash.high64;
+	return ret;
+}
+
+void reset64(void* pState, XXH64_hash_t seed)
+{
+	XXH3_64bits_reset_withSeed(static_cast<XXH3_state_t*>(pState), seed);
+}
+
+void update64(void* pState, const void* data, size_t length)
+{
+	XXH3_64bits_update(static_cast<XXH3_state_t*>(pState), data, length);
+}
+
+XXH64_hash_t digest64(void* pState)
+{
+	return XXH3_64bits_digest(static_cast<XXH3_state_t*>(pState));
+}
+
+}
+
+#if XXH_VECTOR == XXH_AVX512
+#define HASH_KERNELS_NAME "avx512"
+#elif XXH_VECTOR == XXH_AVX2
+#define HASH_KERNELS_NAME "avx2"
+#elif XXH_VECTOR == XXH_SSE2
+#define HASH_KERNELS_NAME "sse2"
+#elif XXH_VECTOR == XXH_SCALAR
+#define HASH_KERNELS_NAME "scalar"
+#elif XXH_VECTOR == XXH_NEON
+#define HASH_KERNELS_NAME "neon"
+#else
+#define HASH_KERNELS_NAME "simd"
+#endif
+
+extern const HashKernels HASH_KERNELS;
+const HashKernels HASH_KERNELS = {HASH_KERNELS_NAME, hash64, createState, freeState, reset, update, digest,
+		reset64, update64, digest64};
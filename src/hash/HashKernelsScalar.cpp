@@ -0,0 +1,4 @@
+//Plain 64 bit arithmetic, for the comparison
+#define XXH_VECTOR 0 //XXH_SCALAR
+#define HASH_KERNELS hashKernelsScalar
+#include "HashKernelsImpl.h"
@@ -2,8 +2,44 @@
 #include <filesystem>
 #include "DirectoryData.h"
 #include "Compression.h"
+#include "ThreadPool.h"
+#include "Progress.h"
+#include "FileIo.h"
+#include "LogTime.h"
+#include "ContentStore.h"
+#include "hash/HashKernels.h"
+#include "DirWatcher.h"
+#include <chrono>
+#include <csignal>
+#include <ctime>
+#include <sstream>
 
 bool verbose{false};
+//only the requested output on stdout, e.g. for the listing
+bool quiet{false};
+
+namespace
+{
+//--watch stops on SIGINT and SIGTERM after the last incremental archive
+volatile std::sig_atomic_t stopRequested = 0;
+
+//dir_data.bin.<UTC time>, like the volumes the name sorts after dir_data.bin
+std::string incrementalArchiveName()
+{
+	std::time_t now = std::time(nullptr);
+	std::tm utc{};
+	::gmtime_r(&now, &utc);
+	char stamp[32];
+	std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &utc);
+
+	std::string name = std::string("dir_data.bin.") + stamp;
+	for(int n = 2; fs::exists(name); ++n)
+	{
+		name = std::string("dir_data.bin.") + stamp + '-' + std::to_string(n);
+	}
+	return name;
+}
+}
 
 int main(int argc, char* argv[])
 {
@@ -14,18 +50,177 @@ int main(int argc, char* argv[])
 		.default_value(false)
 		.implicit_value(true);
 
+	program.add_argument("--list")
+		.help("list the archive content without extracting")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--verify")
+		.help("check the file checksums stored in the archive, nothing is written")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--grep")
+		.help("print the lines of the archived files containing the pattern as path:line:text, nothing is extracted")
+		.default_value(std::string{});
+
+	program.add_argument("--grep-regex")
+		.help("the --grep pattern is a POSIX extended regular expression")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--from")
+		.help("extract, list or grep only the logs with lines at or after the time: YYYY-MM-DD[THH:MM[:SS]][Z|+HH:MM] or @epoch")
+		.default_value(std::string{});
+
+	program.add_argument("--to")
+		.help("extract, list or grep only the logs with lines at or before the time, files without timestamps are always kept")
+		.default_value(std::string{});
+
+	program.add_argument("--columns")
+		.help("extra list columns, comma separated: size,alias,hash")
+		.default_value(std::string{});
+
+	program.add_argument("--update")
+		.help("unpack only the files that differ from the existing ones, the extra names of a duplicate are compared by content and keep the time of the copy")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--include")
+		.help("extract, list or grep only the paths matching the glob, can be repeated")
+		.default_value(std::vector<std::string>{})
+		.append();
+
+	program.add_argument("--exclude")
+		.help("skip the paths matching the glob, can be repeated")
+		.default_value(std::vector<std::string>{})
+		.append();
+
 	program.add_argument("-c", "--compress")
 		.help("compress the packed archive with zstd")
 		.default_value(false)
 		.implicit_value(true);
 
+	program.add_argument("--frame-size")
+		.help("compressed archives: start a new zstd frame every N MB (0 - single frame)")
+		.default_value(32)
+		.scan<'i', int>();
+
+	program.add_argument("--volumes")
+		.help("spread the file data over N volume files written in parallel (0 - single archive)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--split-size")
+		.help("volume files of at most N MB of file data each (0 - single archive)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--volume-dir")
+		.help("directory for the volumes, can be repeated, used round robin (default: next to the archive)")
+		.default_value(std::vector<std::string>{})
+		.append();
+
+	program.add_argument("-j", "--threads")
+		.help("threads used for decompression (0 - all cores)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--memory-limit")
+		.help("pack with bounded memory, the scan is sorted in temporary files (TMPDIR), limit in MB (0 - off)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--checkpoint")
+		.help("packing: make the archive durable every N MB of file data and record it for --resume (0 - off)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--resume")
+		.help("continue an interrupted packing from its last checkpoint, the scan is not repeated")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--store")
+		.help("content store directory shared by the archives: packing puts the file contents there once, the archive only references them; reading needs it too")
+		.default_value(std::string{});
+
+	program.add_argument("--store-release")
+		.help("the archive no longer references its blobs in the --store, run it before deleting the archive")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--store-gc")
+		.help("remove the blobs no archive references from the content store given instead of the directory")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--watch")
+		.help("packing: after dir_data.bin keep watching the directory with inotify and write the files changed in every N seconds to dir_data.bin.<UTC time>, the changes of a failed one go to the next (0 - off)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("-p", "--physical-order")
+		.help("read the source files in their on-disk order (helps on HDDs)")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("-l", "--hard-links")
+		.help("recreate hard links when unpacking (copies by default)")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("-b", "--byte-verify")
+		.help("confirm duplicates byte by byte, not only by the hash")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--zstd-buffer")
+		.help("compressed archives: buffer size of the zstd streams in KB (0 - the zstd recommended sizes)")
+		.default_value(1024)
+		.scan<'i', int>();
+
+	program.add_argument("--hash-sample")
+		.help("64KB blocks sampled by the partial hash of the duplicate search: head, tail and strided middle ones (1 - head only)")
+		.default_value(6)
+		.scan<'i', int>();
+
+	program.add_argument("--hash-impl")
+		.help("XXH3 variant: auto, avx512, avx2, sse2 or scalar (auto - the best the CPU runs)")
+		.default_value(std::string("auto"));
+
+	program.add_argument("--progress")
+		.help("show the phase, files and bytes done, MB/s and ETA on stderr")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--progress-fd")
+		.help("write the progress as one JSON object per line to the file descriptor")
+		.default_value(-1)
+		.scan<'i', int>();
+
+	program.add_argument("--no-cache-pollution")
+		.help("packing: drop the read source files and the written archive from the page cache")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--bwlimit")
+		.help("packing: limit the source reads and archive writes to N MB/s (0 - unlimited)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--iops-limit")
+		.help("packing: limit the source reads and archive writes to N operations/s (0 - unlimited)")
+		.default_value(0)
+		.scan<'i', int>();
+
 	program.add_argument("-v", "--verbose")
 		.help("display extra messages")
 		.default_value(false)
 		.implicit_value(true);
 
 	program.add_argument("dir_name")
-		.help("The directory to pack or file to unpack").
+		.help("The directory to pack or file to unpack or list").
 		required();
 
 	try
@@ -38,45 +233,297 @@ int main(int argc, char* argv[])
 	}
 
 	//std::string work_dir = program.get<std::string>("dir_name");
-	bool pack = !program.get<bool>("-u");
+	bool list = program.get<bool>("--list");
+	bool verify = program.get<bool>("--verify");
+	auto grepPattern = program.get<std::string>("--grep");
+	bool grep = !grepPattern.empty();
+	bool release = program.get<bool>("--store-release");
+	bool pack = !program.get<bool>("-u") && !list && !verify && !grep && !release;
 	bool compress = program.get<bool>("-c");
+	size_t frameSize = static_cast<size_t>(std::max(program.get<int>("--frame-size"), 0)) << 20U;
+	unsigned numThreads = std::max(program.get<int>("-j"), 0);
+	if(numThreads == 0)
+	{
+		numThreads = ThreadPool::defaultThreads();
+	}
 	verbose = program.get<bool>("-v");
+	quiet = (list || grep) && !verbose;
+
+	auto hashImpl = program.get<std::string>("--hash-impl");
+	if(!HashKernels::select(hashImpl.c_str()))
+	{
+		std::cerr << "Error: hash implementation " << hashImpl << " is not available, this CPU runs: ";
+		HashKernels::printSupported(std::cerr);
+		std::cerr << '\n';
+		return 1;
+	}
+	if(verbose) std::cout << "Hash implementation " << HashKernels::get().name_ << '\n';
+
+	if(program.get<bool>("--store-gc"))
+	{
+		ContentStore store(program.get<std::string>("dir_name"));
+		return (store.open(false) && store.collectGarbage()) ? 0 : 7;
+	}
+
+	DirectoryData::Options options;
+	options.physicalOrder = program.get<bool>("-p");
+	options.hardLinks = program.get<bool>("-l");
+	options.verifyDuplicates = program.get<bool>("-b");
+	int hashSample = program.get<int>("--hash-sample");
+	if(hashSample > static_cast<int>(DirectoryData::Options::MAX_HASH_SAMPLE_BLOCKS))
+	{
+		std::cerr << "Error: --hash-sample is at most " << DirectoryData::Options::MAX_HASH_SAMPLE_BLOCKS << " blocks.\n";
+		return 1;
+	}
+	options.hashSampleBlocks = std::max(hashSample, 1);
+	options.numThreads = numThreads;
+	options.update = program.get<bool>("--update");
+	options.memoryLimit = static_cast<size_t>(std::max(program.get<int>("--memory-limit"), 0)) << 20U;
+
+	options.numVolumes = std::max(program.get<int>("--volumes"), 0);
+	options.splitSize = static_cast<uint64_t>(std::max(program.get<int>("--split-size"), 0)) << 20U;
+	options.volumeDirs = program.get<std::vector<std::string>>("--volume-dir");
+	options.checkpointInterval = static_cast<uint64_t>(std::max(program.get<int>("--checkpoint"), 0)) << 20U;
+	options.compress = compress;
+	options.frameSize = frameSize;
+	options.zstdBufferSize = static_cast<size_t>(std::max(program.get<int>("--zstd-buffer"), 0)) << 10U;
+	options.storeDir = program.get<std::string>("--store");
+
+	if(options.numVolumes > 0 && options.splitSize > 0)
+	{
+		std::cerr << "Error: --volumes and --split-size cannot be used together.\n";
+		return 1;
+	}
+
+	options.grepPattern = grepPattern;
+	options.grepRegex = program.get<bool>("--grep-regex");
+
+	for(const auto& [name, pTime] : {std::make_pair("--from", &options.timeFrom), std::make_pair("--to", &options.timeTo)})
+	{
+		auto text = program.get<std::string>(name);
+		if(!text.empty() && !LogTime::parseArgument(text, *pTime))
+		{
+			std::cerr << "Error: " << name << " " << text << " is not a time.\n";
+			return 1;
+		}
+	}
+
+	options.includes = program.get<std::vector<std::string>>("--include");
+	options.excludes = program.get<std::vector<std::string>>("--exclude");
+
+	std::istringstream columns(program.get<std::string>("--columns"));
+	for(std::string column; std::getline(columns, column, ',');)
+	{
+		if(column == "size") options.listSize = true;
+		else if(column == "alias") options.listAliases = true;
+		else if(column == "hash") options.listHash = true;
+		else
+		{
+			std::cerr << "Error: unknown column '" << column << "', the columns are size, alias and hash.\n";
+			return 1;
+		}
+	}
+
+	//the volumes are found next to the archive
+	if(!pack)
+	{
+		options.archivePath = program.get<std::string>("dir_name");
+	}
 
 	DirectoryData dd;
+	dd.setOptions(options);
 
-	static constexpr std::array<char, 7> MAGIC_NUMBER_COMPRESS = {'M','Y','D','I','R','X','X'};
+	//the listing has nothing long running to report
+	if(!list)
+	{
+		static constexpr unsigned PROGRESS_INTERVAL_MS = 1000;
+		progress.start(program.get<bool>("--progress"), program.get<int>("--progress-fd"), PROGRESS_INTERVAL_MS);
+	}
 
 	if(pack)
 	{
-		if (!dd.preProcessSourceDir(program.get<std::string>("dir_name")))
+		IoThrottle::Limits limits;
+		limits.dropCache = program.get<bool>("--no-cache-pollution");
+		limits.bytesPerSecond = static_cast<uint64_t>(std::max(program.get<int>("--bwlimit"), 0)) << 20U;
+		limits.opsPerSecond = std::max(program.get<int>("--iops-limit"), 0);
+		ioThrottle.setLimits(limits);
+
+		//the watches are set before the scan, nothing written meanwhile is missed
+		int watchSeconds = std::max(program.get<int>("--watch"), 0);
+		std::unique_ptr<DirWatcher> pWatcher;
+		if(watchSeconds > 0)
+		{
+			pWatcher = std::make_unique<DirWatcher>();
+			if(!pWatcher->start(program.get<std::string>("dir_name")))
+			{
+				return 2;
+			}
+		}
+
+		if(program.get<bool>("--resume"))
+		{
+			if(!dd.resumeFromCheckpoint(program.get<std::string>("dir_name")))
+			{
+				return 2;
+			}
+			compress = dd.options().compress;
+			frameSize = dd.options().frameSize;
+		}
+		else if (!dd.preProcessSourceDir(program.get<std::string>("dir_name")))
 		{
 			std::cerr << "Error: Processing source dir failed!\n";
 			return 2;
 		}
 
-		std::ofstream out("dir_data.bin", std::ios::binary | std::ios::trunc);
+		//written under a temporary name, the archive appears only after its
+		//store references are recorded. A resumed one continues that file.
+		auto writeArchive = [&](DirectoryData& archiveData, const std::string& archiveName)
+		{
+			std::string partName = archiveName + ".part";
+			ArchiveFile out(partName, archiveData.resumeOffset());
 
-		if (!out) {
-			std::cerr << "Error: Failed to open file!\n";
-			return 3;
-		}
+			if (!out) {
+				std::cerr << "Error: Failed to open file!\n";
+				return 3;
+			}
 
-		if(compress)
-		{
-			std::cout << "Compression on.\n";
-			out.write(MAGIC_NUMBER_COMPRESS.data(), MAGIC_NUMBER_COMPRESS.size());
+			//with compression on every written byte goes through zstd
+			progress.setPhase(compress ? Progress::Phase::COMPRESS : Progress::Phase::WRITE);
+
+			bool writtenOk = false;
+			if(compress)
+			{
+				std::cout << "Compression on.\n";
+				if(archiveData.resumeOffset() == 0)
+				{
+					out.write(MAGIC_NUMBER_COMPRESS.data(), MAGIC_NUMBER_COMPRESS.size());
+				}
+
+				//a resumed archive gets new frames after the last complete one
+				ZstdOStreamBuf zstdStrBuff(out, frameSize, options.zstdBufferSize);
+				std::ostream outCompress(&zstdStrBuff);
+				archiveData.setCheckpointSync([&](uint64_t& size)
+					{
+						return outCompress.flush() && zstdStrBuff.closeFrame() && out.syncToDisk(size);
+					});
+				writtenOk = archiveData.write(outCompress);
+			}
+			else
+			{
+				archiveData.setCheckpointSync([&out](uint64_t& size) { return out.syncToDisk(size); });
+				writtenOk = archiveData.write(out);
+			}
 
-			ZstdOStreamBuf zstdStrBuff(out);
-			std::ostream outCompress(&zstdStrBuff);
-			dd.write(outCompress);
+			out.close();
+
+			if(!writtenOk || !out)
+			{
+				std::cerr << "Error: Writing " << archiveName << " failed!\n";
+				return 6;
+			}
+
+			archiveData.finishCheckpoint();
+			if(!archiveData.addStoreReferences())
+			{
+				return 6;
+			}
+
+			std::error_code ec;
+			fs::rename(partName, archiveName, ec);
+			if(ec)
+			{
+				std::cerr << "Error: Renaming " << partName << " to " << archiveName << " failed: " << ec.message() << '\n';
+				return 6;
+			}
+			std::cout << "Data written to " << archiveName << "\n";
+			return 0;
+		};
+
+		int ret = writeArchive(dd, "dir_data.bin");
+		if(ret != 0)
+		{
+			return ret;
 		}
-		else
+
+		//--watch: the files changed in each interval go to a small archive
+		//named by the time, until SIGINT or SIGTERM. Extracted in the name
+		//order after dir_data.bin they give the latest state of the files.
+		if(pWatcher)
 		{
-			dd.write(out);
+			struct sigaction action{};
+			action.sa_handler = [](int) { stopRequested = 1; };
+			//no SA_RESTART, the signal interrupts the waiting
+			::sigaction(SIGINT, &action, nullptr);
+			::sigaction(SIGTERM, &action, nullptr);
+
+			//the incremental archives are small, scanned in memory
+			auto watchOptions = options;
+			watchOptions.memoryLimit = 0;
+			watchOptions.checkpointInterval = 0;
+
+			auto interval = std::chrono::seconds(watchSeconds);
+			auto nextArchive = std::chrono::steady_clock::now() + interval;
+			bool stopping = false;
+			while(!stopping)
+			{
+				stopping = stopRequested;
+				auto now = std::chrono::steady_clock::now();
+				int waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(nextArchive - now).count();
+				if(!pWatcher->poll(stopping ? 0 : std::max(waitMs, 0)) || pWatcher->rootLost())
+				{
+					std::cerr << "Error: Watching the changes failed!\n";
+					return 8;
+				}
+				if(!stopping && std::chrono::steady_clock::now() < nextArchive)
+				{
+					continue;
+				}
+				nextArchive += interval;
+
+				bool fullScan = pWatcher->overflowed();
+				auto changes = pWatcher->takeChanges();
+				if(changes.empty() && !fullScan)
+				{
+					continue;
+				}
+
+				//the volumes of the increment are named after it, not after dir_data.bin
+				auto archiveName = incrementalArchiveName();
+				watchOptions.archivePath = archiveName;
+				DirectoryData incremental;
+				incremental.setOptions(watchOptions);
+				if(!(fullScan ? incremental.preProcessSourceDir(program.get<std::string>("dir_name"))
+						: incremental.preProcessChangedFiles(program.get<std::string>("dir_name"), changes)))
+				{
+					std::cerr << "Error: Processing the changed files failed!\n";
+					ret = 2;
+				}
+				else
+				{
+					ret = writeArchive(incremental, archiveName);
+				}
+
+				if(ret == 0)
+				{
+					continue;
+				}
+
+				//a file rotated or truncated meanwhile fails the archive, its
+				//changes are tried again in the next one. Only a lost watch
+				//directory or the last archive before stopping ends the loop.
+				std::error_code ec;
+				fs::remove(archiveName + ".part", ec);
+				incremental.discardWritten();
+				if(stopping || pWatcher->rootLost() || !fs::is_directory(program.get<std::string>("dir_name"), ec))
+				{
+					return ret;
+				}
+				std::cerr << "Warning: " << archiveName << " was not written, its changes go to the next archive.\n";
+				pWatcher->requeue(changes, fullScan);
+			}
 		}
 
-		out.close();
-		std::cout << "Data written to dir_data.bin\n";
+		progress.stop();
 	}
 	else
 	{
@@ -96,6 +543,15 @@ int main(int argc, char* argv[])
 			return 3;
 		}
 
+		auto readArchive = [&](std::istream& archive)
+		{
+			if(list) return dd.list(archive);
+			if(verify) return dd.verify(archive);
+			if(grep) return dd.grep(archive);
+			if(release) return dd.releaseStore(archive);
+			return dd.read(archive);
+		};
+
 		bool decompress = false;
 		{
 			std::array<char, MAGIC_NUMBER_COMPRESS.size()> magicNumBuff{};
@@ -105,11 +561,19 @@ int main(int argc, char* argv[])
 
 		if(decompress)
 		{
-			std::cout << "Data compressed.\n";
-			ZstdIStreamBuf zstdStrBuff(in);
-			std::istream inDecompress(&zstdStrBuff);
+			if(!quiet) std::cout << "Data compressed.\n";
+			std::unique_ptr<std::streambuf> zstdStrBuff;
+			if(numThreads > 1)
+			{
+				zstdStrBuff = std::make_unique<ZstdParallelIStreamBuf>(in, numThreads);
+			}
+			else
+			{
+				zstdStrBuff = std::make_unique<ZstdIStreamBuf>(in, options.zstdBufferSize);
+			}
+			std::istream inDecompress(zstdStrBuff.get());
 
-			if(!dd.read(inDecompress))
+			if(!readArchive(inDecompress))
 			{
 				std::cerr << "Error: Failed to read compressed file!\n";
 				return 5;
@@ -117,12 +581,12 @@ int main(int argc, char* argv[])
 		}
 		else
 		{
-			std::cout << "Data not compressed.\n";
+			if(!quiet) std::cout << "Data not compressed.\n";
 			//Not comressed file so moving to start so the 
 			//read can check the standard magic number
 			in.clear();
 			in.seekg(0);
-			if(!dd.read(in))
+			if(!readArchive(in))
 			{
 				std::cerr << "Error: Failed to read file!\n";
 				return 4;
@@ -130,9 +594,10 @@ int main(int argc, char* argv[])
 		}
 
 		in.close();
+		progress.stop();
 	}
 
-	std::cout << "Done.\n";
+	if(!quiet) std::cout << "Done.\n";
 
 	return 0;
 }